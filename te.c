@@ -5,13 +5,35 @@ compile with dcc for NitrOS-9
 dcc te.c -m=2k
 on some systems you may need:
 env -u LD_PRELOAD dcc te.c -m=2k
+host build (Linux/ANSI terminal, for profiling):
+cc -Dposix te.c -o te
  */
 
 #include <stdlib.h>
 #include <stdio.h>
+#ifdef posix
+#include <string.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <signal.h>
+
+struct termios oldstat;
+#else
 #include <sgstat.h>
 
 struct sgbuf oldstat;
+#endif
+
+/* No F256 custom font on the CoCo3 or the host */
+#ifdef coco3
+#define nofont
+#endif
+#ifdef posix
+#define nofont
+#endif
 
 #define SS_OPT 0
 
@@ -30,6 +52,177 @@ struct sgbuf oldstat;
 /* Convert logical text row to physical display row for double-spacing */
 #define PHYS_ROW(lr) (text_start_row + ((lr) * (dbl_space ? 2 : 1)))
 
+/* Keyboard batch - all bytes that are ready come in with one read when
+ * no key is held down.  With Ctrl, Alt, Shift or an arrow down each read
+ * takes one byte, so each key gets the status it was typed with. */
+#define KEY_BATCH   64
+unsigned char key_buf[KEY_BATCH];
+int key_cnt;             /* Bytes in key_buf */
+int key_nxt;             /* Next byte to hand out */
+int key_sts;             /* Modifier status for this batch */
+long in_calls;           /* Input system calls that delivered keys */
+long in_polls;           /* Input polls that found nothing */
+long key_count;          /* Key events handed to the main loop */
+
+/* Key event files - two bytes per key, KySns status then character,
+ * as inkey() returns them.  -rec writes one, -script replays one with
+ * the terminal output going to -cap (or nowhere) on a fixed 80x24. */
+FILE *scr_fp;            /* -script: events to replay */
+FILE *rec_fp;            /* -rec: events being recorded */
+FILE *cap_fp;            /* -cap: replay output, NULL = discard */
+long scr_t0;             /* tm_us() when the replay started */
+
+/* Event loop timers - the loop sleeps until a key arrives or the
+ * earliest armed timer is due.  Times are ms on the tm_now() clock. */
+#define TM_MSG      0    /* Status message expiry */
+#define TM_SAVE     1    /* Autosave of an edited buffer */
+#define TM_IDLE     2    /* Idle work once the keys stop */
+#define TM_NUM      3
+#define MSG_MS      3000L
+#define IDLE_MS     1000L
+long tm_due[TM_NUM];     /* Due time, 0 = not armed */
+long save_ms;            /* -save interval, 0 = no autosave */
+int as_dirty;            /* Edited since the last autosave */
+long ev_waits;           /* Times the loop went to sleep */
+long ev_late;            /* Worst timer lateness in ms */
+#ifndef posix
+#define TICK_MS     16   /* 60Hz system tick */
+#define IDLE_TICKS  30   /* Longest sleep - bounds a lost wake-up */
+long clk_ms;             /* Advanced by the time spent asleep */
+#endif
+
+/* Idle tasks - resumable scans run one slice at a time while no key is
+ * pending.  A slice covers at most IT_BYTES of the buffer, so a key
+ * waits for one slice at worst.  An edit before a task's position
+ * restarts it. */
+#define IT_LINES    0    /* Count lines after a load or bulk edit */
+#define IT_HASH     1    /* Checksum for autosave */
+#define IT_TRIG     2    /* Index blocks staled by edits - a block a slice */
+#define IT_NUM      3
+#define IT_BYTES    1024
+int it_on[IT_NUM];       /* Task pending */
+int it_pos[IT_NUM];      /* Where the next slice starts */
+long it_acc[IT_NUM];     /* Running count or hash */
+long it_runs[IT_NUM];    /* Slices run */
+long it_us[IT_NUM];      /* Time in slices, host only */
+char *it_name[IT_NUM] = {"lines", "hash", "index"};
+int hs_save;             /* Hash was started by the autosave timer */
+long as_hash;            /* Hash of the text last saved or autosaved */
+int dbg_ovl;             /* -dbg: idle task totals replace the title */
+
+#ifdef posix
+/* Host raw mode: no echo, no signals, no flow control; Enter stays CR */
+set_raw_mode()
+{
+    struct termios raw;
+
+    tcgetattr(0, &oldstat);
+    memcpy(&raw, &oldstat, sizeof(raw));
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_iflag &= ~(IXON | ICRNL | INLCR);
+    raw.c_oflag &= ~OPOST;  /* Output bytes exactly as the backend sends */
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(0, TCSANOW, &raw);
+}
+
+restore_mode()
+{
+    tcsetattr(0, TCSANOW, &oldstat);
+}
+
+/* No SS.KySns on the host - modifiers come from the escape sequence */
+int get_kysns(path)
+int path;
+{
+    return 0;
+}
+
+/* Read every byte that is ready (waiting up to ms), 0 if none */
+key_fill(ms)
+int ms;
+{
+    fd_set rd;
+    struct timeval tv;
+    int n;
+
+    if (key_nxt < key_cnt) return 1;
+    FD_ZERO(&rd);
+    FD_SET(0, &rd);
+    tv.tv_sec = 0;
+    tv.tv_usec = ms * 1000L;
+    if (select(1, &rd, NULL, NULL, &tv) <= 0) {
+        in_polls++;
+        return 0;
+    }
+    in_calls += 2;
+    n = read(0, key_buf, KEY_BATCH);
+    if (n <= 0) return 0;
+    key_cnt = n;
+    key_nxt = 0;
+    return 1;
+}
+
+/* Sleep until a key is ready or ms pass, ms < 0 waits for a key.
+ * SIGWINCH also ends the wait. */
+key_wait(ms)
+long ms;
+{
+    fd_set rd;
+    struct timeval tv;
+
+    if (key_nxt < key_cnt) return;
+    FD_ZERO(&rd);
+    FD_SET(0, &rd);
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000L;
+    ev_waits++;
+    select(1, &rd, NULL, NULL, ms < 0 ? NULL : &tv);
+}
+
+/* Microseconds since the first call */
+long tm_us()
+{
+    struct timeval tv;
+    static long base;
+
+    gettimeofday(&tv, NULL);
+    if (base == 0) base = tv.tv_sec;
+    return (tv.tv_sec - base) * 1000000L + tv.tv_usec;
+}
+
+/* Milliseconds on the same clock */
+long tm_now()
+{
+    return tm_us() / 1000;
+}
+
+/* Screen size from the tty */
+int get_cols()
+{
+    struct winsize ws;
+
+    if (ioctl(1, TIOCGWINSZ, &ws) < 0 || ws.ws_col == 0) return 80;
+    return ws.ws_col;
+}
+
+int get_rows()
+{
+    struct winsize ws;
+
+    if (ioctl(1, TIOCGWINSZ, &ws) < 0 || ws.ws_row == 0) return 24;
+    return ws.ws_row;
+}
+
+int write_block(path, buffer, len)
+int path, len;
+char *buffer;
+{
+    if (len <= 0) return 0;
+    return write(path, buffer, len);
+}
+
+#else
 /* Call this at editor startup - DISABLE ECHO completely */
 set_raw_mode()
 {
@@ -75,6 +268,7 @@ _kysns_end:
 }
 
 
+/* Bytes waiting on path, 0 if none */
 int kbhit(path)
 int path;
 {
@@ -86,7 +280,7 @@ int path;
  ldd #0         * Return 0 on error (no data ready)
  bra _ready_end
 _ready_ok:
- ldd #1         * Return 1 on success (data ready)
+ clra           * B = bytes ready
 _ready_end:
 #endasm
 }
@@ -128,19 +322,106 @@ _r_end2:
 #endasm
 }
 
+/* Read every byte that is ready with one I$Read if SS.KySns shows no
+ * key held, else just one.  SCF would block for a full count, so ask
+ * SS.Ready how many there are. */
+key_fill(ms)
+int ms;
+{
+    int n;
+
+    if (key_nxt < key_cnt) return 1;
+    n = kbhit(0);
+    if (n <= 0) {
+        in_polls++;
+        return 0;
+    }
+    if (n > KEY_BATCH) n = KEY_BATCH;
+    key_sts = get_kysns(0);
+    if (key_sts != 0) n = 1;    /* Its status would be wrong for the rest */
+    in_calls += 3;
+    n = read(0, key_buf, n);
+    if (n <= 0) return 0;
+    key_cnt = n;
+    key_nxt = 0;
+    return 1;
+}
+
+/* Sleep up to ticks (0 = until a signal), returns the ticks left */
+int tk_sleep(ticks)
+int ticks;
+{
+#asm
+ ldx 4,s        * Ticks to sleep
+ os9 $0A        * F$Sleep
+ tfr x,d        * Ticks left if woken early
+#endasm
+}
+
+/* Have SCF send signal sig when input is ready on path */
+ss_ssig(path, sig)
+int path, sig;
+{
+#asm
+ lda 5,s        * Path
+ ldb #$1A       * SS.SSig code ($1A)
+ ldx 6,s        * Signal to send
+ os9 $8E        * I$SetStt system call
+#endasm
+}
+
+/* Cancel an SS.SSig that has not fired */
+ss_rel(path)
+int path;
+{
+#asm
+ lda 5,s        * Path
+ ldb #$1B       * SS.Relea code ($1B)
+ os9 $8E        * I$SetStt system call
+#endasm
+}
+
+/* Sleep until a key is ready or ms pass, ms < 0 waits for a key.
+ * SCF wakes us with S$Wake, which needs no intercept routine.  A key
+ * that lands between the SS.Ready check and SS.SSig is signalled at
+ * once; IDLE_TICKS caps the sleep in case a wake-up is ever lost. */
+key_wait(ms)
+long ms;
+{
+    int ticks;
+
+    if (key_nxt < key_cnt || kbhit(0) > 0) return;
+    ticks = IDLE_TICKS;
+    if (ms >= 0 && ms / TICK_MS < IDLE_TICKS) ticks = ms / TICK_MS + 1;
+    ev_waits++;
+    ss_ssig(0, 1);
+    ticks -= tk_sleep(ticks);
+    ss_rel(0);
+    clk_ms += (long)ticks * TICK_MS;
+}
+
+/* Milliseconds asleep - F$Time only has seconds, and the timers
+ * only need to measure idle time */
+long tm_now()
+{
+    return clk_ms;
+}
+
+/* No finer clock - time spent awake is not measured */
+long tm_us()
+{
+    return clk_ms * 1000L;
+}
+
 /* OS-9 immediate keyboard input with F256 arrow key support */
 int inkey()
 {
-    char ch;
-    int key_status;
-    if (kbhit(0)){
-	if (read(0, &ch, 1) > 0) {
-	  /* Get keyboard status for stdin (path 0) */
-	  key_status = get_kysns(0);
-	  return (key_status << 8) | (ch & 0xFF);
-	}
-      }
-    return 0;
+    /* Queued screen output goes out before waiting for more keys; keys
+       already read in this batch are handled first */
+    if (key_nxt >= key_cnt) term_flsh();
+    if (!key_fill(0)) return 0;
+    key_count++;
+    return (key_sts << 8) | key_buf[key_nxt++];
 }
 
 int write_block(path, buffer, len)
@@ -182,6 +463,7 @@ _write_zero:
 _write_end:
 #endasm
 }
+#endif
 
 
 
@@ -198,6 +480,14 @@ _write_end:
 #define KEY_C_X         24   /* Ctrl+X for CUT */
 #define KEY_C_Z         26   /* Ctrl+Z for UNDO */
 #define KEY_C_Y         25   /* Ctrl+Y for REDO */
+#define KEY_C_R         18   /* Ctrl+R to record a macro */
+#define KEY_C_E         5    /* Ctrl+E to play it */
+#define KEY_C_B         2    /* Ctrl+B to find backward */
+#define KEY_C_T         20   /* Ctrl+T to toggle case in searches */
+#define KEY_C_W         23   /* Ctrl+W to toggle whole words */
+#define KEY_C_N         14   /* Ctrl+N to replace */
+#define KEY_C_K         11   /* Ctrl+K to toggle regular expressions */
+#define KEY_C_O         15   /* Ctrl+O to change the search scope */
 #define KEY_ENTER       13
 #define KEY_TAB         9
 
@@ -242,7 +532,11 @@ _write_end:
 
 /* Buffer and screen constants */
 #define BUF_SIZE        16384
-#define MAX_UNDO        50
+#ifdef posix
+#define MAX_UNDO        4096  /* Undo levels - a power of two, for UNDO_AT() */
+#else
+#define MAX_UNDO        64
+#endif
 #define MAX_SEARCH      32    /* Search string length */
 
 /* F256 keyboard status bits (KySns register) */
@@ -255,6 +549,180 @@ _write_end:
 #define RIGHTBIT        0x40    /* Bit 6 = Right Arrow */
 #define SPACE_BIT       0x80    /* Bit 7 = Spacebar */
 
+/* Key map - key_map[mods][code] is the command for a key.  mods is
+ * KM_SHIFT | KM_CTRL; arrows, told apart by their KySns bit, get codes
+ * VK_UP..VK_RIGHT past the character codes.  The F256 and CoCo3 layouts
+ * differ only in the KEY_ codes that key_defs[] is written in. */
+#define KM_SHIFT        1
+#define KM_CTRL         2
+#define KM_NUM          4
+#define VK_UP           256
+#define VK_DOWN         257
+#define VK_LEFT         258
+#define VK_RIGHT        259
+#define KEY_CODES       260
+
+/* Commands - index into cm_fn[], cm_name[] and cm_cnt[] */
+#define CM_NONE         0
+#define CM_INS          1    /* Printable character */
+#define CM_TAB          2
+#define CM_CR           3
+#define CM_LF           4
+#define CM_UP           5
+#define CM_DOWN         6
+#define CM_LEFT         7
+#define CM_RIGHT        8
+#define CM_S_UP         9    /* Extend selection */
+#define CM_S_DOWN       10
+#define CM_S_LEFT       11
+#define CM_S_RIGHT      12
+#define CM_SW_LEFT      13   /* Extend selection by word */
+#define CM_SW_RIGHT     14
+#define CM_W_LEFT       15
+#define CM_W_RIGHT      16
+#define CM_PG_UP        17
+#define CM_PG_DOWN      18
+#define CM_QUIT         19
+#define CM_SAVE         20
+#define CM_FIND         21
+#define CM_GOTO         22
+#define CM_HELP         23
+#define CM_SELALL       24
+#define CM_COPY         25
+#define CM_CUT          26
+#define CM_PASTE        27
+#define CM_UNDO         28
+#define CM_SINGLE       29
+#define CM_DOUBLE       30
+#define CM_BACK         31
+#define CM_ESC          32
+#define CM_ABORT        33   /* Bare ^C code - exit without saving */
+#define CM_RECORD       34   /* Start/stop macro recording */
+#define CM_PLAY         35   /* Ask for a count and play the macro */
+#define CM_FPREV        36   /* Find previous */
+#define CM_CASE         37   /* Toggle ignore case */
+#define CM_WORD         38   /* Toggle whole words */
+#define CM_REPL         39   /* Replace */
+#define CM_REGEX        40   /* Toggle regular expressions */
+#define CM_SCOPE        41   /* Next search scope */
+#define CM_REDO         42
+#define CM_NUM          43
+
+unsigned char key_map[KM_NUM][KEY_CODES];
+long cm_cnt[CM_NUM];     /* Times each command ran, for -log */
+
+/* Keyboard macro - the key events recorded between two Ctrl+R */
+#define MAC_MAX         128
+int mac_buf[MAC_MAX];
+int mac_len;
+int mac_rec;             /* Recording */
+int mac_run;             /* Playing - upd_fast() only tracks the view */
+
+struct KeyDef {
+    unsigned char kd_mod;
+    int kd_key;
+    char kd_cmd;
+};
+
+/* Default bindings - key_init() loads them into key_map */
+struct KeyDef key_defs[] = {
+    {0, KEY_TAB, CM_TAB}, {KM_SHIFT, KEY_TAB, CM_TAB},
+    {KM_CTRL, KEY_TAB, CM_TAB}, {KM_SHIFT | KM_CTRL, KEY_TAB, CM_TAB},
+    {0, KEY_ENTER, CM_CR}, {KM_CTRL, KEY_ENTER, CM_CR},
+    {KM_SHIFT, KEY_ENTER, CM_LF}, {KM_SHIFT | KM_CTRL, KEY_ENTER, CM_LF},
+    {0, VK_UP, CM_UP}, {0, VK_DOWN, CM_DOWN},
+    {0, VK_LEFT, CM_LEFT}, {0, VK_RIGHT, CM_RIGHT},
+    {KM_SHIFT, VK_UP, CM_S_UP}, {KM_SHIFT, VK_DOWN, CM_S_DOWN},
+    {KM_SHIFT, VK_LEFT, CM_S_LEFT}, {KM_SHIFT, VK_RIGHT, CM_S_RIGHT},
+    {KM_SHIFT | KM_CTRL, VK_UP, CM_S_UP}, {KM_SHIFT | KM_CTRL, VK_DOWN, CM_S_DOWN},
+    {KM_SHIFT | KM_CTRL, VK_LEFT, CM_SW_LEFT},
+    {KM_SHIFT | KM_CTRL, VK_RIGHT, CM_SW_RIGHT},
+    {KM_CTRL, VK_LEFT, CM_W_LEFT}, {KM_CTRL, VK_RIGHT, CM_W_RIGHT},
+    {KM_CTRL, VK_UP, CM_PG_UP}, {KM_CTRL, VK_DOWN, CM_PG_DOWN},
+    {KM_CTRL, KEY_C_Q, CM_QUIT}, {KM_CTRL, KEY_C_S, CM_SAVE},
+    {KM_CTRL, KEY_C_F, CM_FIND}, {KM_CTRL, KEY_C_G, CM_GOTO},
+    {KM_CTRL, KEY_C_H, CM_HELP}, {KM_CTRL, KEY_C_A, CM_SELALL},
+    {KM_CTRL, KEY_C_C, CM_COPY}, {KM_CTRL, KEY_C_X, CM_CUT},
+    {KM_CTRL, KEY_C_V, CM_PASTE}, {KM_CTRL, KEY_C_Z, CM_UNDO},
+    {KM_CTRL, KEY_C_1, CM_SINGLE}, {KM_CTRL, KEY_C_2, CM_DOUBLE},
+    {KM_CTRL, KEY_C_R, CM_RECORD}, {KM_CTRL, KEY_C_E, CM_PLAY},
+    {KM_CTRL, KEY_C_B, CM_FPREV},
+    {KM_CTRL, KEY_C_T, CM_CASE}, {KM_CTRL, KEY_C_W, CM_WORD},
+    {KM_CTRL, KEY_C_N, CM_REPL}, {KM_CTRL, KEY_C_K, CM_REGEX},
+    {KM_CTRL, KEY_C_O, CM_SCOPE}, {KM_CTRL, KEY_C_Y, CM_REDO},
+    {0, 127, CM_BACK}, {0, KEY_BS, CM_BACK},
+    {0, KEY_ESC, CM_ESC},
+    {0, KEY_C_C, CM_ABORT}, {0, KEY_C_S, CM_SAVE},
+    {0, 0, CM_NONE}
+};
+
+#ifdef posix
+/* Wait up to ms milliseconds for the next input byte, -1 on timeout */
+key_next(ms)
+int ms;
+{
+    if (!key_fill(ms)) return -1;
+    return key_buf[key_nxt++];
+}
+
+/* Decode the rest of an ESC [ or ESC O sequence into F256 status/char */
+key_csi()
+{
+    int ch, num, mod, bits;
+
+    num = 0;
+    mod = 1;
+    while ((ch = key_next(50)) >= 0) {
+        if (ch >= '0' && ch <= '9') {
+            num = num * 10 + ch - '0';
+        } else if (ch == ';') {
+            num = 0;
+        } else {
+            break;
+        }
+    }
+    /* xterm modifier parameter: 1 + (shift=1, alt=2, ctrl=4) */
+    if (num > 1) mod = num;
+    bits = 0;
+    if ((mod - 1) & 1) bits |= SHIFT_BIT;
+    if ((mod - 1) & 2) bits |= ALT_BIT;
+    if ((mod - 1) & 4) bits |= CTRL_BIT;
+
+    if (ch == 'A') return ((bits | UPBIT) << 8) | KEY_UP;
+    if (ch == 'B') return ((bits | DOWNBIT) << 8) | KEY_DOWN;
+    if (ch == 'C') return ((bits | RIGHTBIT) << 8) | KEY_RIGHT;
+    if (ch == 'D') return ((bits | LEFTBIT) << 8) | KEY_LEFT;
+    return 0;  /* Unmapped sequence (Home, Delete, F-keys...) */
+}
+
+term_flsh();  /* output layer, further down */
+
+/* Host keyboard: map bytes and ANSI sequences to what SS.KySns would give */
+int inkey()
+{
+    int ch;
+
+    /* Queued screen output goes out before waiting for more keys; keys
+       already read in this batch are handled first */
+    if (key_nxt >= key_cnt) term_flsh();
+    ch = key_next(0);
+    if (ch < 0) return 0;
+    key_count++;
+
+    if (ch == 27) {
+        ch = key_next(30);
+        if (ch == '[' || ch == 'O') return key_csi();
+        /* Alt+1/Alt+2 stand in for Ctrl+1/Ctrl+2 */
+        if (ch == '1' || ch == '2') return (CTRL_BIT << 8) | (ch == '1' ? KEY_C_1 : KEY_C_2);
+        return KEY_ESC;
+    }
+    if (ch == KEY_TAB || ch == KEY_ENTER) return ch;
+    if (ch == 10) return (SHIFT_BIT << 8) | KEY_ENTER;  /* Ctrl+J = Shift+Enter */
+    if (ch >= 1 && ch <= 26) return (CTRL_BIT << 8) | ch;
+    return ch;
+}
+#endif
+
 /* Graphics character definitions - 8 bytes each */
 unsigned char topleftbc[8] = {0x00,0x00,0x00,0x1F,0x18,0x1F,0x18,0x18};
 unsigned char toprigtbc[8] = {0x00,0x00,0x00,0xF8,0x18,0xF8,0x18,0x18};
@@ -294,6 +762,22 @@ init_chars()
     newchars[12] = rgtarr;
 }
 
+#ifdef posix
+/* Host terminals have no loadable font */
+int getfntch(charnum, buffer)
+int charnum;
+char *buffer;
+{
+    return -1;
+}
+
+int setfntch(charnum, buffer)
+int charnum;
+char *buffer;
+{
+    return -1;
+}
+#else
 /* Get font character from OS-9 */
 int getfntch(charnum, buffer)
 int charnum;
@@ -339,6 +823,7 @@ _sfc_ok:
 _sfc_end:
 #endasm
 }
+#endif
 
 /* Install custom characters */
 inst_chr()
@@ -389,7 +874,7 @@ rest_chr()
 }
 
 /* Character codes for use in drawing */
-#ifdef coco3
+#ifdef nofont
 #define CH_TOPLTC  124
 #define CH_TOPRTC  124
 #define CH_TOPBL   45
@@ -399,12 +884,65 @@ rest_chr()
 #define CH_TOPBL   246
 #endif
 
-/* Undo structure */
+/* Undo structure - a span of len bytes inserted or deleted at pos.
+ * Typing and Backspace grow the newest entry while un_open is set; any
+ * other command, a pause of UN_PAUSE ms, or typing a new word closes
+ * it.  Deleted bytes are kept in the arena, ua_buf, at off.  Undone
+ * entries stay in the ring above undo_count for redo until the next
+ * edit; what an undone insert took out of the text waits in rd_buf at
+ * off. */
+#define UNDO_SPAN   64    /* Longest Backspace run in one entry */
+#define UN_PAUSE    1000
 struct UndoEntry {
     int pos;
-    int action;
-    char ch;
+    int action;   /* 0 = span inserted, 1 = span deleted, 2 = replace-all */
+    int len;
+    int grp;      /* Entries with the same nonzero grp undo together */
+    int off;      /* Deleted, or undone - its bytes; -1 = spilled */
 };
+#define UNDO_AT(i) (&buf.undo_buf[(buf.undo_head + (i)) & (MAX_UNDO - 1)])
+int undo_grp;     /* Group for new entries, 0 = none */
+int grp_seq;
+int un_open;      /* The newest entry can still grow */
+int un_skip;      /* A delete was not kept - nor is the insert after it */
+long un_time;     /* When it last did */
+
+/* Redo bytes, a stack - the newest undone entry's are on top */
+#ifdef posix
+#define RD_MAX      BUF_SIZE
+#else
+#define RD_MAX      4096
+#endif
+char *rd_buf;
+int rd_top;
+int rd_lost;      /* They did not fit - no redo */
+
+/* Undo text arena - the bytes of each deleted span still to undo,
+ * oldest first.  One F$AllRAM block, two on the host; when it fills,
+ * the oldest entries are spilled and the bytes of the rest slide down. */
+#ifdef posix
+#define UA_BLKS     2
+#else
+#define UA_BLKS     1
+#endif
+#define UA_MAX      (UA_BLKS * 8192)
+int ua_blk;
+char *ua_buf;     /* NULL = none - deletes cannot be undone */
+int ua_top;
+
+/* Spilled history - the oldest entries, each with its bytes followed
+ * by the entry, a stack from 0 up to sp_top.  A temp
+ * file on the host, 8K F$AllRAM blocks mapped one at a time here.
+ * A delete too big for the arena goes straight on top, its entry kept
+ * in the ring with off -1. */
+#ifdef posix
+FILE *sp_fp;
+#else
+#define SP_BLKS     32
+int sp_blk[SP_BLKS];
+int sp_nblk;
+#endif
+long sp_top;
 
 struct Clipboard {
     int start_block;       /* Block number from F$AllRAM */
@@ -422,7 +960,169 @@ int in_find_mode;        /* Find mode - after finding, ready to find next */
 int in_goto_mode;        /* Goto line mode - typing line number */
 int in_help_mode;        /* Help screen mode - displaying help overlay */
 char temp_search_str[MAX_SEARCH];  /* Current search session input */
+int inc_stk[MAX_SEARCH]; /* Match for each length typed, -1 = none,
+                            -2 = not a regular expression yet */
+int inc_len[MAX_SEARCH]; /* And its length */
+int inc_org;             /* Cursor when the prompt opened */
+int inc_top;             /* And the top of the screen */
+
+/* Replace - Ctrl+N takes the pattern from the Find prompt */
+#define RM_WITH     1    /* Typing the replacement */
+#define RM_ASK      2    /* Asking at each match */
+char rep_str[MAX_SEARCH];
+char *rep_txt;           /* What rep_make() made of it */
+int rep_mode;
+int rep_want;            /* The Find prompt was opened by Ctrl+N */
+int rep_cnt;             /* Replaced so far */
+
+/* Undo log of a replace-all, read back by ru_undo().  Per match: the
+ * length of the untouched run before it (one byte, or 255 and two more),
+ * then with ru_var the lengths it had and has in the same form, then
+ * with ru_case the bytes the match had.  ru_keep() copies it into the
+ * undo arena as its entry's bytes, after a RuHead and ru_pat, and
+ * ru_load() brings it back. */
+#define RU_MAX      4096
+unsigned char *ru_log;
+int ru_len;              /* Bytes used, -1 = too many to undo */
+int ru_cnt;              /* Matches */
+int ru_m;                /* Bytes each match had */
+int ru_r;                /* And has now */
+int ru_case;             /* Matches differ - their bytes are logged */
+int ru_var;              /* Lengths differ - each pair is logged too */
+char ru_pat[MAX_SEARCH]; /* What they all were, unless ru_case */
+struct RuHead {
+    int rh_cnt;
+    int rh_m;
+    int rh_r;
+    int rh_case;
+    int rh_var;
+};
+
+/* Horspool skip table for skip_str - rebuilt only when the pattern or
+ * the search modes change, so Ctrl+F again reuses it */
+unsigned char skip_tab[256];
+unsigned char rskip_tab[256];  /* The same for backward windows */
+char skip_str[MAX_SEARCH];
+unsigned char skip_pat[MAX_SEARCH];  /* skip_str through fold_tab[] */
+int skip_len;
+int skip_last;           /* Shift after checking a window */
+int rskip_first;         /* The same backward */
+int skip_case;           /* sch_case the tables were built for */
+int skip_word;           /* And sch_word */
+int sch_case;            /* Ctrl+T - ignore case */
+int sch_word;            /* Ctrl+W - whole words only */
+unsigned char fold_tab[256];  /* Byte as compared - lower case if sch_case */
+unsigned char wc_tab[256];    /* is_word_char() of each byte */
+int sch_rx;              /* Ctrl+K - regular expressions */
+int skip_rx;             /* sch_rx the tables were built for */
+int sch_len;             /* Length of the match found last */
+
+/* Search scope - Ctrl+O.  The scans only look at sch_lo up to sch_hi,
+ * which is BUF_SIZE when the scope runs to the end of the text. */
+#define SC_CURS     0    /* From the cursor round to it again */
+#define SC_ALL      1    /* The whole buffer from the top */
+#define SC_SEL      2    /* The selection the prompt opened on */
+#define SC_NUM      3
+int sch_scope;
+int sch_lo;
+int sch_hi;
+int sc_beg;              /* That selection, kept in step by sc_edit() */
+int sc_end;
+int sc_have;             /* There is one */
+
+/* Trigram index, -ix.  Bit b of tg_tab[h] is set if a trigram hashing
+ * to h starts in block b of the buffer storage, or within TG_OVL bytes
+ * of the text after it, so every trigram of a match is in the block it
+ * starts in.  The blocks are physical - an edit at the gap stales only
+ * the blocks it wrote, and a move of the gap those it copied across.
+ * Stale blocks are in tg_dirt and are scanned in full until IT_TRIG
+ * rebuilds them.  Letters are indexed in lower case for Ctrl+T. */
+#define TG_BLK      1024
+#define TG_NBLK     (BUF_SIZE / TG_BLK)  /* At most 16 - a bit each */
+#define TG_ALL      0xFFFF
+#define TG_OVL      MAX_SEARCH
+#ifdef posix
+#define TG_NHASH    4096
+#else
+#define TG_NHASH    1024
+#endif
+#define TG_LOW(c)   ((c) >= 'A' && (c) <= 'Z' ? (c) + 32 : (c))
+#define TG_HASH(a, b, c) ((((a) * 31 + (b)) * 31 + (c)) & (TG_NHASH - 1))
+unsigned *tg_tab;        /* TG_NHASH block masks, NULL without -ix */
+unsigned tg_dirt;        /* Blocks not indexed yet */
+unsigned tg_pat[MAX_SEARCH];  /* Hashes of the pattern's trigrams */
+int tg_np;               /* How many - 0 if the index can't help */
+
+/* Regular expressions.  sch_prep() compiles the pattern once into a
+ * program for rx_run(), which moves every live thread of the NFA on a
+ * byte at a time, so no pattern can make it backtrack.  The 6809 gets
+ * the small-memory limits, and on both the capture slots of every
+ * thread are only malloc'd for a replace that uses \1 to \9. */
+#ifdef posix
+#define RX_MAX      128  /* Program steps - under 256 */
+#define RX_NCLS     16   /* [] sets */
+#define RX_NSUB     10   /* \0 to \9 */
+#define RX_OUT      1024 /* Replacement with the groups in */
+#else
+#define RX_MAX      64
+#define RX_NCLS     4
+#define RX_NSUB     4
+#define RX_OUT      256
+#endif
+#define RX_CHR      0    /* The byte arg, through fold_tab[] */
+#define RX_ANY      1    /* Any byte but a line end */
+#define RX_CLS      2    /* A byte in rx_cls[arg] */
+#define RX_BOL      3    /* ^ */
+#define RX_EOL      4    /* $ */
+#define RX_JMP      5
+#define RX_SPLIT    6    /* On at pc + 1, and at arg after it */
+#define RX_LOOP     7    /* On at arg, and at pc + 1 after it */
+#define RX_SAVE     8    /* Note the position in slot arg */
+#define RX_MATCH    9
+#define RR_SCAN     0    /* rx_run() - leftmost match from p on */
+#define RR_AT       1    /* Match at p only */
+#define RR_CAP      2    /* And fill rx_sv[] */
+unsigned char rx_op[RX_MAX];
+unsigned char rx_arg[RX_MAX];
+unsigned char rx_cls[RX_NCLS][32];  /* Bit per byte */
+int rx_len;              /* Steps in the program */
+int rx_ncls;
+int rx_grp;              /* Groups opened so far */
+int rx_nul;              /* Can match without reading a byte */
+char *rx_err;            /* Why the pattern did not compile, or NULL */
+char *rx_p;              /* The compiler's place in it */
+
+/* rx_run() thread lists - the one at rx_at and the next */
+unsigned char rx_tpc[2][RX_MAX];
+int rx_tsp[2][RX_MAX];   /* Where each thread's match started */
+int *rx_tcp;             /* Or all its slots, for RR_CAP */
+int *rx_ts[2];           /* Slots of the two lists */
+int rx_w;                /* Slots per thread */
+int rx_cnt[2];
+int rx_mark[RX_MAX];     /* rx_gen of the list pc went in last */
+int rx_gen;
+int rx_at;               /* Position threads are being added at */
+int rx_pv;               /* Bytes before and at it, -1 = none */
+int rx_c;
+int rx_s0[2 * RX_NSUB];  /* Slots of a new thread */
+int rx_sv[2 * RX_NSUB];  /* And of the RR_CAP match */
+int rx_rw;               /* rep_all() is rewriting - rx_lead is the */
+int rx_lead;             /* old byte before the unread text, -1 = none */
+char rx_out[RX_OUT];
+
+/* Find-all index - every match of the skip tables in order, built by one
+ * scan on the first find and shifted by dmg_text() after that */
+#define FA_MAX      256
+int fa_pos[FA_MAX];
+int fa_len[FA_MAX];      /* Lengths of regular expression matches */
+int fa_cnt;
+int fa_ok;               /* fa_pos[] holds every match */
+int fa_big;              /* Too many to hold - plain scans until rebuilt */
+int fa_show;             /* Visible matches are highlighted */
+int fa_hint;             /* Slot fa_in() answered from last */
 char goto_line_str[8];   /* Line number input (max 9999999) */
+char *goto_pmt;          /* Prompt - the goto mode also reads macro counts */
+int goto_rpt;            /* Number is a macro repeat count */
 int screen_rows;
 int screen_cols;
 int tab_wdth;            /* Configurable tab width (default 8) */
@@ -430,36 +1130,140 @@ int tab_wdth;            /* Configurable tab width (default 8) */
 /* Screen tracking */
 int log_row;         /* Logical text row */
 int cursor_col;
-int cur_end_col;
 int text_start_row;
 int status_row;
 int dbl_space;       /* Double-spacing display flag */
 int eff_rows;        /* Effective text rows (accounting for double-spacing) */
 
-/* Pre-built control sequences for write_block */
-char HIDE_CURSOR[2];
-char SHOW_CURSOR[2];
-char REV_ON[2];
-char REV_OFF[2];
-char CLEAR_EOL[1];
-char ERASE_LINE[1];
-char CLEAR_SCREEN[1];
-char HOME_CURSOR[1];
-char POS_BUF[3];  /* For XY positioning sequences */
+/* Screen size changes - SIGWINCH on the host, SS.ScSiz polls on OS-9
+   from the idle timer */
+#define MIN_COLS    40   /* Room for the status fields */
+#define MIN_ROWS    8
+#ifdef posix
+volatile sig_atomic_t winched;
+#endif
+
+/* Terminal capability codes - index into TermCap.tc_seq */
+#define TC_HIDE     0    /* Hide cursor */
+#define TC_SHOW     1    /* Show cursor */
+#define TC_REVON    2    /* Reverse video on */
+#define TC_REVOFF   3    /* Reverse video off */
+#define TC_CLREOL   4    /* Clear to end of line */
+#define TC_ERASLN   5    /* Erase whole line */
+#define TC_CLRSCR   6    /* Clear screen and home */
+#define TC_HOME     7    /* Home cursor */
+#define TC_CR       8    /* Carriage return - column 0, same row */
+#define TC_LEFT     9    /* Cursor left one column */
+#define TC_RIGHT    10   /* Cursor right one column */
+#define TC_UP       11   /* Cursor up one row */
+#define TC_DOWN     12   /* Cursor down one row */
+#define TC_NL       13   /* Newline - column 0 of the next row */
+#define TC_NUM      14
+
+/* Terminal backend: control sequences plus absolute-move encoding */
+struct TermCap {
+    char *tc_name;
+    char *tc_seq[TC_NUM];  /* "" = not supported */
+    int tc_ansi;         /* 1 = ESC[row;colH, 0 = VTIO $02 col+32 row+32 */
+};
+
+/* OS-9 VTIO display codes - $0D also advances the line, so no bare CR */
+struct TermCap vtio_cap = {
+    "vtio",
+    {"\005\040", "\005\041", "\037\040", "\037\041", "\004", "\003",
+     "\014", "\001", "", "\010", "\006", "\011", "\012", "\015"},
+    0
+};
+
+/* ANSI/VT100 - Linux consoles, xterm, serial terminals */
+struct TermCap ansi_cap = {
+    "ansi",
+    {"\033[?25l", "\033[?25h", "\033[7m", "\033[27m", "\033[K", "\033[2K",
+     "\033[H\033[2J", "\033[H", "\015", "\010", "\033[C", "\033[A", "\033[B",
+     "\015\012"},
+    1
+};
+
+#ifdef posix
+#define DEF_TERM &ansi_cap
+#else
+#define DEF_TERM &vtio_cap
+#endif
+
+struct TermCap *term;    /* Active backend */
+int term_len[TC_NUM];    /* Sequence lengths for the active backend */
+char obuf[256];          /* Output queue - one write per flush */
+int obuf_len;
+int scr_col;             /* Where the terminal cursor is, -1 = unknown */
+int scr_row;
+int term_rev;            /* Reverse video currently on */
+int ov_pos;              /* Buffer pos drawn at scr_col, -1 = unknown */
+long out_bytes;          /* Bytes sent to the terminal */
+long out_calls;          /* Write system calls issued */
 
 /* Screen optimization flags */
-int need_char_update;
-int need_full_redraw;
+int need_full_redraw;    /* Title, text and status - geometry or overlay change */
 int need_status_update;
 int need_title_update;
 int last_cursor_pos;
-int need_minimal_update;
-int need_redraw_down;
-int update_from_pos;
+
+/* Text row damage - see dmg_text() and paint_rows() */
+#define MAX_ROWS    72   /* Tallest text area tracked */
+int row_pos[MAX_ROWS + 1];   /* Buffer pos starting each text row, -1 = past end */
+int rows_top;                /* topscr_pos row_pos[] was built for, -1 = none */
+unsigned char row_bits[(MAX_ROWS + 7) / 8];  /* Rows marked for repaint */
+int dmg_lo;                  /* Changed buffer range, -1 = none */
+int dmg_hi;
+int dmg_delta;               /* Net chars inserted since the last paint */
+int dmg_attr;                /* Damage is highlight only - layout unchanged */
+int rows_drawn;              /* Rows repainted by the last update */
+long full_draws;             /* Whole-screen redraws */
+FILE *log_fp;                /* -log file: rows repainted per command */
+
+/* Status line - fixed fields right of the message, "S:nnnnn L:nnnnn/nnnnn
+ * C:nnn nnK", each rewritten only when its value changes */
+#define SF_SEL      0    /* Selection length with its label, blank if none */
+#define SF_LINE     1
+#define SF_TOT      2
+#define SF_COL      3
+#define SF_SIZE     4
+#define SF_NUM      5
+#define STAT_W      31
+char stat_tpl[] = "        L:     /      C:      K";
+int sf_off[SF_NUM] = {0, 10, 16, 24, 28};
+int sf_wid[SF_NUM] = {7, 5, 5, 3, 2};
+long stat_out;               /* Status line bytes this update */
+
+/* Help line text for each editor mode */
+#define HM_EDIT     0
+#define HM_SEARCH   1
+#define HM_GOTO     2
+#define HM_FIND     3
+#define HM_WITH     4
+#define HM_ASK      5
+char *help_txt[] = {
+    "Ctrl+H for Help",
+#ifdef coco3
+    "Ctrl+B=Back  Ctrl+T=Case  Ctrl+W=Word  Ctrl+K=Regex  Ctrl+O=Scope  F1=Cancel",
+    "Enter a number  Enter=Go  F1=Cancel",
+#else
+    "Ctrl+B=Back  Ctrl+T=Case  Ctrl+W=Word  Ctrl+K=Regex  Ctrl+O=Scope  ESC=Cancel",
+    "Enter a number  Enter=Go  ESC=Cancel",
+#endif
+    "Ctrl+F=Next  Ctrl+B=Previous  Ctrl+N=Replace  Typing exits find mode",
+#ifdef coco3
+    "Type the replacement  Enter=Go  F1=Cancel",
+    "Y=Replace  N=Skip  A=All  F1=Stop"
+#else
+    "Type the replacement  Enter=Go  ESC=Cancel",
+    "Y=Replace  N=Skip  A=All  ESC=Stop"
+#endif
+};
 
 /* Wrap detection globals */
 int total_logical_lines;  /* total logical lines in buffer - tracked incrementally */
 int temp_message_active;  /* 1 = status message clears on next keystroke */
+int msg_exp;              /* A key or TM_MSG - the message shown may go */
 
 /* File pointers */
 char *fname_ptr;
@@ -483,9 +1287,11 @@ struct Buffer {
     int select_end;
     int selecting;
     int selection_anchor;    /* Where selection started */
-    /* Undo system */
+    /* Undo system - a ring, undo_head is the oldest entry */
     struct UndoEntry undo_buf[MAX_UNDO];
+    int undo_head;
     int undo_count;
+    int redo_count;          /* Undone entries after them */
     /* Enhanced caching */
     int ccurs_ln;          /* Current cursor line number */
     int topscr_pos;              /* Buffer position at top of screen */
@@ -505,6 +1311,8 @@ init_ed();
 load_file();
 save_file();
 draw_stat();
+fmt_num();
+write_str();
 main_loop();
 col_adv();
 find_end();
@@ -532,11 +1340,76 @@ ex_wd_left();
 ex_wd_right();
 sel_all();
 copy_sel();
+paste_clipboard();
 del_sel();
 /* Search functions */
 strtsch();
+sch_pmt();
 find_next();
 find_prev();
+sch_prep();
+sch_fwd();
+sch_bwd();
+sch_ok();
+sch_hit();
+sch_next();
+sch_show();
+sch_go();
+inc_step();
+inc_show();
+inc_redo();
+rep_with();
+rep_keys();
+rep_ask();
+rep_end();
+rep_one();
+rep_all();
+rs_copy();
+rs_put();
+ru_add();
+ru_num();
+ru_get();
+ru_undo();
+ru_keep();
+ru_load();
+ru_redo();
+undo_drop();
+sch_wb();
+sch_rgn();
+sc_edit();
+rx_comp();
+rx_alt();
+rx_cat();
+rx_atom();
+rx_set();
+rx_esc();
+rx_emit();
+rx_ins();
+rx_fst();
+rx_add();
+rx_newg();
+rx_pos();
+rx_run();
+rx_fwd();
+rx_bwd();
+rx_subs();
+rx_exp();
+rep_make();
+fa_at();
+fa_build();
+fa_find();
+fa_in();
+fa_edit();
+fa_hide();
+lit_fwd();
+lit_bwd();
+tg_init();
+tg_mark();
+tg_step();
+tg_span();
+unsigned tg_want();
+tg_fwd();
+tg_bwd();
 end_search();
 start_goto();
 end_goto();
@@ -548,7 +1421,19 @@ do_back();
 do_cr_enter();
 do_lf_enter();
 add_undo();
+un_ins();
+un_del();
 do_undo();
+do_redo();
+rd_keep();
+ua_room();
+rd_drop();
+un_spill();
+un_big();
+un_have();
+sp_io();
+sp_drop();
+nl_cnt();
 get_line();
 line_sta();
 line_end();
@@ -568,6 +1453,7 @@ fdwd_end();
 start_sel();
 clr_sel();
 sel_active();
+sel_over();
 search_keys();
 /* Gap Buffer Functions */
 init_gap();
@@ -577,43 +1463,146 @@ move_gap_to();
 ensure_gap_at_cursor();
 gap_has_space();
 gap_size();
+gap_copy();
 set_curs();
 /* Fast display routines */
 fast_show();
 fast_curs();
 fast_scr();
-fast_upd();
-fast_char_upd();
 upd_fast();
-fast_from_pos();
-fast_line();
 init_caches();
+set_rows();
 get_top_pos();
 visln_pre();
 visln_next();
 visln_sta();
-redraw_char_at_screen_pos();
 write_pos();
-calc_end_col();
+term_txt();
+/* Damage tracking */
+dmg_row();
+dmg_all();
+dmg_text();
+dmg_span();
+dmg_rng();
+row_map();
+row_next();
+draw_row();
+paint_rows();
+sel_dmg();
+fit_size();
+chk_size();
+term_rep();
+log_sum();
+/* Event loop */
+key_wait();
+long tm_now();
+tm_set();
+long tm_next();
+tm_run();
+ev_idle();
+write_file();
+auto_sav();
+term_wr();
+scr_key();
+scr_end();
+/* Key dispatch */
+do_key();
+mac_add();
+mac_tog();
+mac_play();
+start_rpt();
+undo_one();
+redo_one();
+key_init();
+key_cmd();
+key_opt();
+sel_jump();
+show_help();
+hide_help();
+long tm_us();
+it_start();
+idle_run();
+it_edit();
+#ifdef posix
+void on_winch();
+#endif
 
 /* Main program */
 main(argc, argv)
 int argc;
 char *argv[];
 {
+    int i;
+    char *fname_arg;
+    
     status_msg = status_storage;
     fname_ptr = buf.filename_storage;
     
+    /* Options: -ansi / -vtio pick the terminal backend,
+       -log <file> records the rows repainted per command,
+       -save <secs> autosaves edits to <file>.sav,
+       -dbg shows idle task times on the title line,
+       -ix keeps a trigram index for Find, built while idle,
+       -key <command> <key> rebinds a key,
+       -rec <file> records the keys, -script <file> replays them
+       headless with the output going to -cap <file> */
+    term = DEF_TERM;
+    fname_arg = NULL;
+    log_fp = NULL;
+    key_init();
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-ansi") == 0) {
+            term = &ansi_cap;
+        } else if (strcmp(argv[i], "-vtio") == 0) {
+            term = &vtio_cap;
+        } else if (strcmp(argv[i], "-log") == 0 && i + 1 < argc) {
+            i++;
+            log_fp = fopen(argv[i], "w");
+        } else if (strcmp(argv[i], "-key") == 0 && i + 2 < argc) {
+            if (!key_opt(argv[i + 1], argv[i + 2])) {
+                fprintf(stderr, "te: bad -key %s %s\n", argv[i + 1], argv[i + 2]);
+                exit(1);
+            }
+            i += 2;
+        } else if (strcmp(argv[i], "-script") == 0 && i + 1 < argc) {
+            i++;
+            scr_fp = fopen(argv[i], "r");
+            if (scr_fp == NULL) {
+                fprintf(stderr, "te: can't open %s\n", argv[i]);
+                exit(1);
+            }
+            scr_t0 = tm_us();
+        } else if (strcmp(argv[i], "-cap") == 0 && i + 1 < argc) {
+            i++;
+            cap_fp = fopen(argv[i], "w");
+        } else if (strcmp(argv[i], "-rec") == 0 && i + 1 < argc) {
+            i++;
+            rec_fp = fopen(argv[i], "w");
+        } else if (strcmp(argv[i], "-dbg") == 0) {
+            dbg_ovl = 1;
+        } else if (strcmp(argv[i], "-ix") == 0) {
+            tg_init();
+        } else if (strcmp(argv[i], "-save") == 0 && i + 1 < argc) {
+            i++;
+            save_ms = atoi(argv[i]) * 1000L;
+        } else {
+            fname_arg = argv[i];
+        }
+    }
+    
     init_ed();
+#ifdef posix
+    signal(SIGWINCH, on_winch);
+#endif
     
     text_ptr = buf.text_storage;
 
     fast_scr();
     
-    if (argc > 1) {
-        strcpy(fname_ptr, argv[1]);      /* Use provided filename */
-        if (load_file(argv[1]) == -1) {  /* File doesn't exist */
-            set_dirty(1);                 /* Mark as new/unsaved file */
+    if (fname_arg != NULL) {
+        strcpy(fname_ptr, fname_arg);      /* Use provided filename */
+        if (load_file(fname_arg) == -1) {  /* File doesn't exist */
+            set_dirty(1);                   /* Mark as new/unsaved file */
         }
     }
     
@@ -642,16 +1631,14 @@ init_caches()
 
 
 
-/* Gap-aware write function */
+/* Gap-aware write function - queues buffer text through term_txt() */
 
 
 write_gap_block(path, start_pos, len)
 int path, start_pos, len;
 {
     int end_pos;
-    int written;
     int gap_st, gap_end, text_len;
-    int aft_st, aft_len;
     int phys_st;
     
     /* Copy struct members to local variables to avoid compiler issues */
@@ -660,7 +1647,6 @@ int path, start_pos, len;
     text_len = buf.text_length;
     
     end_pos = start_pos + len;
-    written = 0;
     
     /* Validate bounds */
     if (start_pos < 0 || start_pos >= text_len) return 0;
@@ -669,154 +1655,448 @@ int path, start_pos, len;
     if (start_pos < gap_st) {
         if (end_pos <= gap_st) {
             /* Entire chunk is before gap - single write */
-            return write_block(path, text_ptr + start_pos, end_pos - start_pos);
+            term_txt(text_ptr + start_pos, end_pos - start_pos);
         } else {
             /* Chunk spans gap - write two parts */
-            written += write_block(path, text_ptr + start_pos, gap_st - start_pos);
-            aft_st = gap_end;
-            aft_len = end_pos - gap_st;
-            written += write_block(path, text_ptr + aft_st, aft_len);
-            return written;
+            term_txt(text_ptr + start_pos, gap_st - start_pos);
+            term_txt(text_ptr + gap_end, end_pos - gap_st);
         }
     } else {
         /* Entire chunk is after gap */
         phys_st = start_pos + (gap_end - gap_st);
-        return write_block(path, text_ptr + phys_st, end_pos - start_pos);
+        term_txt(text_ptr + phys_st, end_pos - start_pos);
     }
+    
+    /* The buffer text continues under the cursor - lets write_pos()
+       cross it by rewriting instead of moving */
+    if (scr_row >= 0) ov_pos = end_pos;
+    return end_pos - start_pos;
 }
 
-redraw_char_at_screen_pos(col, row, buffer_pos)
-int col, row, buffer_pos;
+/* Terminal output layer */
+
+/* Select a terminal backend and cache its sequence lengths */
+term_init(tc)
+struct TermCap *tc;
 {
-    char ch;
-    int was_reversed;
-    was_reversed=0;
-    /* Position cursor at screen location */
-    write_pos(col, row);
+    int i;
     
-    /* Set correct reverse video state */
-    if (buf.selecting && buffer_pos >= buf.select_start && buffer_pos < buf.select_end) {
-      write_block(1,REV_ON,2);  /* Reverse on */
-      was_reversed=1;
-    }     
-    /* Redraw the character */
-    if (buffer_pos < buf.text_length) {
-        ch = gap_char_at(buffer_pos);
-        if (ch >= 32 && ch < 127) {
-            putchar(ch);
-        } else if (ch == 9) {
-            /* Handle tab - might need special logic */
-            putchar(' ');  /* Simplified */
-        }
+    term = tc;
+    for (i = 0; i < TC_NUM; i++) {
+        term_len[i] = strlen(tc->tc_seq[i]);
     }
+    obuf_len = 0;
+    scr_col = -1;
+    scr_row = -1;
+    term_rev = 0;
+    ov_pos = -1;
+}
 
-    if(was_reversed){
-      write_block(1,REV_OFF,2);
+/* One write to the terminal, or to the -script capture sink */
+term_wr(s, len)
+char *s;
+int len;
+{
+    out_calls++;
+    if (scr_fp == NULL) {
+        write_block(1, s, len);
+    } else if (cap_fp != NULL) {
+        fwrite(s, 1, len, cap_fp);
     }
-
-    /* Restore cursor position */
-    write_pos(cursor_col, PHYS_ROW(log_row));
 }
 
-/* Build XY position sequence and write it */
-write_pos(col, row)
-int col, row;
+/* Send queued output to the terminal */
+term_flsh()
 {
-    POS_BUF[0] = 0x02;
-    POS_BUF[1] = col + 0x20;
-    POS_BUF[2] = row + 0x20;
-    write_block(1, POS_BUF, 3);
+    if (obuf_len > 0) {
+        term_wr(obuf, obuf_len);
+        obuf_len = 0;
+    }
 }
 
-/* Get top screen position - always valid in buffer position system */
-get_top_pos()
+/* Queue raw bytes - no cursor tracking */
+term_out(s, len)
+char *s;
+int len;
 {
-    return buf.topscr_pos;
+    out_bytes += len;
+    if (obuf_len + len > sizeof(obuf)) {
+        term_flsh();
+        if (len >= sizeof(obuf)) {
+            term_wr(s, len);
+            return;
+        }
+    }
+    memcpy(obuf + obuf_len, s, len);
+    obuf_len += len;
 }
 
-/* Get character at logical position (gap-aware) */
-char gap_char_at(pos)
-int pos;
+/* Queue visible text and advance the tracked cursor */
+term_txt(s, len)
+char *s;
+int len;
 {
-    if (pos < 0 || pos >= buf.text_length) {
-        return 0;  /* Out of bounds */
-    }
-    
-    if (pos < buf.gap_start) {
-        /* Character is before the gap */
-        return *(text_ptr + pos);
-    } else {
-        /* Character is after the gap - skip over gap */
-        return *(text_ptr + pos + (buf.gap_end - buf.gap_start));
+    term_out(s, len);
+    if (scr_row >= 0) {
+        scr_col += len;
+        /* Terminals differ at the right margin - treat as unknown */
+        if (scr_col >= screen_cols) scr_row = -1;
     }
+    ov_pos = -1;
 }
 
-/* Move gap to specified position */
-move_gap_to(target_pos)
-int target_pos;
+term_chr(ch)
+int ch;
 {
-    int gap_size, move_count, i;
-    int og_start, og_end;
-    og_start = buf.gap_start;
-    og_end = buf.gap_end;
-    
-    /* Validate target position */
-    if (target_pos < 0) target_pos = 0;
-    if (target_pos > buf.text_length) target_pos = buf.text_length;
+    char c;
     
-    /* Already at target position? */
-    if (target_pos == buf.gap_start) return;
+    c = ch;
+    term_txt(&c, 1);
+}
 
-    gap_size = buf.gap_end - buf.gap_start;
+/* Queue n copies of ch - bars and padding of any width */
+term_rep(ch, n)
+int ch, n;
+{
+    char run[16];
+    int i;
     
-    if (target_pos < buf.gap_start) {
-        /* Move gap left - copy text from before gap to after gap */
-        move_count = buf.gap_start - target_pos;
-        
-        /* Move text: [target_pos...gap_start) -> [gap_end-move_count...gap_end) */
-        for (i = 0; i < move_count; i++) {
-            *(text_ptr + buf.gap_end - 1 - i) = *(text_ptr + buf.gap_start - 1 - i);
-        }
-        
-        /* Update gap boundaries */
-        buf.gap_start = target_pos;
-        buf.gap_end = target_pos + gap_size;
-        
-    } else {
-        /* Move gap right - copy text from after gap to before gap */
-        move_count = target_pos - buf.gap_start;
-        
-        /* Move text: [gap_end...gap_end+move_count) -> [gap_start...gap_start+move_count) */
-        for (i = 0; i < move_count; i++) {
-            *(text_ptr + buf.gap_start + i) = *(text_ptr + buf.gap_end + i);
-        }
-        
-        /* Update gap boundaries */
-        buf.gap_start = target_pos;
-        buf.gap_end = target_pos + gap_size;
+    for (i = 0; i < 16 && i < n; i++) {
+        run[i] = ch;
     }
+    while (n > 16) {
+        term_txt(run, 16);
+        n -= 16;
+    }
+    if (n > 0) term_txt(run, n);
 }
 
-/* Ensure gap is at cursor position (for efficient editing) */
-ensure_gap_at_cursor()
+/* Emit a capability and account for its effect on the cursor */
+term_cap(code)
+int code;
 {
-    move_gap_to(buf.cursor_pos);
+    term_out(term->tc_seq[code], term_len[code]);
+    
+    if (code == TC_HIDE || code == TC_SHOW) return;
+    if (code == TC_REVON) {
+        term_rev = 1;
+    } else if (code == TC_REVOFF) {
+        term_rev = 0;
+    } else if (code == TC_CLRSCR || code == TC_HOME) {
+        scr_col = 0;
+        scr_row = 0;
+    } else if (code == TC_ERASLN || code == TC_NL) {
+        scr_row = -1;    /* Column differs by backend / may have scrolled */
+    } else if (code == TC_CR) {
+        scr_col = 0;
+    }
+    ov_pos = -1;
 }
 
-/* Check if gap has space for insertion */
-gap_has_space()
+/* Decimal digits in n (n > 0) */
+num_dig(n)
+int n;
 {
-    return (buf.gap_start < buf.gap_end);
+    int d;
+    
+    d = 1;
+    while (n >= 10) {
+        n = n / 10;
+        d++;
+    }
+    return d;
 }
 
-/* Get current gap size */
+/* ANSI final byte for a counted move ESC [ n X */
+csi_fin(code)
+int code;
+{
+    if (code == TC_UP) return 'A';
+    if (code == TC_DOWN) return 'B';
+    if (code == TC_RIGHT) return 'C';
+    return 'D';
+}
+
+/* Bytes needed to move n cells with a single-step capability */
+step_cost(code, n)
+int code, n;
+{
+    int cost;
+    
+    if (term_len[code] == 0) return 999;  /* Not supported */
+    cost = n * term_len[code];
+    /* ANSI can also say ESC [ n A/B/C/D */
+    if (term->tc_ansi && 3 + num_dig(n) < cost) {
+        cost = 3 + num_dig(n);
+    }
+    return cost;
+}
+
+/* Move n cells with a single-step capability, cheapest encoding */
+step_out(code, n)
+int code, n;
+{
+    char seq[16];
+    
+    if (n <= 0) return;
+    if (term->tc_ansi && 3 + num_dig(n) < n * term_len[code]) {
+        sprintf(seq, "\033[%d%c", n, csi_fin(code));
+        term_out(seq, strlen(seq));
+        return;
+    }
+    while (n-- > 0) {
+        term_out(term->tc_seq[code], term_len[code]);
+    }
+}
+
+/* Is the character at pos drawn without any attribute? */
+cell_plain(pos)
+int pos;
+{
+    if (fa_show && fa_in(pos)) return 0;
+    return !(buf.selecting && pos >= buf.select_start && pos < buf.select_end);
+}
+
+/* Can the n cells right of the cursor be crossed by rewriting them? */
+ov_ok(n)
+int n;
+{
+    int i;
+    char ch;
+    
+    if (ov_pos < 0 || term_rev || ov_pos + n > buf.text_length) return 0;
+    for (i = 0; i < n; i++) {
+        ch = gap_char_at(ov_pos + i);
+        if (ch < 32 || ch >= 127 || !cell_plain(ov_pos + i)) return 0;
+    }
+    return 1;
+}
+
+/* Cursor motion planner - reach (col, row) with the fewest bytes:
+ * absolute position, CR plus moves, relative moves, or overwriting
+ * the text already on screen to the right of the cursor */
+write_pos(col, row)
+int col, row;
+{
+    char seq[32];
+    int best, cost, vcost, hcost, how, over;
+    
+    if (row == scr_row && col == scr_col) return;
+    
+    if (term->tc_ansi) {
+        best = 4 + num_dig(row + 1) + num_dig(col + 1);
+    } else {
+        best = 3;
+    }
+    how = 0;
+    over = 0;
+    
+    if (scr_row >= 0) {
+        vcost = 0;
+        if (row < scr_row) vcost = step_cost(TC_UP, scr_row - row);
+        if (row > scr_row) vcost = step_cost(TC_DOWN, row - scr_row);
+        
+        /* Relative from the current column */
+        hcost = 0;
+        if (col < scr_col) hcost = step_cost(TC_LEFT, scr_col - col);
+        if (col > scr_col) {
+            hcost = step_cost(TC_RIGHT, col - scr_col);
+            if (row == scr_row && col - scr_col < hcost && ov_ok(col - scr_col)) {
+                hcost = col - scr_col;
+                over = 1;
+            }
+        }
+        if (vcost + hcost < best) {
+            best = vcost + hcost;
+            how = 1;
+        }
+        
+        /* Carriage return, then right */
+        cost = vcost + term_len[TC_CR] + (col > 0 ? step_cost(TC_RIGHT, col) : 0);
+        if (term_len[TC_CR] > 0 && cost < best) {
+            best = cost;
+            how = 2;
+        }
+    }
+    
+    if (how == 0) {
+        if (term->tc_ansi) {
+            sprintf(seq, "\033[%d;%dH", row + 1, col + 1);
+            term_out(seq, strlen(seq));
+        } else {
+            seq[0] = 0x02;
+            seq[1] = col + 0x20;
+            seq[2] = row + 0x20;
+            term_out(seq, 3);
+        }
+    } else {
+        if (row < scr_row) step_out(TC_UP, scr_row - row);
+        if (row > scr_row) step_out(TC_DOWN, row - scr_row);
+        if (how == 2) {
+            term_out(term->tc_seq[TC_CR], term_len[TC_CR]);
+            step_out(TC_RIGHT, col);
+        } else if (over) {
+            write_gap_block(1, ov_pos, col - scr_col);
+        } else if (col < scr_col) {
+            step_out(TC_LEFT, scr_col - col);
+        } else {
+            step_out(TC_RIGHT, col - scr_col);
+        }
+    }
+    
+    scr_col = col;
+    scr_row = row;
+    if (!over) ov_pos = -1;
+}
+
+/* Get top screen position - always valid in buffer position system */
+get_top_pos()
+{
+    return buf.topscr_pos;
+}
+
+/* Get character at logical position (gap-aware) */
+char gap_char_at(pos)
+int pos;
+{
+    if (pos < 0 || pos >= buf.text_length) {
+        return 0;  /* Out of bounds */
+    }
+    
+    if (pos < buf.gap_start) {
+        /* Character is before the gap */
+        return *(text_ptr + pos);
+    } else {
+        /* Character is after the gap - skip over gap */
+        return *(text_ptr + pos + (buf.gap_end - buf.gap_start));
+    }
+}
+
+/* Move gap to specified position */
+move_gap_to(target_pos)
+int target_pos;
+{
+    int gap_size, move_count, i;
+    int og_start, og_end;
+    og_start = buf.gap_start;
+    og_end = buf.gap_end;
+    
+    /* Validate target position */
+    if (target_pos < 0) target_pos = 0;
+    if (target_pos > buf.text_length) target_pos = buf.text_length;
+    
+    /* Already at target position? */
+    if (target_pos == buf.gap_start) return;
+
+    gap_size = buf.gap_end - buf.gap_start;
+    
+    if (target_pos < buf.gap_start) {
+        /* Move gap left - copy text from before gap to after gap */
+        move_count = buf.gap_start - target_pos;
+        
+        /* Move text: [target_pos...gap_start) -> [gap_end-move_count...gap_end) */
+        for (i = 0; i < move_count; i++) {
+            *(text_ptr + buf.gap_end - 1 - i) = *(text_ptr + buf.gap_start - 1 - i);
+        }
+        
+        /* Update gap boundaries */
+        buf.gap_start = target_pos;
+        buf.gap_end = target_pos + gap_size;
+        
+    } else {
+        /* Move gap right - copy text from after gap to before gap */
+        move_count = target_pos - buf.gap_start;
+        
+        /* Move text: [gap_end...gap_end+move_count) -> [gap_start...gap_start+move_count) */
+        for (i = 0; i < move_count; i++) {
+            *(text_ptr + buf.gap_start + i) = *(text_ptr + buf.gap_end + i);
+        }
+        
+        /* Update gap boundaries */
+        buf.gap_start = target_pos;
+        buf.gap_end = target_pos + gap_size;
+    }
+    
+    /* The bytes moved now sit in other index blocks */
+    tg_mark(target_pos < og_start ? target_pos : og_start,
+            target_pos < og_start ? og_start : target_pos);
+}
+
+/* Ensure gap is at cursor position (for efficient editing) */
+ensure_gap_at_cursor()
+{
+    move_gap_to(buf.cursor_pos);
+}
+
+/* Check if gap has space for insertion */
+gap_has_space()
+{
+    return (buf.gap_start < buf.gap_end);
+}
+
+/* Get current gap size */
 gap_size()
 {
     return buf.gap_end - buf.gap_start;
 }
 
+/* Copy n bytes from logical pos to d - two runs if they straddle the gap */
+gap_copy(d, pos, n)
+char *d;
+int pos, n;
+{
+    int k;
+    
+    k = buf.gap_start - pos;
+    if (k > n) k = n;
+    if (k > 0) {
+        memcpy(d, text_ptr + pos, k);
+    } else {
+        k = 0;
+    }
+    memcpy(d + k, text_ptr + buf.gap_end + pos + k - buf.gap_start, n - k);
+}
+
 /* Add these functions after the existing gap buffer functions, around line 500 */
 
+#ifdef posix
+/* Host stand-ins for F$AllRAM/F$MapBlk - a block number is a malloc slot */
+#define RAM_SLOTS 8
+char *ram_slot[RAM_SLOTS];
+
+int alloc_ram_blocks(num_blocks)
+int num_blocks;
+{
+    int i;
+
+    for (i = 0; i < RAM_SLOTS; i++) {
+        if (ram_slot[i] == NULL) {
+            ram_slot[i] = malloc(num_blocks * 8192);
+            return ram_slot[i] != NULL ? i : -1;
+        }
+    }
+    return -1;
+}
+
+char *map_blocks(start_block, num_blocks)
+int start_block, num_blocks;
+{
+    return ram_slot[start_block];
+}
+
+unmap_blocks(addr, num_blocks)
+char *addr;
+int num_blocks;
+{
+}
+
+free_ram_blocks(start_block, num_blocks)
+int start_block, num_blocks;
+{
+    free(ram_slot[start_block]);
+    ram_slot[start_block] = NULL;
+}
+#else
 /* Allocate RAM blocks - returns starting block number */
 int alloc_ram_blocks(num_blocks)
 int num_blocks;
@@ -872,6 +2152,7 @@ int start_block, num_blocks;
     os9 $51          * Free RAM blocks F$DelRAM  
 #endasm
 }
+#endif
 
 /* Add this function after the system call wrappers */
 init_clipboard()
@@ -900,6 +2181,39 @@ init_clipboard()
     return 0;
 }
 
+/* Map the undo arena for the session */
+ua_init()
+{
+    ua_top = 0;
+    ua_buf = NULL;
+    ua_blk = alloc_ram_blocks(UA_BLKS);
+    if (ua_blk < 0) return;
+    ua_buf = map_blocks(ua_blk, UA_BLKS);
+    if (ua_buf == NULL) free_ram_blocks(ua_blk, UA_BLKS);
+}
+
+ua_free()
+{
+    if (ua_buf != NULL) {
+        unmap_blocks(ua_buf, UA_BLKS);
+        free_ram_blocks(ua_blk, UA_BLKS);
+        ua_buf = NULL;
+    }
+}
+
+/* Give back what the spilled history used */
+sp_free()
+{
+#ifdef posix
+    if (sp_fp != NULL) fclose(sp_fp);
+    sp_fp = NULL;
+#else
+    while (sp_nblk > 0) {
+        free_ram_blocks(sp_blk[--sp_nblk], 1);
+    }
+#endif
+}
+
 /* Add this function after init_clipboard() */
 copy_gap_selection_to_clipboard(sel_len)
 int sel_len;
@@ -951,7 +2265,7 @@ init_ed()
         printf("Fatal: Cannot allocate text buffer\n");
         exit(1);
     }
-#ifndef coco3
+#ifndef nofont
     inst_chr();
 #endif    
     /* Initialize gap buffer */
@@ -968,30 +2282,19 @@ init_ed()
     buf.selecting = 0;
     buf.selection_anchor = -1;
     buf.undo_count = 0;
+    buf.redo_count = 0;
     buf.search_pos = -1;
     buf.search_active = 0;
+    sch_rgn();
 
-    /* Initialize control sequences in init_ed() */
-    HIDE_CURSOR[0] = 0x05;
-    HIDE_CURSOR[1] = 0x20;
-
-    REV_ON[0] = 0x1F;
-    REV_ON[1] = 0x20;
-    REV_OFF[0] = 0x1F;
-    REV_OFF[1] = 0x21;
-    
-    SHOW_CURSOR[0] = 0x05;
-    SHOW_CURSOR[1] = 0x21;
-
-    ERASE_LINE[0] = 0x03;
-    CLEAR_EOL[0] = 0x04;
-    CLEAR_SCREEN[0] = 0x0C;
-    HOME_CURSOR[0] = 0x01;
+    /* Control sequences come from the selected terminal backend */
+    term_init(term);
     
     strcpy(fname_ptr, "untitled.txt");
     strcpy(status_msg, "Fast Editor v2.0 - Gap Buffer + Caching");
 
     init_clipboard();
+    ua_init();
     
     in_search_mode = 0;
     in_find_mode = 0;
@@ -1002,51 +2305,267 @@ init_ed()
     total_logical_lines = 1;  /* Will be recounted on file load */
 
     //   detect_screen_dimentions();
-    screen_cols = get_cols();
-    screen_rows = get_rows();
+    fit_size();
     tab_wdth = 8;          /* Default tab width to 8 columns */
     dbl_space = 0;         /* Default to single-spacing */
     log_row = 0;           /* Start at first logical text row */
     cursor_col = 0;
     text_start_row = 1;
-    status_row = screen_rows - 3;
-    
-    /* Calculate effective text rows based on double-spacing */
-    if (dbl_space) {
-        eff_rows = (status_row - text_start_row) / 2;
-    } else {
-        eff_rows = status_row - text_start_row;
-    }
+    set_rows();
     
     /* Screen optimization */
     need_full_redraw = 1;
     need_status_update = 0;
     need_title_update = 0;
-    need_minimal_update = 0;
-    need_char_update = 0;
-    need_redraw_down = 0;
-    update_from_pos = -1;
     last_cursor_pos = 0;
+    rows_top = -1;
+    dmg_lo = -1;
+    dmg_hi = -1;
+    dmg_delta = 0;
     
-    putchar(0x0C);  /* Clear screen */
+    term_cap(TC_CLRSCR);  /* Clear screen */
     set_raw_mode();
 }
 
-/* Count total logical lines in buffer - called after major changes */
-recount_total_lines()
+/* Calculate status row and effective text rows (double-spacing aware) */
+set_rows()
+{
+    status_row = screen_rows - 3;
+    if (dbl_space) {
+        eff_rows = (status_row - text_start_row) / 2;
+    } else {
+        eff_rows = status_row - text_start_row;
+    }
+    if (eff_rows > MAX_ROWS) eff_rows = MAX_ROWS;
+}
+
+/* Read the screen size (SS.ScSiz / TIOCGWINSZ), 1 if it changed */
+fit_size()
+{
+    int cols, rows;
+    
+    if (scr_fp != NULL) {
+        cols = 80;  /* Replays must not depend on the terminal */
+        rows = 24;
+    } else {
+        cols = get_cols();
+        rows = get_rows();
+    }
+    if (cols < MIN_COLS) cols = MIN_COLS;
+    if (rows < MIN_ROWS) rows = MIN_ROWS;
+    if (cols == screen_cols && rows == screen_rows) return 0;
+    screen_cols = cols;
+    screen_rows = rows;
+    return 1;
+}
+
+#ifdef posix
+/* SIGWINCH - the main loop picks up the new size.  SysV signal()
+ * resets the handler on delivery, so re-arm it; harmless under BSD. */
+void on_winch(sig)
+int sig;
+{
+    winched = 1;
+    signal(SIGWINCH, on_winch);
+}
+#endif
+
+/* Called while idle - adopt a new screen size.  Logical lines don't
+ * depend on the width, so nothing is recounted: the cursor keeps its
+ * buffer position and screen row, and only the rows above it are
+ * re-wrapped to find the new top of screen. */
+chk_size()
 {
     int i;
-    int line_count;
     
-    line_count = 1;  /* Start with line 1 */
+#ifdef posix
+    if (!winched) return 0;
+    winched = 0;
+#endif
+    if (!fit_size()) return 0;
     
-    for (i = 0; i < buf.text_length; i++) {
-        if (IS_LINE_END(gap_char_at(i))) {
-            line_count++;
+    set_rows();
+    if (log_row >= eff_rows) log_row = eff_rows - 1;
+    if (log_row < 0) log_row = 0;
+    buf.topscr_pos = visln_sta(buf.cursor_pos);
+    for (i = 0; i < log_row && buf.topscr_pos > 0; i++) {
+        buf.topscr_pos = visln_pre(buf.topscr_pos);
+    }
+    
+    term_cap(TC_CLRSCR);
+    need_full_redraw = 1;
+    if (in_help_mode) show_help();
+    return 1;
+}
+
+/* Arm timer t to fire ms from now */
+tm_set(t, ms)
+int t;
+long ms;
+{
+    tm_due[t] = tm_now() + ms;
+}
+
+/* Milliseconds until the next timer is due, -1 if none is armed */
+long tm_next()
+{
+    long now, left, best;
+    int t;
+
+    now = tm_now();
+    best = -1;
+    for (t = 0; t < TM_NUM; t++) {
+        if (tm_due[t] == 0) continue;
+        left = tm_due[t] - now;
+        if (left < 0) left = 0;
+        if (best < 0 || left < best) best = left;
+    }
+    return best;
+}
+
+/* Run every timer that is due, 1 if any ran */
+tm_run()
+{
+    long now;
+    int t, ran;
+
+    now = tm_now();
+    ran = 0;
+    for (t = 0; t < TM_NUM; t++) {
+        if (tm_due[t] == 0 || now < tm_due[t]) continue;
+        if (now - tm_due[t] > ev_late) ev_late = now - tm_due[t];
+        tm_due[t] = 0;
+        ran = 1;
+        if (t == TM_MSG) {
+            msg_exp = 1;
+            if (temp_message_active) need_status_update = 1;
+        } else if (t == TM_SAVE) {
+            it_start(IT_HASH);  /* auto_sav() if the text changed */
+            hs_save = 1;
+        } else if (t == TM_IDLE) {
+            /* OS-9 has no resize signal - keep polling SS.ScSiz */
+            chk_size();
+#ifndef posix
+            tm_set(TM_IDLE, IDLE_MS);
+#endif
+        }
+    }
+    return ran;
+}
+
+/* No key ready - handle a resize or due timers, otherwise sleep until
+ * a key arrives or the next timer is due */
+ev_idle()
+{
+    if (chk_size() || tm_run()) {
+        upd_fast();
+        return;
+    }
+    if (idle_run()) {
+        if (need_status_update || need_title_update) upd_fast();
+        return;
+    }
+    key_wait(tm_next());
+}
+
+/* Next -script event.  Idle tasks finish first, as they would in the
+ * pauses between typed keys; timers never fire. */
+scr_key()
+{
+    int sts, ch;
+
+    while (idle_run());
+    sts = getc(scr_fp);
+    ch = getc(scr_fp);
+    if (ch == EOF) scr_end();
+    key_count++;
+    return (sts << 8) | ch;
+}
+
+/* End of the -script - print the totals and quit */
+scr_end()
+{
+    term_flsh();
+    restore_mode();
+    if (cap_fp != NULL) fclose(cap_fp);
+    if (rec_fp != NULL) fclose(rec_fp);
+    printf("wall %ldus keys %ld out_bytes %ld out_calls %ld in_calls %ld waits %ld full_draws %ld\n",
+           tm_us() - scr_t0, key_count, out_bytes, out_calls, in_calls,
+           ev_waits, full_draws);
+    log_sum();
+    exit(0);
+}
+
+/* Queue idle task t to scan the buffer from the start */
+it_start(t)
+int t;
+{
+    it_on[t] = 1;
+    it_pos[t] = 0;
+    it_acc[t] = t == IT_LINES ? 1 : 0;
+}
+
+/* Run one slice of the first pending task, 1 if there was one */
+idle_run()
+{
+    int t, i, end, ch;
+    long h, t0;
+
+    for (t = 0; t < IT_NUM && !it_on[t]; t++);
+    if (t == IT_NUM) return 0;
+    
+    t0 = tm_us();
+    if (t == IT_TRIG) {
+        it_on[t] = tg_step();
+        it_runs[t]++;
+        it_us[t] += tm_us() - t0;
+        if (dbg_ovl) need_title_update = 1;
+        return 1;
+    }
+    end = it_pos[t] + IT_BYTES;
+    if (end > buf.text_length) end = buf.text_length;
+    h = it_acc[t];
+    for (i = it_pos[t]; i < end; i++) {
+        ch = gap_char_at(i);
+        if (t == IT_HASH) {
+            h = h * 31 + ch;
+        } else if (IS_LINE_END(ch)) {
+            h++;
         }
     }
+    it_acc[t] = h;
+    it_pos[t] = end;
+    it_runs[t]++;
+    it_us[t] += tm_us() - t0;
+    if (end < buf.text_length) return 1;
     
-    total_logical_lines = line_count;
+    /* Finished */
+    it_on[t] = 0;
+    if (t == IT_LINES) {
+        total_logical_lines = h;
+        need_status_update = 1;
+    } else {
+        if (hs_save && h != as_hash) {
+            auto_sav();
+        } else if (hs_save) {
+            as_dirty = 0;   /* Edits undone - nothing to save */
+        }
+        as_hash = h;
+        hs_save = 0;
+    }
+    if (dbg_ovl) need_title_update = 1;
+    return 1;
+}
+
+/* An edit at pos - tasks already past it start over */
+it_edit(pos)
+int pos;
+{
+    int t;
+
+    for (t = 0; t < IT_NUM; t++) {
+        if (it_on[t] && pos < it_pos[t]) it_start(t);
+    }
 }
 
 /* Set a temporary status message that clears on next keystroke */
@@ -1065,6 +2584,7 @@ char *filename;
     FILE *fp;
     int ch, count;
     
+    term_flsh();  /* Progress below goes straight to stdout */
     fp = fopen(filename, "r");
     if (fp == 0) {
         strcpy(status_msg, "Could not open file");
@@ -1092,7 +2612,7 @@ char *filename;
         buf.text_length++;
         count++;
         
-        if (count % 1000 == 0) {
+        if (count % 1000 == 0 && scr_fp == NULL) {
             printf("Loading... %d bytes\r", count);
         }
     }
@@ -1107,9 +2627,14 @@ char *filename;
     strcpy(fname_ptr, filename);
     buf.dirty = 0;
     buf.undo_count = 0;
+    buf.redo_count = 0;
+    ua_top = 0;
+    sp_drop();
     
     /* Initialize line cache after loading */
-    recount_total_lines();  /* Count total lines in file */
+    it_start(IT_LINES);  /* Count lines while idle */
+    it_start(IT_HASH);   /* Baseline for autosave */
+    hs_save = 0;
     
 /* Force full screen redraw to show new filename and content */
     buf.topscr_pos = 0;
@@ -1125,16 +2650,15 @@ char *filename;
     return 0;
 }
 
-save_file()
+/* Write the buffer to name, -1 if it can't be opened */
+write_file(name)
+char *name;
 {
     FILE *fp;
     int i;
     
-    fp = fopen(fname_ptr, "w");
-    if (fp == 0) {
-        strcpy(status_msg, "Could not save file");
-        return -1;
-    }
+    fp = fopen(name, "w");
+    if (fp == 0) return -1;
     
     /* Write text before gap */
     for (i = 0; i < buf.gap_start; i++) {
@@ -1152,1577 +2676,3581 @@ save_file()
     }
     
     fclose(fp);
+    return 0;
+}
+
+save_file()
+{
+    if (write_file(fname_ptr) < 0) {
+        strcpy(status_msg, "Could not save file");
+        return -1;
+    }
     set_dirty(0);
+    as_dirty = 0;
+    tm_due[TM_SAVE] = 0;
+    it_start(IT_HASH);
+    hs_save = 0;
     sprintf(status_msg, "Saved %d bytes", buf.text_length);
     temp_message_active = 1;
     return 0;
 }
 
-/* ENHANCED MAIN LOOP with advanced key combinations */
-main_loop()
+/* Autosave - run when the hash shows edits since the last save; they
+ * go to <file>.sav, the file itself is only written by Ctrl+S */
+auto_sav()
 {
-    int key, key_status, key_char;
-    
-    setbuf(stdin, NULL);
-    setbuf(stdout, NULL);
-    
-    need_full_redraw = 1;
-    upd_fast(); 
-    
-    while (1) {
-        key = inkey();
-        
-        if (key != 0) {
-            key_status = (key >> 8) & 0xFF;
-            key_char = key & 0xFF;
-
-	    /* Handle help mode first - any key exits */
-	    if (in_help_mode) {
-	        hide_help();
-	        continue;
-	    }
-
-	    /* Handle search mode first - before other key processing */
-	    if (in_search_mode) {
-	      /* Special handling for Ctrl+F in search mode */
-	      if ((key_status & CTRL_BIT) && key_char == KEY_C_F) {
-	        /* Execute first find (from search mode) */
-	        if (temp_search_str[0] != 0) {
-	          /* User typed something - use it */
-	          strcpy(buf.search_str, temp_search_str);
-	          find_next();
-	          in_search_mode = 0;
-	          in_find_mode = 1;
-	        } else if (buf.search_str[0] != 0) {
-	          /* Blank but previous search exists - reuse it */
-	          find_next();
-	          in_search_mode = 0;
-	          in_find_mode = 1;
-	        }
-	        /* Else: blank and no previous search - do nothing, stay in search mode */
-	        need_status_update = 1;
-	        upd_fast();
-	        continue;
-	      }
-	      
-	      /* Regular search mode key handling */
-	      search_keys(key_char);
-	      need_status_update = 1;
-	      upd_fast();
-	      continue;  /* Skip other key processing */
-	    }
-	
-	    /* Handle goto line mode */
-	    if (in_goto_mode) {
-	      goto_keys(key_char);
-	      need_status_update = 1;
-	      upd_fast();
-	      continue;  /* Skip other key processing */
-	    }
-	
-	    /* Exit find mode if any key other than Ctrl+F is pressed */
-	    if (in_find_mode) {
-	      if (!((key_status & CTRL_BIT) && key_char == KEY_C_F)) {
-	        /* User pressed something other than Ctrl+F - exit find mode */
-	        in_find_mode = 0;
-	        strcpy(status_msg, "");
-	        /* Continue processing this key normally */
-	      }
-	    }
-	
-	    /* ENHANCED F256 HARDWARE KEY PROCESSING */
-            if ((key_char >= 32 && key_char < 127) && ((key_status == 0) || (key_status & SHIFT_BIT) || (key_status & SPACE_BIT))){
-                /* Replace selection if active */
-                if (sel_active()) {
-                    del_sel();
-                    update_from_pos = buf.select_start;
-                } else {
-                    update_from_pos = buf.cursor_pos;
-                }
-                    
-                do_char(key_char);
-              
-            } else if (key_char == KEY_TAB && !(key_status & RIGHTBIT)) {
-                if (sel_active()) {
-                    del_sel();
-                    update_from_pos = buf.select_start;
-                } else {
-                    update_from_pos = buf.cursor_pos;
-                }
-                do_char(9);
-	    } else if (key_char == KEY_ENTER) {
-	      if (in_search_mode) {
-                    find_next();  /* Enter in search = find next */
-	      } else {
-		if (sel_active()) {
-		  del_sel();  /* Delete selection before enter */
-		  update_from_pos = buf.select_start;
-		}
-		/* Check for Shift+Enter to insert LF instead of CR */
-		if (key_status & SHIFT_BIT) {
-		  do_lf_enter();  /* Shift+Enter = insert $0A */
-		} else {
-		  do_cr_enter();  /* Regular Enter = insert $0D */
-		}
-	      }
-
-	    } else if (key_status & SHIFT_BIT){
-	      
-	      if ((key_status & SHIFT_BIT) && (key_status & UPBIT) && key_char == KEY_S_UP) {
-                ex_up();
-	      } else if ((key_status & SHIFT_BIT) && (key_status & DOWNBIT) && key_char == KEY_S_DOWN) {
-                ex_down();
-	      } else if ((key_status & SHIFT_BIT) && (key_status & CTRL_BIT) && (key_status & LEFTBIT) && key_char == KEY_S_LEFT) {
-                ex_wd_left();
-	      } else if ((key_status & SHIFT_BIT) && (key_status & CTRL_BIT) && (key_status & RIGHTBIT) && key_char == KEY_S_RIGHT) {
-                ex_wd_right();		
-	      } else if ((key_status & SHIFT_BIT) && (key_status & LEFTBIT) && key_char == KEY_S_LEFT) {
-                ex_left();
-	      } else if ((key_status & SHIFT_BIT) && (key_status & RIGHTBIT) && key_char == KEY_S_RIGHT) {
-                ex_right();
-		           /* Shift+Ctrl+Arrow = Word Selection */
-	      }
-
-	    } else if (key_status & CTRL_BIT){
-              /* Ctrl+Arrow = Word Navigation */
-              if ((key_status & CTRL_BIT) && (key_status & LEFTBIT) && key_char == KEY_C_LEFT) {
-		word_left();
-	      } else if ((key_status & CTRL_BIT) && (key_status & RIGHTBIT) && key_char == KEY_C_RIGHT) {
-		word_right();
-	      } else if ((key_status & CTRL_BIT) && (key_status & UPBIT) && key_char == KEY_C_UP) {
-		page_up();
-	      } else if ((key_status & CTRL_BIT) && (key_status & DOWNBIT) && key_char == KEY_C_DOWN) {
-		page_down();
-		
-		/* Ctrl+Letter combinations using F256 hardware detection */
-	      } else if ((key_status & CTRL_BIT) && key_char == KEY_C_Q) {  /* Ctrl+Q = Quit */
-		if (buf.dirty && !quit_confirm) {
-		  strcpy(status_msg, "File modified - ^S to save, ^Q again to quit anyway");
-		  quit_confirm = 1;
-		  need_status_update = 1;
-		} else {
-		  cleanup_clipboard();
-#ifndef coco3
-		  rest_chr();
-#endif		  
-		  if (buf.text_storage != NULL) {
-		    free(buf.text_storage);
-		  }
-		  restore_mode();
-		  write_block(1,CLEAR_SCREEN,1);
-		  exit(0);
-		}
-	      } else if ((key_status & CTRL_BIT) && key_char == KEY_C_S) {  /* Ctrl+S = Save */
-		save_file();
-		need_status_update = 1;
-	      } else if ((key_status & CTRL_BIT) && key_char == KEY_C_F) {  /* Ctrl+F = Find / Find Next */
-		if (!in_search_mode && !in_find_mode) {
-		  /* Start new search */
-		  strtsch();
-		  need_status_update = 1;
-		} else if (in_find_mode) {
-		  /* Find next occurrence */
-		  find_next();
-		}
-		/* Note: in_search_mode case handled above before search_keys() */
-	      } else if ((key_status & CTRL_BIT) && key_char == KEY_C_G) {  /* Ctrl+G = Goto Line */
-		start_goto();
-		need_status_update = 1;
-	      } else if ((key_status & CTRL_BIT) && key_char == KEY_C_H) {  /* Ctrl+H = Help */
-		show_help();
-	      } else if ((key_status & CTRL_BIT) && key_char == KEY_C_A) {  /* Ctrl+A = Select All */
-		sel_all();
-		need_full_redraw = 1;
-	      } else if ((key_status & CTRL_BIT) && key_char == KEY_C_C) {  /* Ctrl+C = COPY */
-		if (sel_active()) {
-		  copy_sel();
-		  strcpy(status_msg, "Copied to clipboard");
-		  temp_message_active = 1;
-		} else {
-		  strcpy(status_msg, "Nothing selected to copy");
-		}
-		need_status_update = 1;
-	      } else if ((key_status & CTRL_BIT) && key_char == KEY_C_X) {  /* Ctrl+X = CUT */
-		if (sel_active()) {
-		  copy_sel();
-		  del_sel();
-		  strcpy(status_msg, "Cut to clipboard");
-		  need_status_update = 1;
-		  need_minimal_update = 1;
-		  update_from_pos = buf.select_start;
-		} else {
-		  strcpy(status_msg, "Nothing selected to cut");
-		  need_status_update = 1;
-		}
-	      
-	      
-	      } else if ((key_status & CTRL_BIT) && key_char == KEY_C_V) {  /* Ctrl+V = PASTE */
-		paste_clipboard();
-		need_status_update = 1;
-	      
-	      } else if ((key_status & CTRL_BIT) && key_char == KEY_C_Z) {  /* Ctrl+Z = UNDO */
-		do_undo();
-		need_full_redraw = 1;
-		need_status_update = 1;
-	      
-	      } else if ((key_status & CTRL_BIT) && key_char == KEY_C_1) {  /* Ctrl+1 = Single-spacing */
-		dbl_space = 0;
-		eff_rows = status_row - text_start_row;
-		need_full_redraw = 1;
-		strcpy(status_msg, "Single-spacing");
-		need_status_update = 1;
-	      
-	      } else if ((key_status & CTRL_BIT) && key_char == KEY_C_2) {  /* Ctrl+2 = Double-spacing */
-		dbl_space = 1;
-		eff_rows = (status_row - text_start_row) / 2;
-		need_full_redraw = 1;
-		strcpy(status_msg, "Double-spacing");
-		need_status_update = 1;
-	      
-	      }
-	      
-            /* Regular Arrow Keys with Visual Line Navigation */
-            } else if (key_status & UPBIT && key_char == KEY_UP) {
-		if (sel_active()) {
-		    /* With selection: jump to start and clear */
-		    set_curs(buf.select_start);
-		    clr_sel();
-		    ensure_vis();
-		} else {
-		    /* Normal movement */
-		    move_up();
-		}
-		need_status_update = 1;
-            } else if (key_status & DOWNBIT && key_char == KEY_DOWN) {
-		if (sel_active()) {
-		    /* With selection: jump to end and clear */
-		    set_curs(buf.select_end);
-		    clr_sel();
-		    ensure_vis();
-		} else {
-		    /* Normal movement */
-		    move_down();
-		}
-		need_status_update = 1;
-	    } else if (key_status & LEFTBIT && key_char == KEY_LEFT) {
-		if (sel_active()) {
-		    /* With selection: jump to start and clear */
-		    set_curs(buf.select_start);
-		    clr_sel();
-		    ensure_vis();
-		} else {
-		    /* Normal movement */
-		    move_left();
-		}
-		need_status_update = 1;
-            } else if (key_status & RIGHTBIT && key_char == KEY_RIGHT) {
-		if (sel_active()) {
-		    /* With selection: jump to end and clear */
-		    set_curs(buf.select_end);
-		    clr_sel();
-		    ensure_vis();
-		} else {
-		    /* Normal movement */
-		    move_right();
-		}
-		need_status_update = 1;
-
-            } else if (key_char == 127 || ((key_char == KEY_BS) && !(key_status & LEFTBIT))) {
-	      /* Backspace - handle selection */
-	      if (sel_active()) {
-		del_sel();
-		need_minimal_update = 1;
-		update_from_pos = buf.select_start;
-	      } else {
-		update_from_pos = buf.cursor_pos - 1;
-		do_back();
-		need_minimal_update = 1;
-	      }
-            } else if (key_char == 127 && (key_status & SHIFT_BIT)) {  /* Shift+Del */
-	      if (sel_active()) {
-		copy_sel();  /* Copy to clipboard (simulated) */
-		del_sel();
-		strcpy(status_msg, "Cut to clipboard");
-		need_status_update = 1;
-	      }
-            } else if (key_char == KEY_ESC) {
-	      if (in_search_mode) {
-		end_search();
-		need_status_update = 1;
-	      } else if (buf.selecting) {
-		clr_sel();
-		strcpy(status_msg, "Selection cleared");
-		need_status_update = 1;
-	      }
-            } else if (key_char == KEY_C_C) {
-	      restore_mode();
-	      exit(0);
-            } else if (key_char == KEY_C_S) {
-	      save_file();
-	      need_status_update = 1;
-            } 
-	    
-            /* Clear quit confirmation on any other key */
-            if (key_char != KEY_C_Q) {
-	      quit_confirm = 0;
-            }
-            
-            upd_fast();
-        }
+    char name[40];
+
+    if (!as_dirty || fname_ptr[0] == 0) return;
+    strcpy(name, fname_ptr);
+    name[35] = 0;
+    strcat(name, ".sav");
+    if (write_file(name) < 0) {
+        set_temp_status("Autosave failed");
+        return;
     }
-    
-    restore_mode();
+    as_dirty = 0;
+    sprintf(status_msg, "Autosaved to %s", name);
+    temp_message_active = 1;
+    need_status_update = 1;
 }
 
-/* ENHANCED MOVEMENT FUNCTIONS WITH SOFT WRAP SUPPORT */
+/* Command handlers - each gets the key's character code */
 
-/* Helper: Advance column by one character, handling tabs */
-col_adv(col, ch)
-int col;
-char ch;
+/* Printable character or tab - replaces the selection */
+k_ins(ch)
+int ch;
 {
-    if (ch == 9) {
-        return NEXT_TAB(col);
-    }
-    return col + 1;
+    int g;
+    
+    g = sel_over();
+    do_char(ch);
+    undo_grp = g;
+    un_skip = 0;
 }
 
-/* Helper: Find where visual line ends from start position */
-find_end(start)
-int start;
+/* Delete the selection before typing over it - it undoes along with
+ * what is typed.  The undo group to go back to after the first byte.
+ * If the delete cannot be undone the byte typed is not kept either. */
+sel_over()
 {
-    int pos, col;
-    char ch;
+    int g;
     
-    pos = start;
-    col = 0;
-    while (pos < buf.text_length) {
-        ch = gap_char_at(pos);
-        if (IS_LINE_END(ch)) break;
-        col = col_adv(col, ch);
-        if (col >= screen_cols) break;
-        pos++;
+    g = undo_grp;
+    if (sel_active()) {
+        if (g == 0) undo_grp = ++grp_seq;
+        un_skip = !del_sel();
     }
-    return pos;
+    return g;
 }
 
-/* Helper: Find position at target column on visual line */
-pos_col(start, tgt_col, line_end)
-int start, tgt_col, line_end;
+k_tab(ch)
+int ch;
 {
-    int pos, col;
-    char ch;
-    
-    pos = start;
-    col = 0;
-    while (col < tgt_col && pos < line_end) {
-        ch = gap_char_at(pos);
-        col = col_adv(col, ch);
-        if (col >= screen_cols) break;
-        pos++;
-    }
-    return pos;
+    k_ins(9);
 }
 
-/* Ultra-simple move_up using visln_pre() */
-move_up()
+k_cr(ch)
+int ch;
 {
-    int target, ch;
-    int line_end;
-    int at_line_end;
-    
-    /* Check if we're at a line terminator */
-    at_line_end = 0;
-    if (buf.cursor_pos < buf.text_length) {
-        ch = gap_char_at(buf.cursor_pos);
-        if (IS_LINE_END(ch)) {
-            at_line_end = 1;
-        }
-    }
-    
-    /* Get previous visual line - visln_pre handles all cases correctly */
-    target = visln_pre(buf.cursor_pos);
-    
-    if (target >= buf.cursor_pos) return;  /* Can't go up */
-    
-    /* Find where this visual line ends */
-    line_end = find_end(target);
-    
-    /* Position cursor at target column */
-    target = pos_col(target, cursor_col, line_end);
-    
-    /* If original position was at line end and target line is shorter,
-       position at end of target line */
-    if (at_line_end && target >= line_end) {
-        target = line_end;
-    }
+    int g;
     
-    set_curs(target);
-    log_row--;
+    g = sel_over();
+    do_cr_enter();  /* Enter = insert $0D */
+    undo_grp = g;
+    un_skip = 0;
 }
 
-move_down()
+k_lf(ch)
+int ch;
 {
-    int target, ch;
-    int line_end;
-    int at_line_end;
+    int g;
     
-    /* Check if we're at a line terminator */
-    at_line_end = 0;
-    if (buf.cursor_pos < buf.text_length) {
-        ch = gap_char_at(buf.cursor_pos);
-        if (IS_LINE_END(ch)) {
-            at_line_end = 1;
-        }
+    g = sel_over();
+    do_lf_enter();  /* Shift+Enter = insert $0A */
+    undo_grp = g;
+    un_skip = 0;
+}
+
+/* Arrow with a selection: jump to its start or end and clear it */
+sel_jump(pos)
+int pos;
+{
+    set_curs(pos);
+    clr_sel();
+    ensure_vis();
+}
+
+k_up(ch)
+int ch;
+{
+    if (sel_active()) {
+        sel_jump(buf.select_start);
+    } else {
+        move_up();
     }
-    
+    need_status_update = 1;
+}
 
-    target = visln_next(buf.cursor_pos);
+k_down(ch)
+int ch;
+{
+    if (sel_active()) {
+        sel_jump(buf.select_end);
+    } else {
+        move_down();
+    }
+    need_status_update = 1;
+}
 
-    
-    if (target <= buf.cursor_pos) return;  /* Can't go down */
-    
-    /* Find where this visual line ends */
-    line_end = find_end(target);
-    
-    /* Position cursor at target column */
-    target = pos_col(target, cursor_col, line_end);
-    
-    /* If original position was at line end and target line is shorter,
-       position at end of target line */
-    if (at_line_end && target >= line_end) {
-        target = line_end;
+k_left(ch)
+int ch;
+{
+    if (sel_active()) {
+        sel_jump(buf.select_start);
+    } else {
+        move_left();
     }
-    
-    set_curs(target);
-    log_row++;
+    need_status_update = 1;
 }
 
-move_left()
+k_right(ch)
+int ch;
 {
-    if (buf.cursor_pos > 0) {
-        curs_lft();
+    if (sel_active()) {
+        sel_jump(buf.select_end);
+    } else {
+        move_right();
     }
+    need_status_update = 1;
 }
 
-move_right()
+k_quit(ch)
+int ch;
 {
-    if (buf.cursor_pos < buf.text_length) {
-        curs_rgt();
+    if (buf.dirty && !quit_confirm) {
+        strcpy(status_msg, "File modified - ^S to save, ^Q again to quit anyway");
+        quit_confirm = 1;
+        need_status_update = 1;
+        return;
+    }
+    if (scr_fp) scr_end();
+    cleanup_clipboard();
+    ua_free();
+    sp_free();
+#ifndef nofont
+    rest_chr();
+#endif
+    if (buf.text_storage != NULL) {
+        free(buf.text_storage);
     }
+    restore_mode();
+    term_cap(TC_CLRSCR);
+    term_flsh();
+    log_sum();
+    exit(0);
 }
 
-set_curs(new_pos)
-int new_pos;
+k_save(ch)
+int ch;
 {
-    int old_pos, i;
-    
-    if (new_pos < 0) new_pos = 0;
-    if (new_pos > buf.text_length) new_pos = buf.text_length;
-    
-    if (new_pos == buf.cursor_pos) return;  /* No change */
-    
-    old_pos = buf.cursor_pos;
-    buf.cursor_pos = new_pos;
+    save_file();
+    need_status_update = 1;
+}
 
-    
-    /* Update cached line number incrementally */
-        if (new_pos > old_pos) {
-            /* Moving forward - count newlines crossed */
-            for (i = old_pos; i < new_pos; i++) {
-                if (IS_LINE_END(gap_char_at(i))) {
-                    buf.ccurs_ln++;
-                }
-            }
-        } else {
-            /* Moving backward - count newlines crossed */
-            for (i = old_pos - 1; i >= new_pos; i--) {
-                if (IS_LINE_END(gap_char_at(i))) {
-                    buf.ccurs_ln--;
-                }
-            }
-        }
+/* Ctrl+F - start a search, or find the next match in find mode */
+k_find(ch)
+int ch;
+{
+    if (in_find_mode) {
+        find_next();
+    } else {
+        strtsch();
+        need_status_update = 1;
+    }
 }
 
-/* Calculate column position for a given buffer position */
-/* Returns the column (0-79) where the cursor would be at this position */
-calc_col(pos)
-int pos;
+/* Ctrl+B - search backward; from edit mode it opens the prompt too */
+k_fprev(ch)
+int ch;
 {
-    int col, i;
-    int line_start;
-    char ch;
-    
-    /* Find start of current visual line */
-    line_start = visln_sta(pos);
-    
-    /* Count columns from line start to pos */
-    col = 0;
-    for (i = line_start; i < pos && i < buf.text_length; i++) {
-        ch = gap_char_at(i);
-        if (!IS_LINE_END(ch)) {
-            col = col_adv(col, ch);
-            if (col >= screen_cols) {
-                /* Wrapped to next visual line */
-                line_start = i + 1;
-                col = 0;
-            }
-        }
+    if (in_find_mode) {
+        find_prev();
+    } else {
+        strtsch();
+        need_status_update = 1;
     }
-    
-    return col;
 }
 
-/* Update cursor position moving left with proper screen coordinate tracking */
-curs_lft()
+/* Ctrl+T / Ctrl+W - search modes; find mode stays on so Ctrl+F
+ * carries on with the new mode */
+k_case(ch)
+int ch;
 {
-    char prev_char;
-    int old_log_row;
-    
-    if (buf.cursor_pos <= 0) return;
+    sch_case = !sch_case;
+    fa_hide();
+    if (in_search_mode) {
+        inc_redo();
+    } else {
+        sch_pmt();
+    }
+}
+
+k_word(ch)
+int ch;
+{
+    sch_word = !sch_word;
+    fa_hide();
+    if (in_search_mode) {
+        inc_redo();
+    } else {
+        sch_pmt();
+    }
+}
+
+k_regex(ch)
+int ch;
+{
+    sch_rx = !sch_rx;
+    fa_hide();
+    if (in_search_mode) {
+        inc_redo();
+    } else {
+        sch_pmt();
+    }
+}
+
+/* Ctrl+O - next scope; the selection one only once there is a selection */
+k_scope(ch)
+int ch;
+{
+    sch_scope = (sch_scope + 1) % SC_NUM;
+    if (sch_scope == SC_SEL && !sc_have) sch_scope = SC_CURS;
+    sch_rgn();
+    fa_hide();
+    if (in_search_mode) {
+        inc_redo();
+    } else {
+        sch_pmt();
+    }
+}
+
+/* Ctrl+N - replace the match found, or ask for the pattern first */
+k_repl(ch)
+int ch;
+{
+    if (in_find_mode && sel_active()) {
+        rep_with();
+    } else {
+        rep_want = 1;
+        strtsch();
+    }
+}
+
+k_goto(ch)
+int ch;
+{
+    start_goto();
+    need_status_update = 1;
+}
+
+k_help(ch)
+int ch;
+{
+    show_help();
+}
+
+k_selall(ch)
+int ch;
+{
+    sel_all();
+}
+
+k_copy(ch)
+int ch;
+{
+    if (sel_active()) {
+        copy_sel();
+        strcpy(status_msg, "Copied to clipboard");
+        temp_message_active = 1;
+    } else {
+        strcpy(status_msg, "Nothing selected to copy");
+    }
+    need_status_update = 1;
+}
+
+k_cut(ch)
+int ch;
+{
+    if (sel_active()) {
+        copy_sel();
+        if (del_sel()) {
+            strcpy(status_msg, "Cut to clipboard");
+        } else {
+            strcpy(status_msg, "Cut to clipboard - too big to undo");
+        }
+    } else {
+        strcpy(status_msg, "Nothing selected to cut");
+    }
+    need_status_update = 1;
+}
+
+k_paste(ch)
+int ch;
+{
+    paste_clipboard();
+    need_status_update = 1;
+}
+
+k_undo(ch)
+int ch;
+{
+    do_undo();
+    need_status_update = 1;
+}
+
+k_redo(ch)
+int ch;
+{
+    do_redo();
+    need_status_update = 1;
+}
+
+k_single(ch)
+int ch;
+{
+    dbl_space = 0;
+    set_rows();
+    need_full_redraw = 1;
+    strcpy(status_msg, "Single-spacing");
+    need_status_update = 1;
+}
+
+k_double(ch)
+int ch;
+{
+    dbl_space = 1;
+    set_rows();
+    need_full_redraw = 1;
+    strcpy(status_msg, "Double-spacing");
+    need_status_update = 1;
+}
+
+/* Backspace - deletes the selection if there is one */
+k_back(ch)
+int ch;
+{
+    if (sel_active()) {
+        del_sel();
+    } else {
+        do_back();
+    }
+}
+
+k_esc(ch)
+int ch;
+{
+    if (buf.selecting) {
+        clr_sel();
+        strcpy(status_msg, "Selection cleared");
+        need_status_update = 1;
+    }
+}
+
+k_abort(ch)
+int ch;
+{
+    if (scr_fp) scr_end();
+    restore_mode();
+    exit(0);
+}
+
+/* Handlers and names in CM_ order */
+int (*cm_fn[CM_NUM])() = {
+    NULL, k_ins, k_tab, k_cr, k_lf, k_up, k_down, k_left, k_right,
+    ex_up, ex_down, ex_left, ex_right, ex_wd_left, ex_wd_right,
+    word_left, word_right, page_up, page_down,
+    k_quit, k_save, k_find, k_goto, k_help, k_selall,
+    k_copy, k_cut, k_paste, k_undo, k_single, k_double,
+    k_back, k_esc, k_abort, mac_tog, start_rpt, k_fprev,
+    k_case, k_word, k_repl, k_regex, k_scope, k_redo
+};
+
+char *cm_name[CM_NUM] = {
+    "none", "insert", "tab", "enter", "lf", "up", "down", "left", "right",
+    "selup", "seldown", "selleft", "selright", "selwleft", "selwright",
+    "wleft", "wright", "pgup", "pgdown",
+    "quit", "save", "find", "goto", "help", "selall",
+    "copy", "cut", "paste", "undo", "single", "double",
+    "back", "esc", "abort", "record", "play", "findprev",
+    "case", "word", "replace", "regex", "scope", "redo"
+};
+
+/* Fill key_map from key_defs[]; printable keys insert */
+key_init()
+{
+    int i;
+
+    for (i = 32; i < 127; i++) {
+        key_map[0][i] = CM_INS;
+        key_map[KM_SHIFT][i] = CM_INS;
+        key_map[KM_SHIFT | KM_CTRL][i] = CM_INS;
+    }
+    for (i = 0; key_defs[i].kd_cmd != CM_NONE; i++) {
+        key_map[key_defs[i].kd_mod][key_defs[i].kd_key] = key_defs[i].kd_cmd;
+    }
+}
+
+/* Key event to command - one table lookup once arrows are told apart */
+key_cmd(status, ch)
+int status, ch;
+{
+    int m, c;
+
+    c = ch;
+    if ((status & UPBIT) && (ch == KEY_UP || ch == KEY_S_UP || ch == KEY_C_UP)) {
+        c = VK_UP;
+    } else if ((status & DOWNBIT) && (ch == KEY_DOWN || ch == KEY_S_DOWN || ch == KEY_C_DOWN)) {
+        c = VK_DOWN;
+    } else if ((status & LEFTBIT) && (ch == KEY_LEFT || ch == KEY_S_LEFT || ch == KEY_C_LEFT)) {
+        c = VK_LEFT;
+    } else if ((status & RIGHTBIT) && (ch == KEY_RIGHT || ch == KEY_S_RIGHT || ch == KEY_C_RIGHT)) {
+        c = VK_RIGHT;
+    }
+    m = 0;
+    if (status & SHIFT_BIT) m |= KM_SHIFT;
+    if (status & CTRL_BIT) m |= KM_CTRL;
+    
+    /* Unshifted text only types with no modifier, or with the spacebar
+       held - not under Alt or an arrow */
+    if (m == 0 && c >= 32 && c < 127 && status != 0 && !(status & SPACE_BIT)) {
+        return CM_NONE;
+    }
+    return key_map[m][c];
+}
+
+/* -key <command> <key>: bind a key, e.g. "c26" for Ctrl+Z or "sup" for
+ * Shift+Up.  s and c prefixes add Shift and Ctrl; 0 if not understood */
+key_opt(name, spec)
+char *name, *spec;
+{
+    int cmd, m, c;
+
+    for (cmd = 1; cmd < CM_NUM && strcmp(cm_name[cmd], name) != 0; cmd++);
+    if (cmd == CM_NUM) return 0;
+    m = 0;
+    while (*spec == 's' || *spec == 'c') {
+        m |= *spec == 's' ? KM_SHIFT : KM_CTRL;
+        spec++;
+    }
+    if (strcmp(spec, "up") == 0) {
+        c = VK_UP;
+    } else if (strcmp(spec, "down") == 0) {
+        c = VK_DOWN;
+    } else if (strcmp(spec, "left") == 0) {
+        c = VK_LEFT;
+    } else if (strcmp(spec, "right") == 0) {
+        c = VK_RIGHT;
+    } else {
+        c = atoi(spec);
+        if (c <= 0 || c > 255) return 0;
+    }
+    key_map[m][c] = cmd;
+    return 1;
+}
+
+/* Ctrl+R - start recording, or stop and keep what was recorded */
+mac_tog(ch)
+int ch;
+{
+    if (mac_rec) {
+        mac_rec = 0;
+        sprintf(status_msg, "Macro: %d keys - ^E to play", mac_len);
+    } else {
+        mac_rec = 1;
+        mac_len = 0;
+        strcpy(status_msg, "Recording macro - ^R to stop");
+    }
+    need_status_update = 1;
+}
+
+/* Add a key to the macro being recorded */
+mac_add(key)
+int key;
+{
+    if (mac_len < MAC_MAX) {
+        mac_buf[mac_len++] = key;
+        return;
+    }
+    mac_rec = 0;
+    sprintf(status_msg, "Macro full - %d keys kept", mac_len);
+    need_status_update = 1;
+}
+
+/* Play the macro n times against the buffer.  The screen is only
+ * drawn by the main loop's upd_fast() afterwards, and the edits
+ * undo as one group. */
+mac_play(n)
+int n;
+{
+    int i, k;
+
+    if (mac_len == 0) {
+        strcpy(status_msg, "No macro - ^R to record one");
+        need_status_update = 1;
+        return;
+    }
+    mac_run = 1;
+    undo_grp = ++grp_seq;
+    for (i = 0; i < n; i++) {
+        for (k = 0; k < mac_len; k++) {
+            do_key(mac_buf[k]);
+        }
+    }
+    undo_grp = 0;
+    un_open = 0;
+    mac_run = 0;
+    ensure_vis();
+    sprintf(status_msg, "Macro played %d times", n);
+    need_status_update = 1;
+}
+
+/* Handle one key event - from the keyboard, a script or a macro */
+do_key(key)
+int key;
+{
+    int key_status, key_char, cmd;
+    
+    key_status = (key >> 8) & 0xFF;
+    key_char = key & 0xFF;
+    cmd = key_cmd(key_status, key_char);
+    msg_exp = 1;
+    if (cmd != CM_INS && cmd != CM_TAB && cmd != CM_CR && cmd != CM_LF &&
+        cmd != CM_BACK) {
+        un_open = 0;    /* Moved, or some other command - undo apart */
+    }
+    if (mac_rec && cmd != CM_RECORD && cmd != CM_PLAY) mac_add(key);
+
+    /* Handle help mode first - any key exits */
+    if (in_help_mode) {
+        hide_help();
+        return;
+    }
+
+    /* Handle search mode first - before other key processing */
+    if (in_search_mode) {
+      /* Ctrl+F / Ctrl+B in search mode - on to find mode, forward or back */
+      if (cmd == CM_FIND || cmd == CM_FPREV) {
+        sch_go(cmd == CM_FPREV);
+        need_status_update = 1;
+        return;
+      }
+      
+      if (cmd == CM_CASE || cmd == CM_WORD || cmd == CM_REGEX ||
+          cmd == CM_SCOPE) {
+        cm_cnt[cmd]++;
+        (*cm_fn[cmd])(key_char);
+        return;
+      }
+      
+      /* Regular search mode key handling */
+      search_keys(key_char);
+      need_status_update = 1;
+      return;  /* Skip other key processing */
+    }
+
+    /* Replacement prompt and the question at each match */
+    if (rep_mode) {
+      rep_keys(key_char);
+      need_status_update = 1;
+      return;
+    }
+
+    /* Handle goto line / repeat count mode */
+    if (in_goto_mode) {
+      goto_keys(key_char);
+      need_status_update = 1;
+      return;  /* Skip other key processing */
+    }
+
+    /* Exit find mode if any key other than Ctrl+F is pressed */
+    if (in_find_mode && cmd != CM_FIND && cmd != CM_FPREV &&
+        cmd != CM_CASE && cmd != CM_WORD && cmd != CM_REPL &&
+        cmd != CM_REGEX && cmd != CM_SCOPE) {
+      in_find_mode = 0;
+      fa_hide();
+      strcpy(status_msg, "");
+      /* Continue processing this key normally */
+    }
+
+    /* Table dispatch - see key_defs[] for the bindings */
+    if (cmd != CM_NONE) {
+        cm_cnt[cmd]++;
+        (*cm_fn[cmd])(key_char);
+    }
+    
+    /* Clear quit confirmation on any other key */
+    if (cmd != CM_QUIT) {
+      quit_confirm = 0;
+    }
+}
+
+/* ENHANCED MAIN LOOP with advanced key combinations */
+main_loop()
+{
+    int key;
+    
+    setbuf(stdin, NULL);
+    setbuf(stdout, NULL);
+    
+    need_full_redraw = 1;
+    upd_fast(); 
+    tm_set(TM_IDLE, IDLE_MS);
+    
+    while (1) {
+        key = scr_fp ? scr_key() : inkey();
+        
+        if (key != 0) {
+            if (rec_fp) {
+                putc(key >> 8, rec_fp);
+                putc(key & 0xFF, rec_fp);
+            }
+            do_key(key);
+            upd_fast();
+            
+            /* Idle work starts over after each key; an edit arms the
+               autosave unless one is already pending */
+            tm_set(TM_IDLE, IDLE_MS);
+            if (save_ms && as_dirty && tm_due[TM_SAVE] == 0) {
+                tm_set(TM_SAVE, save_ms);
+            }
+        } else {
+            ev_idle();
+        }
+    }
+    
+    restore_mode();
+}
+
+/* ENHANCED MOVEMENT FUNCTIONS WITH SOFT WRAP SUPPORT */
+
+/* Helper: Advance column by one character, handling tabs */
+col_adv(col, ch)
+int col;
+char ch;
+{
+    if (ch == 9) {
+        return NEXT_TAB(col);
+    }
+    return col + 1;
+}
+
+/* Helper: Find where visual line ends from start position */
+find_end(start)
+int start;
+{
+    int pos, col;
+    char ch;
+    
+    pos = start;
+    col = 0;
+    while (pos < buf.text_length) {
+        ch = gap_char_at(pos);
+        if (IS_LINE_END(ch)) break;
+        col = col_adv(col, ch);
+        if (col >= screen_cols) break;
+        pos++;
+    }
+    return pos;
+}
+
+/* Helper: Find position at target column on visual line */
+pos_col(start, tgt_col, line_end)
+int start, tgt_col, line_end;
+{
+    int pos, col;
+    char ch;
+    
+    pos = start;
+    col = 0;
+    while (col < tgt_col && pos < line_end) {
+        ch = gap_char_at(pos);
+        col = col_adv(col, ch);
+        if (col >= screen_cols) break;
+        pos++;
+    }
+    return pos;
+}
+
+/* Ultra-simple move_up using visln_pre() */
+move_up()
+{
+    int target, ch;
+    int line_end;
+    int at_line_end;
+    
+    /* Check if we're at a line terminator */
+    at_line_end = 0;
+    if (buf.cursor_pos < buf.text_length) {
+        ch = gap_char_at(buf.cursor_pos);
+        if (IS_LINE_END(ch)) {
+            at_line_end = 1;
+        }
+    }
+    
+    /* Get previous visual line - visln_pre handles all cases correctly */
+    target = visln_pre(buf.cursor_pos);
+    
+    if (target >= buf.cursor_pos) return;  /* Can't go up */
+    
+    /* Find where this visual line ends */
+    line_end = find_end(target);
+    
+    /* Position cursor at target column */
+    target = pos_col(target, cursor_col, line_end);
+    
+    /* If original position was at line end and target line is shorter,
+       position at end of target line */
+    if (at_line_end && target >= line_end) {
+        target = line_end;
+    }
+    
+    set_curs(target);
+    log_row--;
+}
+
+move_down()
+{
+    int target, ch;
+    int line_end;
+    int at_line_end;
+    
+    /* Check if we're at a line terminator */
+    at_line_end = 0;
+    if (buf.cursor_pos < buf.text_length) {
+        ch = gap_char_at(buf.cursor_pos);
+        if (IS_LINE_END(ch)) {
+            at_line_end = 1;
+        }
+    }
+    
+
+    target = visln_next(buf.cursor_pos);
+
+    
+    if (target <= buf.cursor_pos) return;  /* Can't go down */
+    
+    /* Find where this visual line ends */
+    line_end = find_end(target);
+    
+    /* Position cursor at target column */
+    target = pos_col(target, cursor_col, line_end);
+    
+    /* If original position was at line end and target line is shorter,
+       position at end of target line */
+    if (at_line_end && target >= line_end) {
+        target = line_end;
+    }
+    
+    set_curs(target);
+    log_row++;
+}
+
+move_left()
+{
+    if (buf.cursor_pos > 0) {
+        curs_lft();
+    }
+}
+
+move_right()
+{
+    if (buf.cursor_pos < buf.text_length) {
+        curs_rgt();
+    }
+}
+
+set_curs(new_pos)
+int new_pos;
+{
+    int old_pos, i;
+    
+    if (new_pos < 0) new_pos = 0;
+    if (new_pos > buf.text_length) new_pos = buf.text_length;
+    
+    if (new_pos == buf.cursor_pos) return;  /* No change */
+    
+    old_pos = buf.cursor_pos;
+    buf.cursor_pos = new_pos;
+
+    
+    /* Update cached line number incrementally */
+        if (new_pos > old_pos) {
+            /* Moving forward - count newlines crossed */
+            for (i = old_pos; i < new_pos; i++) {
+                if (IS_LINE_END(gap_char_at(i))) {
+                    buf.ccurs_ln++;
+                }
+            }
+        } else {
+            /* Moving backward - count newlines crossed */
+            for (i = old_pos - 1; i >= new_pos; i--) {
+                if (IS_LINE_END(gap_char_at(i))) {
+                    buf.ccurs_ln--;
+                }
+            }
+        }
+}
+
+/* Calculate column position for a given buffer position */
+/* Returns the column (0-79) where the cursor would be at this position */
+calc_col(pos)
+int pos;
+{
+    int col, i;
+    int line_start;
+    char ch;
+    
+    /* Find start of current visual line */
+    line_start = visln_sta(pos);
+    
+    /* Count columns from line start to pos */
+    col = 0;
+    for (i = line_start; i < pos && i < buf.text_length; i++) {
+        ch = gap_char_at(i);
+        if (!IS_LINE_END(ch)) {
+            col = col_adv(col, ch);
+            if (col >= screen_cols) {
+                /* Wrapped to next visual line */
+                line_start = i + 1;
+                col = 0;
+            }
+        }
+    }
+    
+    return col;
+}
+
+/* Update cursor position moving left with proper screen coordinate tracking */
+curs_lft()
+{
+    char prev_char;
+    int old_log_row;
+    
+    if (buf.cursor_pos <= 0) return;
+    
+    prev_char = gap_char_at(buf.cursor_pos - 1);
+    old_log_row = log_row;
+    
+    /* Update buffer position and line number */
+    set_curs(buf.cursor_pos - 1);
+    
+    /* Update screen coordinates based on character type */
+    if (IS_LINE_END(prev_char)) {
+        /* Moved to previous logical line - need to recalculate column */
+        log_row--;
+        cursor_col = calc_col(buf.cursor_pos);
+    } else if (prev_char == 9) {
+        /* Tab - need to recalculate column since tabs are variable width */
+        cursor_col = calc_col(buf.cursor_pos);
+        /* Check if the new position is on a different visual line */
+        /* This can happen if the tab crossed a visual line boundary */
+        if (cursor_col == 0 && old_log_row > 0) {
+            log_row--;
+            /* cursor_col is already 0, no need to recalculate */
+        }
+    } else {
+        /* Regular character - simple decrement */
+        cursor_col--;
+        if (cursor_col < 0) {
+            /* Wrapped to previous visual line */
+            log_row--;
+            cursor_col = screen_cols - 1;
+        }
+    }
+}
+
+/* Update cursor position moving right with proper screen coordinate tracking */
+curs_rgt()
+{
+    char curr_char;
+    
+    if (buf.cursor_pos >= buf.text_length) return;
+    
+    curr_char = gap_char_at(buf.cursor_pos);
+    
+    /* Update buffer position and line number */
+    set_curs(buf.cursor_pos + 1);
+    
+    /* Update screen coordinates based on character type */
+    if (IS_LINE_END(curr_char)) {
+        /* Moved to next logical line */
+        log_row++;
+        cursor_col = 0;
+    } else {
+        /* Advance column (handles tabs and regular chars) */
+        cursor_col = col_adv(cursor_col, curr_char);
+        if (cursor_col >= screen_cols) {
+            /* Wrapped to next visual line */
+            log_row++;
+            cursor_col = 0;
+        }
+    }
+}
+
+/* Right-align val in wid cells (wid <= 5).  Digits come from subtracting
+ * powers of ten - the 6809 has no divide instruction */
+fmt_num(dst, val, wid)
+char *dst;
+int val, wid;
+{
+    static int pow10[5] = {10000, 1000, 100, 10, 1};
+    int i, lead;
+    char d;
+    
+    if (val < 0) val = 0;
+    if (wid < 5 && val >= pow10[4 - wid]) val = pow10[4 - wid] - 1;
+    
+    lead = 1;
+    for (i = 5 - wid; i < 5; i++) {
+        d = '0';
+        while (val >= pow10[i]) {
+            val -= pow10[i];
+            d++;
+        }
+        if (d == '0' && lead && i < 4) {
+            *dst++ = ' ';
+        } else {
+            lead = 0;
+            *dst++ = d;
+        }
+    }
+}
+
+/* Status line with fixed position fields - rewrites only what changed */
+draw_stat()
+{
+    static int stinit = 0;
+    static int msg_len = 0;      /* Message cells on screen */
+    static int help_md = -1;     /* Help line mode on screen */
+    static int stat_val[SF_NUM];
+    
+    int val[SF_NUM];
+    char cell[8];
+    int i, n, x, mode, drawn;
+    long start;
+    
+    start = out_bytes;
+    drawn = 0;
+    x = screen_cols - STAT_W - 1;
+    
+    val[SF_SEL] = sel_active() ? buf.select_end - buf.select_start : -1;
+    val[SF_LINE] = buf.ccurs_ln + 1;
+    val[SF_TOT] = total_logical_lines;
+    val[SF_COL] = cursor_col;
+    val[SF_SIZE] = buf.text_length >> 10;
+    
+    if (in_search_mode) {
+        mode = HM_SEARCH;
+    } else if (rep_mode == RM_WITH) {
+        mode = HM_WITH;
+    } else if (rep_mode == RM_ASK) {
+        mode = HM_ASK;
+    } else if (in_goto_mode) {
+        mode = HM_GOTO;
+    } else if (in_find_mode) {
+        mode = HM_FIND;
+    } else {
+        mode = HM_EDIT;
+    }
+    
+    /* Whole line: clear it and lay down the field labels */
+    if (!stinit || need_full_redraw) {
+        term_cap(TC_HIDE);
+        term_cap(TC_REVON);
+        drawn = 1;
+        write_pos(0, status_row);
+        term_cap(TC_CLREOL);
+        write_pos(x, status_row);
+        term_txt(stat_tpl, STAT_W);
+        for (i = 0; i < SF_NUM; i++) {
+            stat_val[i] = -2;
+        }
+        msg_len = 0;
+        help_md = -1;
+        stinit = 1;
+    }
+    
+    /* A new message replaces the old one; an old one expires after a key
+     * or TM_MSG, not on a redraw for the idle tasks */
+    if (status_msg[0] != 0 || (msg_len > 0 && msg_exp)) {
+        if (!drawn) {
+            term_cap(TC_HIDE);
+            term_cap(TC_REVON);
+            drawn = 1;
+        }
+        write_pos(0, status_row);
+        n = 0;
+        while (n < x - 1 && status_msg[n] != 0) n++;
+        term_txt(status_msg, n);
+        for (i = n; i < msg_len; i++) {
+            term_chr(' ');
+        }
+        if (n > 0) tm_set(TM_MSG, MSG_MS);
+        msg_len = n;
+        status_msg[0] = 0;
+        msg_exp = 0;
+    }
+    temp_message_active = msg_len > 0;
+    
+    for (i = 0; i < SF_NUM; i++) {
+        if (val[i] == stat_val[i]) continue;
+        stat_val[i] = val[i];
+        if (!drawn) {
+            term_cap(TC_HIDE);
+            term_cap(TC_REVON);
+            drawn = 1;
+        }
+        
+        if (i != SF_SEL) {
+            fmt_num(cell, val[i], sf_wid[i]);
+        } else if (val[i] < 0) {
+            for (n = 0; n < 7; n++) {
+                cell[n] = ' ';
+            }
+        } else {
+            cell[0] = 'S';
+            cell[1] = ':';
+            fmt_num(cell + 2, val[i], 5);
+        }
+        write_pos(x + sf_off[i], status_row);
+        term_txt(cell, sf_wid[i]);
+    }
+    if (drawn) term_cap(TC_REVOFF);
+    
+    /* Help line only changes with the mode */
+    if (mode != help_md) {
+        if (!drawn) {
+            term_cap(TC_HIDE);
+            drawn = 1;
+        }
+        write_pos(0, status_row + 1);
+        write_str(help_txt[mode]);
+        term_cap(TC_CLREOL);
+        help_md = mode;
+    }
+    
+    if (drawn) term_cap(TC_SHOW);
+    stat_out += out_bytes - start;
+}
+
+/* Help Screen Functions */
+
+/* Help command data structure */
+struct HelpCmd {
+    char *full;     /* Full format for tall screens */
+    char *compact;  /* Compact format for short screens */
+    char cat;       /* Category: 'F', 'E', 'S', 'C', 'N', 'D', or 'H' for header */
+};
+
+/* Help table - category headers have cat='H' */
+struct HelpCmd help_table[] = {
+    {"FILE OPERATIONS:", "FILE:", 'H'},
+    {"  ^S              Save file", "^S=Save", 'F'},
+    {"  ^Q              Quit (confirms if unsaved)", "^Q=Quit", 'F'},
+    {"", "", 'F'},
+    
+    {"EDITING:", "EDIT:", 'H'},
+    {"  ^Z              Undo", "^Z=Undo", 'E'},
+    {"  ^Y              Redo", "^Y=Redo", 'E'},
+#ifdef coco3    
+    {"  Break=Backspace       Delete character before cursor", "Break=Del<", 'E'},
+#else
+    {"  Backspace       Delete character before cursor", "BS=Del<", 'E'},
+#endif    
+    {"  Delete          Delete character at cursor", "Del=Del>", 'E'},
+    {"  Tab             Insert tab character", "Tab=Tab", 'E'},
+    {"", "", 'E'},
+    
+    {"SELECTION:", "SELECT:", 'H'},
+    {"  ^A              Select all", "^A=All", 'S'},
+    {"  Shift+Arrows    Select text", "Shft+Arr=Sel", 'S'},
+    {"  Shift+^Arrows   Select by word", "Shft+^Arr=Word", 'S'},
+    {"  ESC             Clear selection", "ESC=Clear", 'S'},
+    {"", "", 'S'},
+    
+    {"CLIPBOARD:", "CLIP:", 'H'},
+    {"  ^C              Copy selection", "^C=Copy", 'C'},
+    {"  ^X              Cut selection", "^X=Cut", 'C'},
+    {"  ^V              Paste from clipboard", "^V=Paste", 'C'},
+    {"", "", 'C'},
+    
+    {"SEARCH & NAVIGATION:", "NAV:", 'H'},
+    {"  ^F              Find text / Find next", "^F=Find", 'N'},
+    {"  ^G              Go to line number", "^G=Goto", 'N'},
+    {"  ^Arrows         Move by word", "^Arr=Word", 'N'},
+    {"  ^Up/Down        Page up/down", "^Up/Dn=Page", 'N'},
+    {"", "", 'N'},
+    
+    {"DISPLAY:", "VIEW:", 'H'},
+#ifdef coco3
+    {"  ^F1              Single-spacing mode", "^F1=Single", 'D'},
+    {"  ^F2              Double-spacing mode", "^F2=Double", 'D'},
+#else    
+    {"  ^1              Single-spacing mode", "^1=Single", 'D'},
+    {"  ^2              Double-spacing mode", "^2=Double", 'D'},
+#endif
+    {"", "", 'D'},
+    
+    {NULL, NULL, 0}
+};
+
+/* Helper to write string through the terminal layer */
+write_str(s)
+char *s;
+{
+    term_txt(s, strlen(s));
+}
+
+/* Display full-screen help overlay - adapts to screen size */
+show_help()
+{
+    int i;
+    
+    in_help_mode = 1;
+    
+    term_cap(TC_CLRSCR);
+    term_cap(TC_HOME);
+    
+    term_cap(TC_NL);
+    term_cap(TC_REVON);
+    
+    /* Choose format based on screen rows */
+    if (screen_rows >= 60) {
+        /* Double-spaced full format for very tall screens (80x60+) */
+        write_str("  F256 Text Editor - Help  ");
+        term_cap(TC_REVOFF);
+        term_cap(TC_NL);
+        term_cap(TC_NL);
+        
+        for (i = 0; help_table[i].full != NULL; i++) {
+            /* Skip blank lines - they're just separators in the table */
+            if (help_table[i].full[0] != 0) {
+                write_str(help_table[i].full);
+                term_cap(TC_NL);
+                /* Add blank line after every line for readability */
+                term_cap(TC_NL);
+            }
+        }
+        
+        /* No extra blank before footer - save space */
+        term_cap(TC_REVON);
+        write_str("Press any key to return to editor");
+        
+    } else if (screen_rows >= 40) {
+        /* Regular full format for tall screens (80x40-80x59) */
+        write_str("  F256 Text Editor - Help  ");
+        term_cap(TC_REVOFF);
+        term_cap(TC_NL);
+        term_cap(TC_NL);
+        
+        for (i = 0; help_table[i].full != NULL; i++) {
+            write_str(help_table[i].full);
+            term_cap(TC_NL);
+        }
+        
+        term_cap(TC_NL);
+        term_cap(TC_REVON);
+        write_str("Press any key to return to editor");
+        
+    } else {
+        /* Compact format for short screens (80x30, 80x24, 40x30) */
+        int first_in_cat;
+        char *cat_name;
+        int cat_len;
+        int spaces_needed;
+        int j;
+        
+        write_str(" Help ");
+        term_cap(TC_REVOFF);
+        term_cap(TC_NL);
+        term_cap(TC_NL);
+        
+        first_in_cat = 0;
+        for (i = 0; help_table[i].compact != NULL; i++) {
+            if (help_table[i].cat == 'H') {
+                /* Category header - calculate spacing to align at column 9 */
+                term_cap(TC_NL);
+                cat_name = help_table[i].compact;
+                cat_len = strlen(cat_name);
+                write_str(cat_name);
+                
+                /* Pad to column 9 (category + spaces = 9) */
+                spaces_needed = 9 - cat_len;
+                for (j = 0; j < spaces_needed; j++) {
+                    write_str(" ");
+                }
+                
+                first_in_cat = 1;
+            } else if (help_table[i].compact[0] != 0) {
+                /* Command - first one on same line, rest indented to column 9 */
+                if (first_in_cat) {
+                    /* First command after category - on same line */
+                    write_str(help_table[i].compact);
+                    first_in_cat = 0;
+                } else {
+                    /* Subsequent commands - on new line, indented to column 9 */
+                    term_cap(TC_NL);
+                    write_str("         ");
+                    write_str(help_table[i].compact);
+                }
+            }
+        }
+        
+        term_cap(TC_NL);
+        term_cap(TC_NL);
+        term_cap(TC_REVON);
+        write_str("Any key=exit");
+    }
+    
+    term_cap(TC_REVOFF);
+}
+
+/* Hide help and return to editor */
+hide_help()
+{
+    in_help_mode = 0;
+    need_full_redraw = 1;
+    upd_fast();
+}
+
+/* Text Selection Functions */
+
+/* Start selection at current cursor */
+start_sel()
+{
+    if (!buf.selecting) {
+        buf.selecting = 1;
+        buf.select_start = buf.cursor_pos;
+        buf.select_end = buf.cursor_pos;
+        buf.selection_anchor = buf.cursor_pos;
+    }
+}
+
+/* Clear selection */
+clr_sel()
+{
+    if (buf.selecting) {
+        dmg_span(buf.select_start, buf.select_end);  /* Clear highlights */
+        buf.selecting = 0;
+        buf.select_start = -1;
+        buf.select_end = -1;
+        buf.selection_anchor = -1;
+    }
+}
+
+/* Damage the cells whose highlight differs between the old selection
+ * [os, oe) and the current one - the symmetric difference of the two */
+sel_dmg(os, oe)
+int os, oe;
+{
+    int ns, ne;
+    
+    ns = -1;
+    ne = -1;
+    if (sel_active()) {
+        ns = buf.select_start;
+        ne = buf.select_end;
+    }
+    if (os < 0 || oe <= os) {
+        dmg_span(ns, ne);
+    } else if (ns < 0) {
+        dmg_span(os, oe);
+    } else if (ne <= os || oe <= ns) {
+        /* Disjoint - both ranges flip */
+        dmg_span(os, oe);
+        dmg_span(ns, ne);
+    } else {
+        /* Overlapping - only the ends moved */
+        dmg_span(os < ns ? os : ns, os < ns ? ns : os);
+        dmg_span(oe < ne ? oe : ne, oe < ne ? ne : oe);
+    }
+}
+
+smart_sel_update()
+{
+    int anchor = buf.selection_anchor;
+    int cursor = buf.cursor_pos;
+    
+    /* Determine boundaries based on cursor position relative to anchor */
+    if (cursor < anchor) {
+        /* Cursor is left of anchor - selection extends left */
+        buf.select_start = cursor;
+        buf.select_end = anchor;
+        sprintf(status_msg, "Selection LEFT: %d-%d (len=%d)", 
+                buf.select_start, buf.select_end, buf.select_end - buf.select_start);
+        
+    } else if (cursor > anchor) {
+        /* Cursor is right of anchor - selection extends right */
+        buf.select_start = anchor;
+        buf.select_end = cursor;
+        sprintf(status_msg, "Selection RIGHT: %d-%d (len=%d)", 
+                buf.select_start, buf.select_end, buf.select_end - buf.select_start);
+        
+    } else {
+        /* Cursor is at anchor - clear selection (zero-length not useful) */
+        buf.selecting = 0;
+        buf.select_start = -1;
+        buf.select_end = -1;
+        buf.selection_anchor = -1;
+        sprintf(status_msg, "Selection cleared");
+    }
+}
+
+
+/* Check if selection is active and valid */
+sel_active()
+{
+    return (buf.selecting && buf.select_start >= 0 && 
+            buf.select_end > buf.select_start);
+}
+
+/* Selection movement functions with screen coordinate updates */
+
+/* Extend selection left - fixed to use proper cursor management */
+ex_left()
+{
+  int os, oe;
+  
+  if (!buf.selecting) start_sel();
+  os = buf.select_start;
+  oe = buf.select_end;
+    
+  if (buf.cursor_pos > 0) {
+    /* Use proper cursor update that handles tabs and line endings */
+    curs_lft();
+        
+    /* Use smart update - no parameters needed, uses cursor_pos and anchor */
+    smart_sel_update();
+    sel_dmg(os, oe);
+  }
+  
+  need_status_update = 1;
+}
+
+/* Extend selection right - fixed to use proper cursor management */
+ex_right()
+{
+  int os, oe;
+  
+  if (!buf.selecting) start_sel();
+  os = buf.select_start;
+  oe = buf.select_end;
+    
+  if (buf.cursor_pos < buf.text_length) {
+    /* Use proper cursor update that handles tabs and line endings */
+    curs_rgt();
+        
+    /* Use smart update - no parameters needed, uses cursor_pos and anchor */
+    smart_sel_update();
+    sel_dmg(os, oe);
+  }
+  
+  need_status_update = 1;
+}
+
+/* Extend selection up */
+ex_up()
+{
+    int os, oe;
+    
+    if (!buf.selecting) start_sel();
+    os = buf.select_start;
+    oe = buf.select_end;
+    move_up();
+    smart_sel_update();
+    sel_dmg(os, oe);
+    need_status_update = 1;
+}
+
+/* Extend selection down */
+ex_down()
+{
+    int os, oe;
+    
+    if (!buf.selecting) start_sel();
+    os = buf.select_start;
+    oe = buf.select_end;
+    move_down();
+    smart_sel_update();
+    sel_dmg(os, oe);
+    need_status_update = 1;
+}
+
+/* Extend selection word left */
+ex_wd_left()
+{
+    int os, oe;
+    
+    if (!buf.selecting) start_sel();
+    os = buf.select_start;
+    oe = buf.select_end;
+    word_left();  /* Use existing word movement function */
+    smart_sel_update();
+    sel_dmg(os, oe);
+    need_status_update = 1;
+}
+
+/* Extend selection word right */
+ex_wd_right()
+{
+    int os, oe;
+    
+    if (!buf.selecting) start_sel();
+    os = buf.select_start;
+    oe = buf.select_end;
+    word_right(); /* Use existing word movement function */
+    smart_sel_update();
+    sel_dmg(os, oe);
+    need_status_update = 1;
+}
+
+/* Select all text */
+sel_all()
+{
+    buf.selecting = 1;
+    buf.selection_anchor = 0;
+    buf.select_start = 0;
+    buf.select_end = buf.text_length;
+    dmg_span(0, buf.text_length);
+    buf.cursor_pos = buf.text_length;
+    strcpy(status_msg, "All text selected");
+    need_status_update = 1;
+}
+
+/* Delete selected text using gap buffer operations - 0 if it cannot be
+ * undone (see un_del()) */
+del_sel()
+{
+    int del_len, ok;
+    
+    if (!buf.selecting || buf.select_start < 0 || buf.select_end <= buf.select_start) {
+        return 1;  /* No valid selection */
+    }
+    
+    del_len = buf.select_end - buf.select_start;
+    un_open = 0;
+    ok = un_del(buf.select_start, del_len);
+    un_open = 0;
+    
+    /* Move gap to selection start position */
+    move_gap_to(buf.select_start);
+    
+    /* Expand gap to cover the selected text - this "deletes" it */
+    buf.gap_end += del_len;
+    
+    /* Validate gap doesn't exceed buffer bounds */
+    if (buf.gap_end > BUF_SIZE) {
+        buf.gap_end = BUF_SIZE;
+    }
+    
+    /* Update buffer state */
+    buf.text_length -= del_len;
+    buf.cursor_pos = buf.select_start;
+    set_dirty(1);
+    dmg_text(buf.select_start, 0, del_len);
+    buf.select_end = buf.select_start;  /* Nothing left to un-highlight */
+    
+    /* Recount total lines after deleting selection */
+    it_start(IT_LINES);
+    
+    /* Clear selection state */
+    clr_sel();
+    return ok;
+}
+
+/* Replace the existing copy_sel() function around line 1200 */
+copy_sel()
+{
+    int sel_len;
+    
+    if (!sel_active()) {
+        strcpy(status_msg, "Nothing selected to copy");
+        need_status_update = 1;
+        return;
+    }
+    
+    if (!clipboard.initialized) {
+        strcpy(status_msg, "No clipboard available");
+        need_status_update = 1;
+        return;
+    }
+    
+    sel_len = buf.select_end - buf.select_start;
+    if (sel_len <= 0) return;
+    
+    /* Check if selection fits in 8K clipboard */
+    if (sel_len > clipboard.max_capacity) {
+        sprintf(status_msg, "Selection too large (%d chars, max 8K)", sel_len);
+        need_status_update = 1;
+        return;
+    }
+    
+    /* Copy selection to fixed clipboard */
+    copy_gap_selection_to_clipboard(sel_len);
+    clipboard.data_length = sel_len;
+    sprintf(status_msg, "Copied %d chars to clipboard", sel_len);
+    need_status_update = 1;
+}
+
+/* Add this new function after copy_sel() */
+paste_clipboard()
+{
+    int i, p, g, ok;
+    
+    if (!clipboard.initialized) {
+        strcpy(status_msg, "No clipboard available");
+        need_status_update = 1;
+        return;
+    }
+    
+    if (clipboard.data_length <= 0) {
+        strcpy(status_msg, "Clipboard empty");
+        need_status_update = 1;
+        return;
+    }
+    
+    /* Replace selection if active - one undo for both */
+    g = undo_grp;
+    if (g == 0) undo_grp = ++grp_seq;
+    ok = 1;
+    if (sel_active()) {
+        ok = del_sel();
+        un_skip = !ok;
+    }
+    
+    /* Insert clipboard contents at cursor */
+    p = buf.cursor_pos;
+    for (i = 0; i < clipboard.data_length; i++) {
+        if (!gap_has_space()) {
+            sprintf(status_msg, "Buffer full - pasted %d of %d chars", i, clipboard.data_length);
+            need_status_update = 1;
+            break;
+        }
+        
+        ensure_gap_at_cursor();
+        *(text_ptr + buf.gap_start) = clipboard.mapped_addr[i];
+        buf.gap_start++;
+        buf.cursor_pos++;
+        buf.text_length++;
+    }
+    
+    un_open = 0;
+    un_ins(p, i);
+    un_open = 0;
+    undo_grp = g;
+    un_skip = 0;
+    set_dirty(1);
+    sprintf(status_msg, "Pasted %d chars from clipboard", clipboard.data_length);
+    if (!ok) strcat(status_msg, " - too big to undo");
+    temp_message_active = 1;
+    it_start(IT_LINES);  /* Recount after paste */
+    dmg_text(buf.cursor_pos - clipboard.data_length, clipboard.data_length, 0);
+    need_status_update = 1;
+}
+
+/* Word Movement Functions */
+
+/* Check if character is part of a word */
+is_word_char(ch)
+char ch;
+{
+    return ((ch >= 'a' && ch <= 'z') || 
+            (ch >= 'A' && ch <= 'Z') || 
+            (ch >= '0' && ch <= '9') || 
+            ch == '_');
+}
+
+/* Find start of current word */
+fdwd_start(pos)
+int pos;
+{
+    /* Skip non-word chars backwards */
+    while (pos > 0 && !is_word_char(*(text_ptr + pos - 1))) {
+        pos = pos - 1;
+    }
+    
+    /* Find start of word */
+    while (pos > 0 && is_word_char(*(text_ptr + pos - 1))) {
+        pos = pos - 1;
+    }
     
-    prev_char = gap_char_at(buf.cursor_pos - 1);
-    old_log_row = log_row;
+    return pos;
+}
+
+/* Find end of current word */
+fdwd_end(pos)
+int pos;
+{
+    /* Skip non-word chars forward */
+    while (pos < buf.text_length && !is_word_char(*(text_ptr + pos))) {
+        pos = pos + 1;
+    }
     
-    /* Update buffer position and line number */
-    set_curs(buf.cursor_pos - 1);
+    /* Find end of word */
+    while (pos < buf.text_length && is_word_char(*(text_ptr + pos))) {
+        pos = pos + 1;
+    }
     
-    /* Update screen coordinates based on character type */
-    if (IS_LINE_END(prev_char)) {
-        /* Moved to previous logical line - need to recalculate column */
-        log_row--;
-        cursor_col = calc_col(buf.cursor_pos);
-    } else if (prev_char == 9) {
-        /* Tab - need to recalculate column since tabs are variable width */
-        cursor_col = calc_col(buf.cursor_pos);
-        /* Check if the new position is on a different visual line */
-        /* This can happen if the tab crossed a visual line boundary */
-        if (cursor_col == 0 && old_log_row > 0) {
-            log_row--;
-            /* cursor_col is already 0, no need to recalculate */
-        }
-    } else {
-        /* Regular character - simple decrement */
-        cursor_col--;
-        if (cursor_col < 0) {
-            /* Wrapped to previous visual line */
-            log_row--;
-            cursor_col = screen_cols - 1;
-        }
+    return pos;
+}
+
+/* Move cursor to start of previous word */
+word_left()
+{
+    int new_pos;
+    
+    if (buf.cursor_pos <= 0) return;
+    
+    new_pos = buf.cursor_pos - 1;
+    
+    while (new_pos > 0 && is_word_char(gap_char_at(new_pos))) {
+        new_pos = new_pos - 1;
+    }
+    
+    while (new_pos > 0 && !is_word_char(gap_char_at(new_pos))) {
+        new_pos = new_pos - 1;
+    }
+    
+    while (new_pos > 0 && is_word_char(gap_char_at(new_pos - 1))) {
+        new_pos = new_pos - 1;
     }
+    
+    set_curs(new_pos);  /* Use cached update */
+    /* clr_sel(); */
 }
 
-/* Update cursor position moving right with proper screen coordinate tracking */
-curs_rgt()
+/* Move cursor to start of next word */
+word_right()
 {
-    char curr_char;
+    int new_pos;
     
     if (buf.cursor_pos >= buf.text_length) return;
     
-    curr_char = gap_char_at(buf.cursor_pos);
+    new_pos = buf.cursor_pos;
     
-    /* Update buffer position and line number */
-    set_curs(buf.cursor_pos + 1);
+    while (new_pos < buf.text_length && is_word_char(gap_char_at(new_pos))) {
+        new_pos = new_pos + 1;
+    }
     
-    /* Update screen coordinates based on character type */
-    if (IS_LINE_END(curr_char)) {
-        /* Moved to next logical line */
-        log_row++;
+    while (new_pos < buf.text_length && !is_word_char(gap_char_at(new_pos))) {
+        new_pos = new_pos + 1;
+    }
+    
+    set_curs(new_pos);  /* Use cached update */
+    /* clr_sel()'*/
+}
+
+/* Helper function to position cursor at same relative screen position */
+page_curs(new_screen_top)
+int new_screen_top;
+{
+    int i, relative_row, target_pos, next_pos;
+    
+    /* Only adjust if cursor is currently in text area */
+    if (log_row < 0 || log_row >= eff_rows) {
+        return;  /* Cursor not in text area */
+    }
+    
+    /* Calculate which visual line cursor is on */
+    relative_row = log_row;
+    target_pos = new_screen_top;
+    
+    /* Advance to same relative visual line */
+    for (i = 0; i < relative_row && target_pos < buf.text_length; i++) {
+        next_pos = visln_next(target_pos);
+        if (next_pos <= target_pos || next_pos > buf.text_length) break;
+        target_pos = next_pos;
+    }
+    
+    /* Ensure cursor stays within buffer bounds */
+    if (target_pos > buf.text_length) {
+        target_pos = buf.text_length;
+    }
+    
+    set_curs(target_pos);
+}
+
+/* Simplified page_up using helper */
+page_up()
+{
+    int i, new_top_pos, lines_to_scroll, prev_pos;
+    int original_top_pos;
+
+    original_top_pos = get_top_pos();
+    new_top_pos = original_top_pos;
+    lines_to_scroll = eff_rows;  /* Use effective rows for proper scrolling */
+    
+    /* Scroll up by screen height */
+    for (i = 0; i < lines_to_scroll && new_top_pos > 0; i++) {
+        prev_pos = new_top_pos;
+        new_top_pos = visln_pre(new_top_pos);
+        if (new_top_pos >= prev_pos) break;
+    }
+    
+    if (new_top_pos < 0) new_top_pos = 0;
+
+    /* Check if we're already at the top */
+    if (new_top_pos == original_top_pos && original_top_pos == 0) {
+        /* Already at top of file - just move cursor to top of screen */
+        set_curs(0);
+        log_row = 0;  /* First logical row */
         cursor_col = 0;
+        clr_sel();
+        return;
+    }
+    
+    /* Update screen */
+    buf.topscr_pos = new_top_pos;
+    
+    /* Position cursor at same relative location */
+    page_curs(new_top_pos);
+    clr_sel();
+}
+
+/* Simplified page_down using helper */
+page_down()
+{
+    int i, new_top_pos, lines_to_scroll, next_pos;
+    int last_line_start, max_reasonable_top;
+    
+    new_top_pos = get_top_pos();
+    lines_to_scroll = eff_rows;  /* Use effective rows for proper scrolling */
+    
+    /* Calculate maximum scroll position */
+    if (buf.text_length > 0) {
+        last_line_start = line_sta(buf.text_length - 1);
+        max_reasonable_top = last_line_start;
     } else {
-        /* Advance column (handles tabs and regular chars) */
-        cursor_col = col_adv(cursor_col, curr_char);
-        if (cursor_col >= screen_cols) {
-            /* Wrapped to next visual line */
-            log_row++;
-            cursor_col = 0;
+        max_reasonable_top = 0;
+    }
+    
+    /* Scroll down by screen height */
+    for (i = 0; i < lines_to_scroll && new_top_pos < buf.text_length; i++) {
+        next_pos = visln_next(new_top_pos);
+        if (next_pos <= new_top_pos || next_pos > max_reasonable_top) break;
+        new_top_pos = next_pos;
+    }
+    
+    if (new_top_pos > buf.text_length) new_top_pos = buf.text_length;
+    
+    /* Update screen */
+    buf.topscr_pos = new_top_pos;
+    
+    /* Position cursor at same relative location */
+    page_curs(new_top_pos);
+    clr_sel();
+}
+
+/* Search Functions */
+
+/* Start search mode */
+strtsch()
+{
+    in_search_mode = 1;
+    temp_search_str[0] = 0;
+    inc_org = buf.cursor_pos;
+    inc_top = buf.topscr_pos;
+    buf.search_active = 1;
+    if (sel_active()) {
+        /* A selection scope searches this one now */
+        sc_beg = buf.select_start;
+        sc_end = buf.select_end;
+        sc_have = 1;
+        sch_rgn();
+    }
+    sch_pmt();
+}
+
+/* Set sch_lo and sch_hi for sch_scope.  The index is of the old ones. */
+sch_rgn()
+{
+    if (sch_scope == SC_SEL) {
+        sch_lo = sc_beg;
+        sch_hi = sc_end;
+    } else {
+        sch_lo = 0;
+        sch_hi = BUF_SIZE;
+    }
+    fa_ok = 0;
+    fa_big = 0;
+}
+
+/* Text changed at pos - see dmg_text().  The selection scope moves with
+ * edits before it, and grows or shrinks with those inside it. */
+sc_edit(pos, ins, del)
+int pos, ins, del;
+{
+    if (!sc_have) return;
+    if (pos + del <= sc_beg) {
+        sc_beg += ins - del;
+        sc_end += ins - del;
+    } else if (pos < sc_end) {
+        if (pos < sc_beg) sc_beg = pos;
+        sc_end = pos + del >= sc_end ? pos + ins : sc_end + ins - del;
+    } else {
+        return;
+    }
+    if (sch_scope == SC_SEL) {
+        sch_lo = sc_beg;
+        sch_hi = sc_end;
+    }
+}
+
+/* Show the search modes - as the prompt while typing, else on their own */
+sch_pmt()
+{
+    char *c, *w, *x, *e, *o;
+    int n;
+    
+    c = sch_case ? " [Aa]" : "";
+    w = sch_word ? " [word]" : "";
+    x = sch_rx ? " [.*]" : "";
+    o = sch_scope == SC_SEL ? " [sel]" : sch_scope == SC_ALL ? " [all]" : "";
+    if (in_search_mode) {
+        n = strlen(temp_search_str);
+        e = "";
+        if (n > 0 && inc_stk[n - 1] == -2) {
+            e = "  (bad pattern)";
+        } else if (n > 0 && inc_stk[n - 1] < 0) {
+            e = "  (not found)";
+        }
+        sprintf(status_msg, "%s%s%s%s%s: %s%s", rep_want ? "Replace" : "Find",
+                c, w, x, o, temp_search_str, e);
+    } else {
+        sprintf(status_msg, "Ignore case %s, whole words %s, regex %s, %s",
+                sch_case ? "on" : "off", sch_word ? "on" : "off",
+                sch_rx ? "on" : "off",
+                sch_scope == SC_SEL ? "in selection" :
+                sch_scope == SC_ALL ? "whole buffer" : "from cursor");
+    }
+    need_status_update = 1;
+}
+
+/* End search mode */
+end_search()
+{
+    if (temp_search_str[0] != 0) {
+        /* Back to where the prompt opened */
+        clr_sel();
+        set_curs(inc_org);
+        buf.topscr_pos = inc_top;
+    }
+    in_search_mode = 0;
+    in_find_mode = 0;
+    rep_want = 0;
+    fa_hide();
+    buf.search_active = 0;
+    temp_search_str[0] = 0;
+    strcpy(status_msg, "Find cancelled");
+    need_status_update = 1;
+}
+
+/* Handle search mode keys */
+search_keys(key)
+int key;
+{
+    int len;
+    
+    if (key == KEY_ESC) {
+        end_search();
+    } else if (key == KEY_ENTER) {
+        sch_go(0);
+    } else if (key == 127 || key == KEY_BS) {  /* Backspace */
+        len = strlen(temp_search_str);
+        if (len > 0) {
+            /* Pop back to the shorter string's match */
+            temp_search_str[len - 1] = 0;
+            inc_show();
+        }
+    } else if (key >= 32 && key < 127) {
+        len = strlen(temp_search_str);
+        if (len < MAX_SEARCH - 1) {
+            temp_search_str[len] = key;
+            temp_search_str[len + 1] = 0;
+            inc_step(len + 1);
+            inc_show();
         }
     }
 }
 
-/* Enhanced status line with right-aligned position info */
-draw_stat()
+/* Leave the prompt for find mode.  A typed string keeps the match found
+ * while typing; a blank one searches again for the last string. */
+sch_go(back)
+int back;
 {
-    static char cached_status_msg[80] = "";
-    static int stinit = 0;  /* Renamed from status_msg_initialized to avoid 8-char conflict */
-    static int last_right_len = 0;
-    
-    char right_buf[50];
-    int right_len;
-    int left_len;
-    int padding;
-    int i;
-    int status_changed;
-    int pad_needed;
-    
-    /* Hide cursor while drawing status and help lines */
-    write_block(1, HIDE_CURSOR, 2);
+    int n;
     
-    /* Build right side with position info */
-    if (sel_active()) {
-        sprintf(right_buf, "S:%d L:%d/%d C:%d %dK", 
-                buf.select_end - buf.select_start,
-                buf.ccurs_ln + 1,
-                total_logical_lines,
-                cursor_col,
-                buf.text_length / 1024);
+    n = strlen(temp_search_str);
+    if (n > 0) strcpy(buf.search_str, temp_search_str);
+    if (buf.search_str[0] == 0) return;  /* Nothing to find - stay */
+    if (!sch_ok()) return;               /* Or a bad pattern to fix */
+    in_search_mode = 0;
+    in_find_mode = 1;
+    if (back) {
+        if (n > 0) set_curs(inc_org);
+        if (sch_scope != SC_CURS) {
+            /* Back from the end of the scope */
+            set_curs(sch_hi < buf.text_length ? sch_hi : buf.text_length);
+        }
+        find_prev();
+    } else if (n > 0 && inc_stk[n - 1] >= 0) {
+        sch_len = inc_len[n - 1];
+        sch_hit(inc_stk[n - 1], 0);
+    } else if (sch_scope != SC_CURS) {
+        sch_next(sch_lo);
     } else {
-        sprintf(right_buf, "L:%d/%d C:%d %dK",
-                buf.ccurs_ln + 1,
-                total_logical_lines,
-                cursor_col,
-                buf.text_length / 1024);
+        find_next();
     }
-    
-    right_len = strlen(right_buf);
-    
-    /* Pad right_buf if shorter than last time to cover old text */
-    pad_needed = last_right_len - right_len;
-    if (pad_needed > 0) {
-        for (i = 0; i < pad_needed; i++) {
-            right_buf[right_len + i] = ' ';
-        }
-        right_buf[right_len + pad_needed] = '\0';
-        right_len = last_right_len;
+    if (rep_want) {
+        rep_want = 0;
+        if (in_find_mode) rep_with();
     }
+}
+
+/* Incremental search for the first n bytes typed.  Adding a byte can
+ * only move the first match later, so the scan starts at the match for
+ * n - 1 bytes rather than where the prompt opened; once a prefix has
+ * failed every longer string fails too.  Neither holds for a regular
+ * expression, which always starts from where the prompt opened. */
+inc_step(n)
+int n;
+{
+    char pat[MAX_SEARCH];
+    int i, from;
+    
+    from = n > 1 && !sch_rx ? inc_stk[n - 2] :
+           sch_scope == SC_CURS ? inc_org : sch_lo;
+    i = -1;
+    if (from >= 0) {
+        memcpy(pat, temp_search_str, n);
+        pat[n] = 0;
+        sch_prep(pat);
+        i = sch_fwd(from);
+        if (i < 0) i = sch_fwd(sch_lo);  /* Wrapped */
+        if (rx_err) i = -2;
+    }
+    inc_stk[n - 1] = i;
+    inc_len[n - 1] = sch_len;
+}
+
+/* Show the match for the string typed so far - none typed goes back to
+ * where the prompt opened, a failed one leaves the last match shown */
+inc_show()
+{
+    int n;
     
-    /* Check if status message changed and set temp_message_active */
-    if (strlen(status_msg) > 0) {
-        temp_message_active = 1;
-    } else {
-        temp_message_active = 0;
+    n = strlen(temp_search_str);
+    if (n == 0) {
+        clr_sel();
+        set_curs(inc_org);
+        buf.topscr_pos = inc_top;
+    } else if (inc_stk[n - 1] >= 0) {
+        sch_show(inc_stk[n - 1], inc_len[n - 1]);
     }
-    status_changed = strcmp(status_msg, cached_status_msg) != 0;
-    
-    /* Turn on reverse video */
-    write_block(1, REV_ON, 2);
+    sch_pmt();
+}
+
+/* Search modes changed in the prompt - every length again */
+inc_redo()
+{
+    int i, n;
     
-    /* Only do full redraw with CLEAR_EOL if status message changed or first time */
-    if (status_changed || !stinit || need_full_redraw) {
-        /* Position cursor to start of status line */
-        putchar(0x02);
-        putchar(0 + 0x20);
-        putchar(status_row + 0x20);
-        
-        /* Clear entire line */
-        write_block(1, CLEAR_EOL, 1);
-        
-        /* Reposition to start of line (cursor may have moved after CLEAR_EOL) */
-        putchar(0x02);
-        putchar(0 + 0x20);
-        putchar(status_row + 0x20);
-        
-        /* Write message on left if present */
-        if (temp_message_active) {
-            left_len = strlen(status_msg);
-            
-            /* Check if message + right side would overflow */
-            if (left_len + right_len >= screen_cols) {
-                /* Too long - truncate message */
-                left_len = screen_cols - right_len - 1;
-                if (left_len < 0) left_len = 0;
-            }
-            
-            /* Write only the amount that fits */
-            write_block(1, status_msg, left_len);
-            strcpy(cached_status_msg, status_msg);
-            strcpy(status_msg, "");
-        } else {
-            strcpy(cached_status_msg, "");
-        }
-        
-        /* Position cursor to right side and write position info */
-        putchar(0x02);
-        putchar((screen_cols - right_len - 1) + 0x20);
-        putchar(status_row + 0x20);
-        write_str(right_buf);
-        
-        stinit = 1;
+    n = strlen(temp_search_str);
+    for (i = 1; i <= n; i++) {
+        inc_step(i);
     }
-    else {
-        /* Status message unchanged - only update right side (no CLEAR_EOL = no flash!) */
-        putchar(0x02);
-        putchar((screen_cols - right_len - 1) + 0x20);
-        putchar(status_row + 0x20);
-        write_str(right_buf);
+    inc_show();
+}
+
+/* Build the skip table for pat unless it is already built.
+ * A window whose last byte is c moves on by skip_tab[c].  The pattern's
+ * own last byte has 0 there, so the scan needs one test per window;
+ * such windows are checked and then move on by skip_last.  With
+ * sch_case both cases of a letter share an entry, so the scan reads
+ * raw bytes and only the check goes through fold_tab[].  With sch_rx
+ * pat is compiled by rx_comp() instead. */
+sch_prep(pat)
+char *pat;
+{
+    int i, m;
+    unsigned x, y, z;
+
+    if (skip_len > 0 && skip_case == sch_case && skip_word == sch_word &&
+        skip_rx == sch_rx && strcmp(skip_str, pat) == 0) return;
+    strcpy(skip_str, pat);
+    m = strlen(skip_str);
+    skip_len = m;
+    skip_case = sch_case;
+    skip_word = sch_word;
+    skip_rx = sch_rx;
+    fa_ok = 0;
+    fa_big = 0;
+    tg_np = 0;
+    for (i = 0; i < 256; i++) {
+        fold_tab[i] = (sch_case && i >= 'A' && i <= 'Z') ? i + 32 : i;
+        wc_tab[i] = is_word_char(i);
+        skip_tab[i] = m;
+        rskip_tab[i] = m;
+    }
+    if (skip_rx) {
+        rx_comp(skip_str);
+        return;
     }
-    
-    write_block(1, REV_OFF, 2);
-    
-    /* Remember right_len for next time to handle padding */
-    last_right_len = right_len;
-    
-    /* Enhanced help line - simplified with full help screen available */
-    putchar(0x02);
-    putchar(0 + 0x20);
-    putchar((status_row + 1) + 0x20);
-#ifdef coco3
-    if (in_search_mode) {
-        printf("Ctrl+F=Find  Enter=Find  F1=Cancel");
-    } else if (in_goto_mode) {
-        printf("Enter line number  Enter=Go  F1=Cancel");
-    } else if (in_find_mode) {
-        printf("Ctrl+F=Find Next  Start typing to exit find mode");
-    } else {
-        printf("Ctrl+H for Help");
+    rx_err = NULL;
+    sch_len = m;
+    for (i = 0; i < m; i++) {
+        skip_pat[i] = fold_tab[skip_str[i] & 0xFF];
     }
-#else    
-    if (in_search_mode) {
-        printf("Ctrl+F=Find  Enter=Find  ESC=Cancel");
-    } else if (in_goto_mode) {
-        printf("Enter line number  Enter=Go  ESC=Cancel");
-    } else if (in_find_mode) {
-        printf("Ctrl+F=Find Next  Start typing to exit find mode");
-    } else {
-        printf("Ctrl+H for Help");
+    for (i = 0; i < m - 1; i++) {
+        skip_tab[skip_pat[i]] = m - 1 - i;
+    }
+    for (i = m - 1; i > 0; i--) {
+        rskip_tab[skip_pat[i]] = i;
+    }
+    if (tg_tab != NULL) {
+        for (i = 0; i + 2 < m; i++) {
+            x = skip_str[i] & 0xFF;
+            y = skip_str[i + 1] & 0xFF;
+            z = skip_str[i + 2] & 0xFF;
+            tg_pat[tg_np++] = TG_HASH(TG_LOW(x), TG_LOW(y), TG_LOW(z));
+        }
+    }
+    skip_last = skip_tab[skip_pat[m - 1]];
+    skip_tab[skip_pat[m - 1]] = 0;
+    rskip_first = rskip_tab[skip_pat[0]];
+    rskip_tab[skip_pat[0]] = 0;
+    if (sch_case) {
+        for (i = 'A'; i <= 'Z'; i++) {
+            skip_tab[i] = skip_tab[i + 32];
+            rskip_tab[i] = rskip_tab[i + 32];
+        }
     }
-#endif    
-    /* Clear to end of help line */
-    write_block(1, CLEAR_EOL, 1);
-    
-    /* Show cursor again */
-    write_block(1, SHOW_CURSOR, 2);
 }
 
-/* Help Screen Functions */
-
-/* Help command data structure */
-struct HelpCmd {
-    char *full;     /* Full format for tall screens */
-    char *compact;  /* Compact format for short screens */
-    char cat;       /* Category: 'F', 'E', 'S', 'C', 'N', 'D', or 'H' for header */
-};
-
-/* Help table - category headers have cat='H' */
-struct HelpCmd help_table[] = {
-    {"FILE OPERATIONS:", "FILE:", 'H'},
-    {"  ^S              Save file", "^S=Save", 'F'},
-    {"  ^Q              Quit (confirms if unsaved)", "^Q=Quit", 'F'},
-    {"", "", 'F'},
-    
-    {"EDITING:", "EDIT:", 'H'},
-    {"  ^Z              Undo (50 levels)", "^Z=Undo", 'E'},
-#ifdef coco3    
-    {"  Break=Backspace       Delete character before cursor", "Break=Del<", 'E'},
-#else
-    {"  Backspace       Delete character before cursor", "BS=Del<", 'E'},
-#endif    
-    {"  Delete          Delete character at cursor", "Del=Del>", 'E'},
-    {"  Tab             Insert tab character", "Tab=Tab", 'E'},
-    {"", "", 'E'},
-    
-    {"SELECTION:", "SELECT:", 'H'},
-    {"  ^A              Select all", "^A=All", 'S'},
-    {"  Shift+Arrows    Select text", "Shft+Arr=Sel", 'S'},
-    {"  Shift+^Arrows   Select by word", "Shft+^Arr=Word", 'S'},
-    {"  ESC             Clear selection", "ESC=Clear", 'S'},
-    {"", "", 'S'},
-    
-    {"CLIPBOARD:", "CLIP:", 'H'},
-    {"  ^C              Copy selection", "^C=Copy", 'C'},
-    {"  ^X              Cut selection", "^X=Cut", 'C'},
-    {"  ^V              Paste from clipboard", "^V=Paste", 'C'},
-    {"", "", 'C'},
-    
-    {"SEARCH & NAVIGATION:", "NAV:", 'H'},
-    {"  ^F              Find text / Find next", "^F=Find", 'N'},
-    {"  ^G              Go to line number", "^G=Goto", 'N'},
-    {"  ^Arrows         Move by word", "^Arr=Word", 'N'},
-    {"  ^Up/Down        Page up/down", "^Up/Dn=Page", 'N'},
-    {"", "", 'N'},
-    
-    {"DISPLAY:", "VIEW:", 'H'},
-#ifdef coco3
-    {"  ^F1              Single-spacing mode", "^F1=Single", 'D'},
-    {"  ^F2              Double-spacing mode", "^F2=Double", 'D'},
-#else    
-    {"  ^1              Single-spacing mode", "^1=Single", 'D'},
-    {"  ^2              Double-spacing mode", "^2=Double", 'D'},
-#endif
-    {"", "", 'D'},
-    
-    {NULL, NULL, 0}
-};
+/* Whole-word test, made only on a full match at i.  gap_char_at() gives
+ * 0 past either end, which is not a word byte. */
+sch_wb(i)
+int i;
+{
+    return !wc_tab[gap_char_at(i - 1) & 0xFF] &&
+           !wc_tab[gap_char_at(i + sch_len) & 0xFF];
+}
 
-/* Helper to write string using write_block */
-write_str(s)
-char *s;
+/* First match at or after from, -1 if none - in the scope, so the work
+ * is bounded by its size, and with -ix only in the blocks the index
+ * can't rule out. */
+sch_fwd(from)
+int from;
 {
-    write_block(1, s, strlen(s));
+    int i, hi;
+
+    if (skip_rx) return rx_fwd(from);
+    i = from > sch_lo ? from : sch_lo;
+    hi = sch_hi < buf.text_length ? sch_hi : buf.text_length;
+    if (tg_np > 0 && !rx_rw) return tg_fwd(i, hi);
+    return lit_fwd(i, hi);
 }
 
-/* Display full-screen help overlay - adapts to screen size */
-show_help()
+/* First literal match starting at i or later and ending by hi.  Windows
+ * before the gap and after it are read straight from the two spans;
+ * only the few that straddle the gap go through gap_char_at(). */
+lit_fwd(i, hi)
+int i, hi;
 {
-    int i;
-    
-    in_help_mode = 1;
-    
-    write_block(1, CLEAR_SCREEN, 1);
-    write_block(1, HOME_CURSOR, 1);
-    
-    write_str("\n");
-    write_block(1, REV_ON, 2);
-    
-    /* Choose format based on screen rows */
-    if (screen_rows >= 60) {
-        /* Double-spaced full format for very tall screens (80x60+) */
-        write_str("  F256 Text Editor - Help  ");
-        write_block(1, REV_OFF, 2);
-        write_str("\n\n");
-        
-        for (i = 0; help_table[i].full != NULL; i++) {
-            /* Skip blank lines - they're just separators in the table */
-            if (help_table[i].full[0] != 0) {
-                write_str(help_table[i].full);
-                write_str("\n");
-                /* Add blank line after every line for readability */
-                write_str("\n");
-            }
+    int j, k, m, end, gl;
+    char *t;
+
+    m = skip_len;
+    
+    /* Windows wholly before the gap */
+    t = text_ptr;
+    end = (buf.gap_start < hi ? buf.gap_start : hi) - m;
+    while (i <= end) {
+        k = skip_tab[t[i + m - 1] & 0xFF];
+        if (k == 0) {
+            for (j = 0; j < m - 1 && fold_tab[t[i + j] & 0xFF] == skip_pat[j]; j++);
+            if (j == m - 1 && (!skip_word || sch_wb(i))) return i;
+            k = skip_last;
         }
-        
-        /* No extra blank before footer - save space */
-        write_block(1, REV_ON, 2);
-        write_str("Press any key to return to editor");
-        
-    } else if (screen_rows >= 40) {
-        /* Regular full format for tall screens (80x40-80x59) */
-        write_str("  F256 Text Editor - Help  ");
-        write_block(1, REV_OFF, 2);
-        write_str("\n\n");
-        
-        for (i = 0; help_table[i].full != NULL; i++) {
-            write_str(help_table[i].full);
-            write_str("\n");
+        i += k;
+    }
+    
+    /* Windows straddling it */
+    end = hi - m;
+    while (i < buf.gap_start && i <= end) {
+        k = skip_tab[gap_char_at(i + m - 1) & 0xFF];
+        if (k == 0) {
+            for (j = 0; j < m - 1 &&
+                 fold_tab[gap_char_at(i + j) & 0xFF] == skip_pat[j]; j++);
+            if (j == m - 1 && (!skip_word || sch_wb(i))) return i;
+            k = skip_last;
         }
-        
-        write_str("\n");
-        write_block(1, REV_ON, 2);
-        write_str("Press any key to return to editor");
-        
-    } else {
-        /* Compact format for short screens (80x30, 80x24, 40x30) */
-        int first_in_cat;
-        char *cat_name;
-        int cat_len;
-        int spaces_needed;
-        int j;
-        
-        write_str(" Help ");
-        write_block(1, REV_OFF, 2);
-        write_str("\n\n");
-        
-        first_in_cat = 0;
-        for (i = 0; help_table[i].compact != NULL; i++) {
-            if (help_table[i].cat == 'H') {
-                /* Category header - calculate spacing to align at column 9 */
-                write_str("\n");
-                cat_name = help_table[i].compact;
-                cat_len = strlen(cat_name);
-                write_str(cat_name);
-                
-                /* Pad to column 9 (category + spaces = 9) */
-                spaces_needed = 9 - cat_len;
-                for (j = 0; j < spaces_needed; j++) {
-                    write_str(" ");
-                }
-                
-                first_in_cat = 1;
-            } else if (help_table[i].compact[0] != 0) {
-                /* Command - first one on same line, rest indented to column 9 */
-                if (first_in_cat) {
-                    /* First command after category - on same line */
-                    write_str(help_table[i].compact);
-                    first_in_cat = 0;
-                } else {
-                    /* Subsequent commands - on new line, indented to column 9 */
-                    write_str("\n");
-                    write_str("         ");
-                    write_str(help_table[i].compact);
-                }
-            }
+        i += k;
+    }
+    
+    /* Windows after it - logical i is at t[i] */
+    gl = buf.gap_end - buf.gap_start;
+    t = text_ptr + gl;
+    while (i <= end) {
+        k = skip_tab[t[i + m - 1] & 0xFF];
+        if (k == 0) {
+            for (j = 0; j < m - 1 && fold_tab[t[i + j] & 0xFF] == skip_pat[j]; j++);
+            if (j == m - 1 && (!skip_word || sch_wb(i))) return i;
+            k = skip_last;
         }
-        
-        write_str("\n\n");
-        write_block(1, REV_ON, 2);
-        write_str("Any key=exit");
+        i += k;
     }
-    
-    write_block(1, REV_OFF, 2);
+    return -1;
 }
 
-/* Hide help and return to editor */
-hide_help()
+/* Last match starting at or before from, -1 if none */
+sch_bwd(from)
+int from;
 {
-    in_help_mode = 0;
-    need_full_redraw = 1;
-    upd_fast();
-}
+    int hi;
 
-/* Text Selection Functions */
+    if (skip_rx) return rx_bwd(from);
+    hi = sch_hi < buf.text_length ? sch_hi : buf.text_length;
+    if (tg_np > 0) return tg_bwd(from, hi);
+    return lit_bwd(from, sch_lo, hi);
+}
 
-/* Start selection at current cursor */
-start_sel()
+/* Last literal match starting between lo and i and ending by hi.  The
+ * mirror of lit_fwd(): windows are tested at their first byte and move
+ * back by rskip_tab[] of it. */
+lit_bwd(i, lo, hi)
+int i, lo, hi;
 {
-    if (!buf.selecting) {
-        buf.selecting = 1;
-        buf.select_start = buf.cursor_pos;
-        buf.select_end = buf.cursor_pos;
-        buf.selection_anchor = buf.cursor_pos;
+    int j, k, m, gl;
+    char *t;
+
+    m = skip_len;
+    if (i > hi - m) i = hi - m;
+    
+    /* Windows wholly after the gap - logical i is at t[i] */
+    gl = buf.gap_end - buf.gap_start;
+    t = text_ptr + gl;
+    while (i >= buf.gap_start && i >= lo) {
+        k = rskip_tab[t[i] & 0xFF];
+        if (k == 0) {
+            for (j = 1; j < m && fold_tab[t[i + j] & 0xFF] == skip_pat[j]; j++);
+            if (j == m && (!skip_word || sch_wb(i))) return i;
+            k = rskip_first;
+        }
+        i -= k;
+    }
+    
+    /* Windows straddling it */
+    while (i >= lo && i > buf.gap_start - m) {
+        k = rskip_tab[gap_char_at(i) & 0xFF];
+        if (k == 0) {
+            for (j = 1; j < m &&
+                 fold_tab[gap_char_at(i + j) & 0xFF] == skip_pat[j]; j++);
+            if (j == m && (!skip_word || sch_wb(i))) return i;
+            k = rskip_first;
+        }
+        i -= k;
+    }
+    
+    /* Windows wholly before it */
+    t = text_ptr;
+    while (i >= lo) {
+        k = rskip_tab[t[i] & 0xFF];
+        if (k == 0) {
+            for (j = 1; j < m && fold_tab[t[i + j] & 0xFF] == skip_pat[j]; j++);
+            if (j == m && (!skip_word || sch_wb(i))) return i;
+            k = rskip_first;
+        }
+        i -= k;
     }
+    return -1;
 }
 
-/* Clear selection */
-clr_sel()
+/* Trigram Index Functions */
+
+/* -ix: allocate the index.  The empty buffer has nothing to build. */
+tg_init()
 {
-    if (buf.selecting) {
-        buf.selecting = 0;
-        buf.select_start = -1;
-        buf.select_end = -1;
-        buf.selection_anchor = -1;
-        need_full_redraw = 1;  /* Need to redraw to clear highlights */
+    int h;
+    
+    tg_tab = (unsigned *)malloc(TG_NHASH * sizeof(unsigned));
+    if (tg_tab == NULL) return;
+    for (h = 0; h < TG_NHASH; h++) {
+        tg_tab[h] = 0;
     }
+    tg_dirt = 0;
 }
 
-smart_sel_update()
+/* The text from lo up to hi was written or moved - stale the blocks now
+ * holding it, and those of the TG_OVL + 2 bytes before, whose trigrams
+ * run into it.  Call after the gap buffer has been updated. */
+tg_mark(lo, hi)
+int lo, hi;
 {
-    int anchor = buf.selection_anchor;
-    int cursor = buf.cursor_pos;
-    
-    /* Determine boundaries based on cursor position relative to anchor */
-    if (cursor < anchor) {
-        /* Cursor is left of anchor - selection extends left */
-        buf.select_start = cursor;
-        buf.select_end = anchor;
-        sprintf(status_msg, "Selection LEFT: %d-%d (len=%d)", 
-                buf.select_start, buf.select_end, buf.select_end - buf.select_start);
-        
-    } else if (cursor > anchor) {
-        /* Cursor is right of anchor - selection extends right */
-        buf.select_start = anchor;
-        buf.select_end = cursor;
-        sprintf(status_msg, "Selection RIGHT: %d-%d (len=%d)", 
-                buf.select_start, buf.select_end, buf.select_end - buf.select_start);
-        
-    } else {
-        /* Cursor is at anchor - clear selection (zero-length not useful) */
-        buf.selecting = 0;
-        buf.select_start = -1;
-        buf.select_end = -1;
-        buf.selection_anchor = -1;
-        sprintf(status_msg, "Selection cleared");
+    int k, b, p, q, gs, gl;
+    
+    if (tg_tab == NULL) return;
+    lo -= TG_OVL + 2;
+    if (lo < 0) lo = 0;
+    if (hi > buf.text_length) hi = buf.text_length;
+    gs = buf.gap_start;
+    gl = buf.gap_end - gs;
+    for (k = 0; k < 2; k++) {
+        /* The part before the gap, then the part after it */
+        p = k ? (lo > gs ? lo : gs) + gl : lo;
+        q = k ? hi + gl : (hi < gs ? hi : gs);
+        for (b = p / TG_BLK; b * TG_BLK < q; b++) {
+            tg_dirt |= 1 << b;
+        }
     }
+    if (tg_dirt) it_on[IT_TRIG] = 1;
 }
 
-
-/* Check if selection is active and valid */
-sel_active()
+/* Logical span of the text block b holds - k = 0 for the part before
+ * the gap, 1 for the part after it.  0 if there is none. */
+tg_span(b, k, sp, ep)
+int b, k, *sp, *ep;
 {
-    return (buf.selecting && buf.select_start >= 0 && 
-            buf.select_end > buf.select_start);
+    int s, e, gl;
+    
+    s = b * TG_BLK;
+    e = s + TG_BLK;
+    if (k == 0) {
+        if (e > buf.gap_start) e = buf.gap_start;
+    } else {
+        if (s < buf.gap_end) s = buf.gap_end;
+        gl = buf.gap_end - buf.gap_start;
+        s -= gl;
+        e -= gl;
+    }
+    *sp = s;
+    *ep = e;
+    return s < e;
 }
 
-/* Selection movement functions with screen coordinate updates */
+/* Index the first stale block - one IT_TRIG slice.  1 if more are
+ * left. */
+tg_step()
+{
+    int b, k, h, p, s, e;
+    unsigned bit, x, y, z;
+    
+    if (tg_dirt == 0) return 0;
+    for (b = 0; !(tg_dirt >> b & 1); b++);
+    bit = 1 << b;
+    for (h = 0; h < TG_NHASH; h++) {
+        tg_tab[h] &= ~bit;
+    }
+    for (k = 0; k < 2; k++) {
+        if (!tg_span(b, k, &s, &e)) continue;
+        e += TG_OVL;
+        if (e > buf.text_length - 2) e = buf.text_length - 2;
+        if (s >= e) continue;
+        x = gap_char_at(s) & 0xFF;
+        x = TG_LOW(x);
+        y = gap_char_at(s + 1) & 0xFF;
+        y = TG_LOW(y);
+        for (p = s; p < e; p++) {
+            z = gap_char_at(p + 2) & 0xFF;
+            z = TG_LOW(z);
+            tg_tab[TG_HASH(x, y, z)] |= bit;
+            x = y;
+            y = z;
+        }
+    }
+    tg_dirt &= ~bit;
+    return tg_dirt != 0;
+}
 
-/* Extend selection left - fixed to use proper cursor management */
-ex_left()
+/* Blocks that may hold a match: those with every trigram of the
+ * pattern, and the stale ones */
+unsigned tg_want()
 {
-  int old_pos;
-  int old_col;
-  int old_row;
-  char ch;
-  
-  if (!buf.selecting) start_sel();
-    
-  if (buf.cursor_pos > 0) {
-    /* Save current position before moving */
-    old_pos = buf.cursor_pos;
-    old_col = cursor_col;
-    old_row = log_row;
-    ch = gap_char_at(buf.cursor_pos - 1);  /* Check the character we're moving to */
-    
-    /* Use proper cursor update that handles tabs and line endings */
-    curs_lft();
-        
-    /* Use smart update - no parameters needed, uses cursor_pos and anchor */
-    smart_sel_update();
+    unsigned c;
+    int j;
     
-    /* Check for boundary conditions */
-    if (IS_LINE_END(ch) || cursor_col == 0 || cursor_col == screen_cols - 1) {
-      /* Complex case - use broader update */
-      need_full_redraw = 1;
-    } else {
-      /* Simple case - use fast character updates */
-      int phys_old_row, phys_log_row;
-      phys_old_row = PHYS_ROW(old_row);
-      phys_log_row = PHYS_ROW(log_row);
-      redraw_char_at_screen_pos(old_col, phys_old_row, old_pos);
-      redraw_char_at_screen_pos(cursor_col, phys_log_row, buf.cursor_pos);
-    }     
-  }
-  
-  need_status_update = 1;
+    c = TG_ALL;
+    for (j = 0; j < tg_np; j++) {
+        c &= tg_tab[tg_pat[j]];
+    }
+    return c | tg_dirt;
 }
 
-/* Extend selection right - fixed to use proper cursor management */
-ex_right()
+/* sch_fwd() through the index - lit_fwd() over each candidate block,
+ * letting a match run on past its end */
+tg_fwd(i, hi)
+int i, hi;
 {
-  int old_pos;
-  int old_col;
-  int old_row;
-  char ch;
-  
-  if (!buf.selecting) start_sel();
-    
-  if (buf.cursor_pos < buf.text_length) {
-    /* Save current position before moving */
-    old_pos = buf.cursor_pos;
-    old_col = cursor_col;
-    old_row = log_row;
-    ch = gap_char_at(buf.cursor_pos);  /* Check the character we're moving over */
-    
-    /* Use proper cursor update that handles tabs and line endings */
-    curs_rgt();
-        
-    /* Use smart update - no parameters needed, uses cursor_pos and anchor */
-    smart_sel_update();
-    
-    /* Check for boundary conditions */
-    if (IS_LINE_END(ch) || cursor_col == 0 || cursor_col == screen_cols - 1) {
-      /* Complex case - use broader update */
-      need_full_redraw = 1;
-    } else {
-      /* Simple case - use fast character updates */
-      int phys_old_row, phys_log_row;
-      phys_old_row = PHYS_ROW(old_row);
-      phys_log_row = PHYS_ROW(log_row);
-      redraw_char_at_screen_pos(old_col, phys_old_row, old_pos);
-      redraw_char_at_screen_pos(cursor_col, phys_log_row, buf.cursor_pos);
+    int b, k, s, e, r;
+    unsigned c;
+    
+    c = tg_want();
+    if ((c & TG_ALL) == TG_ALL) return lit_fwd(i, hi);
+    for (b = 0; b < TG_NBLK; b++) {
+        for (k = 0; k < 2; k++) {
+            /* The spans come in text order */
+            if (!(c >> b & 1) || !tg_span(b, k, &s, &e) || e <= i) continue;
+            if (s >= hi) return -1;
+            e += skip_len - 1;
+            r = lit_fwd(s > i ? s : i, e < hi ? e : hi);
+            if (r >= 0) return r;
+        }
     }
-  }
-  
-  need_status_update = 1;
+    return -1;
 }
 
-/* Extend selection up */
-ex_up()
+/* The same backward for sch_bwd() */
+tg_bwd(i, hi)
+int i, hi;
 {
-    if (!buf.selecting) start_sel();
-    move_up();
-    smart_sel_update();
-    need_full_redraw = 1;
-    need_status_update = 1;
+    int b, k, s, e, r;
+    unsigned c;
+    
+    c = tg_want();
+    if ((c & TG_ALL) == TG_ALL) return lit_bwd(i, sch_lo, hi);
+    for (b = TG_NBLK - 1; b >= 0; b--) {
+        for (k = 1; k >= 0; k--) {
+            if (!(c >> b & 1) || !tg_span(b, k, &s, &e) || s > i) continue;
+            if (e <= sch_lo) return -1;
+            r = lit_bwd(i < e - 1 ? i : e - 1, s > sch_lo ? s : sch_lo,
+                        e + skip_len - 1 < hi ? e + skip_len - 1 : hi);
+            if (r >= 0) return r;
+        }
+    }
+    return -1;
 }
 
-/* Extend selection down */
-ex_down()
+/* Regular Expression Functions */
+
+/* Compile pat into rx_op[] - or set rx_err.  Besides the usual
+ * characters, . [] * + ? | () ^ $, a backslash escapes one, and gives
+ * \n \r \t and the sets \d \w \s (capitals for the bytes outside them).
+ * The program saves slots 0 and 1 around the whole match, 2k and 2k + 1
+ * around group k. */
+rx_comp(pat)
+char *pat;
 {
-    if (!buf.selecting) start_sel();
-    move_down();
-    smart_sel_update();
-    need_full_redraw = 1;
-    need_status_update = 1;
+    rx_len = 0;
+    rx_ncls = 0;
+    rx_grp = 0;
+    rx_err = NULL;
+    rx_p = pat;
+    rx_emit(RX_SAVE, 0);
+    rx_alt();
+    if (!rx_err && *rx_p == ')') rx_err = "unmatched )";
+    rx_emit(RX_SAVE, 1);
+    rx_emit(RX_MATCH, 0);
+    if (rx_err) return;
+    
+    /* skip_tab[] is free - it marks the bytes a match can start with */
+    memset(skip_tab, 0, 256);
+    rx_nul = 0;
+    rx_pos(0);      /* A fresh rx_gen for rx_fst()'s marks */
+    rx_fst(0);
 }
 
-/* Extend selection word left */
-ex_wd_left()
+/* cat, or cat | cat ... - the left one is tried first */
+rx_alt()
 {
-    if (!buf.selecting) start_sel();
-    word_left();  /* Use existing word movement function */
-    smart_sel_update();
-    need_full_redraw = 1;
-    need_status_update = 1;
+    int s, j, r;
+    
+    s = rx_len;
+    rx_cat();
+    while (*rx_p == '|' && !rx_err) {
+        rx_p++;
+        rx_ins(s, RX_SPLIT, 0);
+        j = rx_len;
+        rx_emit(RX_JMP, 0);
+        r = rx_len;
+        rx_cat();
+        if (rx_err) return;
+        rx_arg[s] = r;
+        rx_arg[j] = rx_len;
+    }
 }
 
-/* Extend selection word right */
-ex_wd_right()
+/* Atoms in a row, each with any * + ? after it */
+rx_cat()
 {
-    if (!buf.selecting) start_sel();
-    word_right(); /* Use existing word movement function */
-    smart_sel_update();
-    need_full_redraw = 1;
-    need_status_update = 1;
+    int s, c;
+    
+    while (*rx_p != 0 && *rx_p != '|' && *rx_p != ')' && !rx_err) {
+        s = rx_len;
+        rx_atom();
+        while ((c = *rx_p) == '*' || c == '+' || c == '?') {
+            rx_p++;
+            if (c == '*') {
+                rx_ins(s, RX_SPLIT, rx_len + 2);
+                rx_emit(RX_JMP, s);
+            } else if (c == '+') {
+                rx_emit(RX_LOOP, s);
+            } else {
+                rx_ins(s, RX_SPLIT, rx_len + 1);
+            }
+        }
+    }
 }
 
-/* Select all text */
-sel_all()
+/* One byte, set, anchor or group */
+rx_atom()
 {
-    buf.selecting = 1;
-    buf.selection_anchor = 0;
-    buf.select_start = 0;
-    buf.select_end = buf.text_length;
-    buf.cursor_pos = buf.text_length;
-    strcpy(status_msg, "All text selected");
-    need_status_update = 1;
+    int c, k;
+    
+    c = *rx_p++ & 0xFF;
+    if (c == '(') {
+        /* Groups past RX_NSUB - 1 still group, but save nothing */
+        k = ++rx_grp < RX_NSUB ? rx_grp : 0;
+        if (k) rx_emit(RX_SAVE, 2 * k);
+        rx_alt();
+        if (*rx_p != ')') {
+            if (!rx_err) rx_err = "unmatched (";
+            return;
+        }
+        rx_p++;
+        if (k) rx_emit(RX_SAVE, 2 * k + 1);
+    } else if (c == '*' || c == '+' || c == '?') {
+        rx_err = "nothing to repeat";
+    } else if (c == '.') {
+        rx_emit(RX_ANY, 0);
+    } else if (c == '^') {
+        rx_emit(RX_BOL, 0);
+    } else if (c == '$') {
+        rx_emit(RX_EOL, 0);
+    } else if (c == '[') {
+        rx_set();
+    } else {
+        if (c == '\\') {
+            if (rx_ncls < RX_NCLS) memset(rx_cls[rx_ncls], 0, 32);
+            c = rx_esc(rx_ncls < RX_NCLS ? rx_cls[rx_ncls] : NULL);
+            if (c < 0) {
+                if (!rx_err) rx_emit(RX_CLS, rx_ncls++);
+                return;
+            }
+        }
+        rx_emit(RX_CHR, fold_tab[c]);
+    }
 }
 
-/* Delete selected text using gap buffer operations */
-del_sel()
+/* [...] - bytes and ranges, or with ^ first the bytes not listed.
+ * A ] straight after the [ or ^ is one of the bytes. */
+rx_set()
 {
-    int del_len;
+    unsigned char *set;
+    char *first;
+    int c, d, neg, i;
     
-    if (!buf.selecting || buf.select_start < 0 || buf.select_end <= buf.select_start) {
-        return;  /* No valid selection */
+    if (rx_ncls == RX_NCLS) {
+        rx_err = "too many []";
+        return;
     }
-    
-    del_len = buf.select_end - buf.select_start;
-    
-    /* Record each deleted character for undo (up to 50 chars) */
-    /* Read characters before deleting them */
-    {
-        int i, undo_count_limit;
-        char deleted_char;
-        
-        /* Limit to 50 characters to fit in undo buffer */
-        undo_count_limit = del_len;
-        if (undo_count_limit > MAX_UNDO) {
-            undo_count_limit = MAX_UNDO;
+    set = rx_cls[rx_ncls];
+    memset(set, 0, 32);
+    neg = *rx_p == '^';
+    if (neg) rx_p++;
+    first = rx_p;
+    while (*rx_p != 0 && (*rx_p != ']' || rx_p == first)) {
+        c = *rx_p++ & 0xFF;
+        if (c == '\\') {
+            c = rx_esc(set);
+            if (rx_err) return;
+            if (c < 0) continue;
         }
-        
-        /* Record each character that will be deleted */
-        for (i = 0; i < undo_count_limit; i++) {
-            deleted_char = gap_char_at(buf.select_start + i);
-            add_undo(buf.select_start + i, 1, deleted_char);
+        d = c;
+        if (rx_p[0] == '-' && rx_p[1] != 0 && rx_p[1] != ']') {
+            d = *++rx_p & 0xFF;
+            rx_p++;
+        }
+        while (c <= d) {
+            set[c >> 3] |= 1 << (c & 7);
+            c++;
         }
     }
-    
-    /* Move gap to selection start position */
-    move_gap_to(buf.select_start);
-    
-    /* Expand gap to cover the selected text - this "deletes" it */
-    buf.gap_end += del_len;
-    
-    /* Validate gap doesn't exceed buffer bounds */
-    if (buf.gap_end > BUF_SIZE) {
-        buf.gap_end = BUF_SIZE;
+    if (*rx_p != ']') {
+        rx_err = "unmatched [";
+        return;
     }
-    
-    /* Update buffer state */
-    buf.text_length -= del_len;
-    buf.cursor_pos = buf.select_start;
-    set_dirty(1);
-    
-    /* Recalculate total lines after deleting selection */
-    recount_total_lines();
-    
-    /* Clear selection state */
-    clr_sel();
+    rx_p++;
+    for (c = 'A'; sch_case && c <= 'Z'; c++) {
+        if (((set[c >> 3] | set[(c + 32) >> 3]) >> (c & 7)) & 1) {
+            set[c >> 3] |= 1 << (c & 7);
+            set[(c + 32) >> 3] |= 1 << (c & 7);
+        }
+    }
+    if (neg) {
+        for (i = 0; i < 32; i++) set[i] = ~set[i];
+    }
+    rx_emit(RX_CLS, rx_ncls++);
 }
 
-/* Replace the existing copy_sel() function around line 1200 */
-copy_sel()
+/* The byte after a backslash stands for, or -1 once the set it names
+ * is added to set */
+rx_esc(set)
+unsigned char *set;
 {
-    int sel_len;
+    int c, d, i, in;
     
-    if (!sel_active()) {
-        strcpy(status_msg, "Nothing selected to copy");
-        need_status_update = 1;
-        return;
+    c = *rx_p & 0xFF;
+    if (c == 0) {
+        rx_err = "trailing \\";
+        return -1;
     }
-    
-    if (!clipboard.initialized) {
-        strcpy(status_msg, "No clipboard available");
-        need_status_update = 1;
-        return;
+    rx_p++;
+    if (c == 'n') return LF;
+    if (c == 'r') return CR;
+    if (c == 't') return 9;
+    d = c >= 'A' && c <= 'Z' ? c + 32 : c;
+    if (d != 'd' && d != 'w' && d != 's') return c;
+    if (set == NULL) {
+        rx_err = "too many []";
+        return -1;
     }
-    
-    sel_len = buf.select_end - buf.select_start;
-    if (sel_len <= 0) return;
-    
-    /* Check if selection fits in 8K clipboard */
-    if (sel_len > clipboard.max_capacity) {
-        sprintf(status_msg, "Selection too large (%d chars, max 8K)", sel_len);
-        need_status_update = 1;
-        return;
+    for (i = 0; i < 256; i++) {
+        if (d == 'd') {
+            in = i >= '0' && i <= '9';
+        } else if (d == 'w') {
+            in = wc_tab[i];
+        } else {
+            in = i == ' ' || i == 9 || IS_LINE_END(i);
+        }
+        if (in != (c != d)) set[i >> 3] |= 1 << (i & 7);
     }
-    
-    /* Copy selection to fixed clipboard */
-    copy_gap_selection_to_clipboard(sel_len);
-    clipboard.data_length = sel_len;
-    sprintf(status_msg, "Copied %d chars to clipboard", sel_len);
-    need_status_update = 1;
+    return -1;
 }
 
-/* Add this new function after copy_sel() */
-paste_clipboard()
+/* Append a step */
+rx_emit(op, arg)
+int op, arg;
+{
+    rx_ins(rx_len, op, arg);
+}
+
+/* Put a step in at pc.  Jumps in the code moved up move with it; those
+ * before it that go to pc now go to the new step. */
+rx_ins(pc, op, arg)
+int pc, op, arg;
 {
     int i;
     
-    if (!clipboard.initialized) {
-        strcpy(status_msg, "No clipboard available");
-        need_status_update = 1;
+    if (rx_len == RX_MAX) {
+        rx_err = "too long";
         return;
     }
-    
-    if (clipboard.data_length <= 0) {
-        strcpy(status_msg, "Clipboard empty");
-        need_status_update = 1;
-        return;
+    for (i = rx_len; i > pc; i--) {
+        rx_op[i] = rx_op[i - 1];
+        rx_arg[i] = rx_arg[i - 1];
+        if (rx_op[i] >= RX_JMP && rx_op[i] <= RX_LOOP && rx_arg[i] >= pc) {
+            rx_arg[i]++;
+        }
     }
-    
-    /* Replace selection if active */
-    if (sel_active()) {
-        del_sel();
+    rx_op[pc] = op;
+    rx_arg[pc] = arg;
+    rx_len++;
+}
+
+/* Mark in skip_tab[] the bytes a thread at pc can go on with */
+rx_fst(pc)
+int pc;
+{
+    int op, i;
+    
+    if (rx_mark[pc] == rx_gen) return;
+    rx_mark[pc] = rx_gen;
+    op = rx_op[pc];
+    if (op == RX_MATCH) {
+        rx_nul = 1;
+    } else if (op <= RX_CLS) {
+        for (i = 0; i < 256; i++) {
+            if (op == RX_CHR ? fold_tab[i] == rx_arg[pc] :
+                op == RX_ANY ? !IS_LINE_END(i) :
+                (rx_cls[rx_arg[pc]][i >> 3] >> (i & 7)) & 1) skip_tab[i] = 1;
+        }
+    } else {
+        if (op != RX_JMP) rx_fst(pc + 1);
+        if (op >= RX_JMP && op <= RX_LOOP) rx_fst(rx_arg[pc]);
+    }
+}
+
+/* Add a thread at pc with slots s to list l.  Jumps and tests are
+ * followed at once, so lists only hold steps that read a byte; a pc
+ * already in the list keeps the thread that got there first. */
+rx_add(l, pc, s)
+int l, pc;
+int *s;
+{
+    int op, k, old;
+    int *d;
+    
+    if (rx_mark[pc] == rx_gen) return;
+    rx_mark[pc] = rx_gen;
+    op = rx_op[pc];
+    if (op == RX_JMP) {
+        rx_add(l, rx_arg[pc], s);
+    } else if (op == RX_SPLIT) {
+        rx_add(l, pc + 1, s);
+        rx_add(l, rx_arg[pc], s);
+    } else if (op == RX_LOOP) {
+        rx_add(l, rx_arg[pc], s);
+        rx_add(l, pc + 1, s);
+    } else if (op == RX_SAVE) {
+        k = rx_arg[pc];
+        if (k < rx_w) {
+            old = s[k];
+            s[k] = rx_at;
+            rx_add(l, pc + 1, s);
+            s[k] = old;
+        } else {
+            rx_add(l, pc + 1, s);
+        }
+    } else if (op == RX_BOL) {
+        if (rx_pv < 0 || rx_pv == LF || (rx_pv == CR && rx_c != LF)) {
+            rx_add(l, pc + 1, s);
+        }
+    } else if (op == RX_EOL) {
+        if (rx_c < 0 || rx_c == CR || (rx_c == LF && rx_pv != CR)) {
+            rx_add(l, pc + 1, s);
+        }
+    } else {
+        k = rx_cnt[l]++;
+        rx_tpc[l][k] = pc;
+        d = rx_ts[l] + k * rx_w;
+        for (k = 0; k < rx_w; k++) d[k] = s[k];
     }
+}
+
+/* A fresh rx_gen for the next thread list.  It wraps well short of a
+ * 16-bit int, clearing rx_mark[] so no stale mark matches. */
+rx_newg()
+{
+    int i;
     
-    /* Insert clipboard contents at cursor */
-    for (i = 0; i < clipboard.data_length; i++) {
-        if (!gap_has_space()) {
-            sprintf(status_msg, "Buffer full - pasted %d of %d chars", i, clipboard.data_length);
-            need_status_update = 1;
-            break;
+    if (++rx_gen >= 30000) {
+        for (i = 0; i < RX_MAX; i++) rx_mark[i] = 0;
+        rx_gen = 1;
+    }
+}
+
+/* Ready to add threads at p - a new list */
+rx_pos(p)
+int p;
+{
+    rx_newg();
+    rx_at = p;
+    rx_c = p < buf.text_length ? gap_char_at(p) & 0xFF : -1;
+    if (rx_rw && p == buf.gap_start) {
+        rx_pv = rx_lead;
+    } else {
+        rx_pv = p > 0 ? gap_char_at(p - 1) & 0xFF : -1;
+    }
+}
+
+/* Run the program from p - how is RR_SCAN, RR_AT or RR_CAP.  Each step
+ * moves every live thread on by one byte, so the time is linear in the
+ * text; with none live a scan skips to a byte in skip_tab[].  A thread
+ * that matches drops those after it, which came later in priority.
+ * Returns the match's start, with its length in sch_len, or -1. */
+rx_run(p, how)
+int p, how;
+{
+    int i, l, c, pc, op, arg, from, found, len, gl;
+    int *s;
+    char *t;
+    
+    len = sch_hi < buf.text_length ? sch_hi : buf.text_length;
+    if (p > len) return -1;
+    if (how == RR_CAP) {
+        if (rx_tcp == NULL) {
+            rx_tcp = (int *)malloc(2 * RX_MAX * 2 * RX_NSUB * sizeof(int));
+            if (rx_tcp == NULL) return -1;
+        }
+        rx_w = 2 * RX_NSUB;
+        rx_ts[0] = rx_tcp;
+        rx_ts[1] = rx_tcp + RX_MAX * rx_w;
+    } else {
+        rx_w = 1;
+        rx_ts[0] = rx_tsp[0];
+        rx_ts[1] = rx_tsp[1];
+    }
+    gl = buf.gap_end - buf.gap_start;
+    t = text_ptr;
+    from = p;
+    found = -1;
+    l = 0;
+    rx_cnt[0] = 0;
+    rx_pos(p);
+    for (;;) {
+        if (found < 0 && (how == RR_SCAN || p == from)) {
+            if (rx_cnt[l] == 0 && how == RR_SCAN && !rx_nul) {
+                /* Nothing live - on to a byte a match can start with */
+                i = p;
+                while (p < len &&
+                       !skip_tab[(p < buf.gap_start ? t[p] : t[p + gl]) & 0xFF]) {
+                    p++;
+                }
+                if (p == len) return -1;
+                if (p != i) rx_pos(p);
+            }
+            for (i = 0; i < rx_w; i++) rx_s0[i] = -1;
+            rx_add(l, 0, rx_s0);
         }
+        if (rx_cnt[l] == 0 && (found >= 0 || how != RR_SCAN)) break;
         
-        ensure_gap_at_cursor();
-        *(text_ptr + buf.gap_start) = clipboard.mapped_addr[i];
-        buf.gap_start++;
-        buf.cursor_pos++;
-        buf.text_length++;
+        /* Step every thread over the byte at p - none past the scope,
+         * though ^ and $ still see the text either side of it */
+        c = p < len ? rx_c : -1;
+        p++;
+        rx_newg();
+        rx_at = p;
+        rx_pv = rx_c;
+        rx_c = p < buf.text_length ?
+               (p < buf.gap_start ? t[p] : t[p + gl]) & 0xFF : -1;
+        rx_cnt[1 - l] = 0;
+        for (i = 0; i < rx_cnt[l]; i++) {
+            pc = rx_tpc[l][i];
+            s = rx_ts[l] + i * rx_w;
+            op = rx_op[pc];
+            if (op == RX_MATCH) {
+                found = s[0];
+                sch_len = p - 1 - found;
+                for (arg = 0; how == RR_CAP && arg < rx_w; arg++) {
+                    rx_sv[arg] = s[arg];
+                }
+                break;
+            }
+            if (c < 0) continue;
+            arg = rx_arg[pc];
+            if (op == RX_CHR ? fold_tab[c] == arg :
+                op == RX_ANY ? !IS_LINE_END(c) :
+                (rx_cls[arg][c >> 3] >> (c & 7)) & 1) {
+                rx_add(1 - l, pc + 1, s);
+            }
+        }
+        if (c < 0) break;
+        l = 1 - l;
     }
+    return found;
+}
+
+/* sch_fwd() for a regular expression */
+rx_fwd(from)
+int from;
+{
+    int i;
     
-    set_dirty(1);
-    sprintf(status_msg, "Pasted %d chars from clipboard", clipboard.data_length);
-    temp_message_active = 1;
-    recount_total_lines();  /* Recalculate after paste */
-    need_redraw_down = 1;
-    update_from_pos = buf.cursor_pos - clipboard.data_length;
-    need_status_update = 1;
+    if (rx_err) return -1;
+    if (from < sch_lo) from = sch_lo;
+    for (;;) {
+        i = rx_run(from, RR_SCAN);
+        if (i < 0 || !skip_word || sch_wb(i)) return i;
+        from = i + 1;
+    }
+}
+
+/* sch_bwd() for a regular expression - a match is tried at each place
+ * a match can start, back from from */
+rx_bwd(from)
+int from;
+{
+    int i, hi;
+    
+    if (rx_err) return -1;
+    hi = sch_hi < buf.text_length ? sch_hi : buf.text_length;
+    if (from > hi) from = hi;
+    for (i = from; i >= sch_lo; i--) {
+        if ((rx_nul || (i < hi && skip_tab[gap_char_at(i) & 0xFF])) &&
+            rx_run(i, RR_AT) >= 0 && (!skip_word || sch_wb(i))) return i;
+    }
+    return -1;
+}
+
+/* The groups of the match at i in rx_sv[] - all unset if there is no
+ * memory for them */
+rx_subs(i)
+int i;
+{
+    int k;
+    
+    if (rx_run(i, RR_CAP) < 0) {
+        for (k = 0; k < 2 * RX_NSUB; k++) rx_sv[k] = -1;
+    }
+}
+
+/* rep_str for the match of m bytes at i, in rx_out[]: \0 is the match,
+ * \1 to \9 its groups, \n \r \t as in a pattern, and a backslash before
+ * anything else gives that byte.  Returns the length, or -1 if that is
+ * over RX_OUT. */
+rx_exp(i, m)
+int i, m;
+{
+    int n, k, a, b, c, subs;
+    char *r;
+    
+    n = 0;
+    subs = 0;
+    for (r = rep_str; *r != 0; r++) {
+        c = *r;
+        if (c == '\\' && r[1] >= '0' && r[1] <= '9') {
+            k = *++r - '0';
+            a = i;
+            b = i + m;
+            if (k > 0) {
+                if (!subs) rx_subs(i);
+                subs = 1;
+                a = b = 0;
+                if (k < RX_NSUB && rx_sv[2 * k] >= 0 && rx_sv[2 * k + 1] >= 0) {
+                    a = rx_sv[2 * k];
+                    b = rx_sv[2 * k + 1];
+                }
+            }
+            if (n + b - a > RX_OUT) return -1;
+            while (a < b) rx_out[n++] = gap_char_at(a++);
+            continue;
+        }
+        if (c == '\\' && r[1] != 0) {
+            c = *++r;
+            if (c == 'n') c = LF;
+            if (c == 'r') c = CR;
+            if (c == 't') c = 9;
+        }
+        if (n == RX_OUT) return -1;
+        rx_out[n++] = c;
+    }
+    return n;
 }
 
-/* Word Movement Functions */
+/* Index every match with one forward scan.  Regular expression
+ * matches vary in length, so those are indexed end to end, as a
+ * replace-all would take them. */
+fa_build()
+{
+    int i;
+    
+    fa_cnt = 0;
+    fa_hint = 0;
+    i = sch_fwd(sch_lo);
+    while (i >= 0) {
+        if (fa_cnt == FA_MAX) {
+            fa_big = 1;
+            return;
+        }
+        fa_len[fa_cnt] = sch_len;
+        fa_pos[fa_cnt++] = i;
+        i = sch_fwd(skip_rx && sch_len > 0 ? i + sch_len : i + 1);
+    }
+    fa_ok = 1;
+}
 
-/* Check if character is part of a word */
-is_word_char(ch)
-char ch;
+/* Match in slot k, with its length in sch_len */
+fa_at(k)
+int k;
 {
-    return ((ch >= 'a' && ch <= 'z') || 
-            (ch >= 'A' && ch <= 'Z') || 
-            (ch >= '0' && ch <= '9') || 
-            ch == '_');
+    if (skip_rx) sch_len = fa_len[k];
+    return fa_pos[k];
 }
 
-/* Find start of current word */
-fdwd_start(pos)
+/* First slot whose match starts at or after pos, fa_cnt if none */
+fa_find(pos)
 int pos;
 {
-    /* Skip non-word chars backwards */
-    while (pos > 0 && !is_word_char(*(text_ptr + pos - 1))) {
-        pos = pos - 1;
-    }
-    
-    /* Find start of word */
-    while (pos > 0 && is_word_char(*(text_ptr + pos - 1))) {
-        pos = pos - 1;
+    int lo, hi, mid;
+    
+    lo = 0;
+    hi = fa_cnt;
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        if (fa_pos[mid] < pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
-    
-    return pos;
+    return lo;
 }
 
-/* Find end of current word */
-fdwd_end(pos)
+/* Is pos inside a match?  Rows are drawn left to right, so the slot of
+ * the last answer is tried before a binary search.  Matches do not
+ * overlap in length, so only the last one starting at or before pos
+ * can cover it. */
+fa_in(pos)
 int pos;
 {
-    /* Skip non-word chars forward */
-    while (pos < buf.text_length && !is_word_char(*(text_ptr + pos))) {
-        pos = pos + 1;
-    }
+    int k;
     
-    /* Find end of word */
-    while (pos < buf.text_length && is_word_char(*(text_ptr + pos))) {
-        pos = pos + 1;
+    k = fa_hint;
+    if (k >= fa_cnt || fa_pos[k] > pos ||
+        (k + 1 < fa_cnt && fa_pos[k + 1] <= pos)) {
+        k = fa_find(pos + 1) - 1;
+        if (k < 0) return 0;
+        fa_hint = k;
     }
-    
-    return pos;
+    return pos < fa_pos[k] + (skip_rx ? fa_len[k] : skip_len);
 }
 
-/* Move cursor to start of previous word */
-word_left()
+/* Text changed at pos - see dmg_text().  Matches that overlapped the
+ * change, or touched it in whole-word mode, are dropped; those after it
+ * move by ins - del; then the changed stretch is scanned again. */
+fa_edit(pos, ins, del)
+int pos, ins, del;
 {
-    int new_pos;
-    
-    if (buf.cursor_pos <= 0) return;
-    
-    new_pos = buf.cursor_pos - 1;
+    int lo, a, b, k, i, end;
     
-    while (new_pos > 0 && is_word_char(gap_char_at(new_pos))) {
-        new_pos = new_pos - 1;
+    if (!fa_ok || skip_rx) {
+        fa_ok = 0;      /* A regular expression can reach anywhere */
+        fa_big = 0;     /* Text changed - worth counting again */
+        fa_cnt = 0;
+        return;
     }
-    
-    while (new_pos > 0 && !is_word_char(gap_char_at(new_pos))) {
-        new_pos = new_pos - 1;
+    lo = pos - skip_len + 1 - skip_word;
+    if (lo < 0) lo = 0;
+    a = fa_find(lo);
+    b = fa_find(pos + del + skip_word);
+    for (k = b; k < fa_cnt; k++) {
+        fa_pos[k] += ins - del;
     }
-    
-    while (new_pos > 0 && is_word_char(gap_char_at(new_pos - 1))) {
-        new_pos = new_pos - 1;
+    if (b > a) {
+        for (k = b; k < fa_cnt; k++) {
+            fa_pos[k - b + a] = fa_pos[k];
+        }
+        fa_cnt -= b - a;
     }
     
-    set_curs(new_pos);  /* Use cached update */
-    /* clr_sel(); */
+    end = pos + ins + skip_word;
+    i = sch_fwd(lo);
+    while (i >= 0 && i < end) {
+        if (fa_cnt == FA_MAX) {
+            fa_ok = 0;
+            return;
+        }
+        for (k = fa_cnt; k > a; k--) {
+            fa_pos[k] = fa_pos[k - 1];
+        }
+        fa_pos[a++] = i;
+        fa_cnt++;
+        i = sch_fwd(i + 1);
+    }
+    fa_hint = 0;
 }
 
-/* Move cursor to start of next word */
-word_right()
+/* Drop the match highlights */
+fa_hide()
 {
-    int new_pos;
-    
-    if (buf.cursor_pos >= buf.text_length) return;
-    
-    new_pos = buf.cursor_pos;
-    
-    while (new_pos < buf.text_length && is_word_char(gap_char_at(new_pos))) {
-        new_pos = new_pos + 1;
+    if (fa_show) {
+        fa_show = 0;
+        dmg_all();
     }
-    
-    while (new_pos < buf.text_length && !is_word_char(gap_char_at(new_pos))) {
-        new_pos = new_pos + 1;
+}
+
+/* Check there is a search string and ready its skip tables and index */
+sch_ok()
+{
+    if (!buf.search_active || buf.search_str[0] == 0) {
+        strcpy(status_msg, "No search string");
+        need_status_update = 1;
+        return 0;
     }
-    
-    set_curs(new_pos);  /* Use cached update */
-    /* clr_sel()'*/
+    sch_prep(buf.search_str);
+    if (rx_err) {
+        sprintf(status_msg, "Bad pattern: %s", rx_err);
+        need_status_update = 1;
+        return 0;
+    }
+    if (!fa_ok && !fa_big) fa_build();
+    return 1;
 }
 
-/* Helper function to position cursor at same relative screen position */
-page_curs(new_screen_top)
-int new_screen_top;
+/* Find next occurrence, wrapping to the top */
+find_next()
 {
-    int i, relative_row, target_pos, next_pos;
-    
-    /* Only adjust if cursor is currently in text area */
-    if (log_row < 0 || log_row >= eff_rows) {
-        return;  /* Cursor not in text area */
+    sch_next(buf.cursor_pos + 1);
+}
+
+/* First match at or after from, wrapping to the top */
+sch_next(from)
+int from;
+{
+    int i, k, wrap;
+    
+    if (!sch_ok()) return;
+    wrap = 0;
+    if (fa_ok) {
+        k = fa_find(from);
+        if (k == fa_cnt) {
+            k = 0;
+            wrap = 1;
+        }
+        i = fa_cnt ? fa_at(k) : -1;
+    } else {
+        i = sch_fwd(from);
+        if (i < 0) {
+            i = sch_fwd(sch_lo);
+            wrap = 1;
+        }
+    }
+    sch_hit(i, wrap);
+}
+
+/* Find previous occurrence, wrapping to the bottom */
+find_prev()
+{
+    int i, k, wrap;
+    
+    if (!sch_ok()) return;
+    wrap = 0;
+    if (fa_ok) {
+        k = fa_find(buf.cursor_pos) - 1;
+        if (k < 0) {
+            k = fa_cnt - 1;
+            wrap = 1;
+        }
+        i = fa_cnt ? fa_at(k) : -1;
+    } else {
+        i = sch_bwd(buf.cursor_pos - 1);
+        if (i < 0) {
+            i = sch_bwd(BUF_SIZE);
+            wrap = 1;
+        }
     }
+    sch_hit(i, wrap);
+}
+
+/* Select the len bytes at i and bring them on screen */
+sch_show(i, len)
+int i, len;
+{
+    int j, p, q, vis;
     
-    /* Calculate which visual line cursor is on */
-    relative_row = log_row;
-    target_pos = new_screen_top;
+    set_curs(i);  /* Use set_curs to update cursor and line count */
+    buf.search_pos = i;
     
-    /* Advance to same relative visual line */
-    for (i = 0; i < relative_row && target_pos < buf.text_length; i++) {
-        next_pos = visln_next(target_pos);
-        if (next_pos <= target_pos || next_pos > buf.text_length) break;
-        target_pos = next_pos;
+    /* Select the found text */
+    clr_sel();
+    buf.selecting = 1;
+    buf.select_start = i;
+    buf.select_end = i + len;
+    buf.selection_anchor = i;
+    
+    /* Visible if it starts on one of the eff_rows visual lines shown */
+    vis = 0;
+    p = buf.topscr_pos;
+    for (j = 0; j < eff_rows && p <= i; j++) {
+        q = visln_next(p);
+        if (i < q || q <= p) {
+            vis = 1;
+            break;
+        }
+        p = q;
     }
     
-    /* Ensure cursor stays within buffer bounds */
-    if (target_pos > buf.text_length) {
-        target_pos = buf.text_length;
+    /* If found text is off-screen, scroll to show it */
+    if (!vis) {
+        /* Center the found text on screen */
+        buf.topscr_pos = line_sta(i);
+        /* Move back a few visual lines for context */
+        for (j = 0; j < 5 && buf.topscr_pos > 0; j++) {
+            buf.topscr_pos = visln_pre(buf.topscr_pos);
+        }
+    }
+    dmg_span(buf.select_start, buf.select_end);
+}
+
+/* Select the match at i and bring it on screen, or report none */
+sch_hit(i, wrap)
+int i, wrap;
+{
+    if (i >= 0) {
+        sch_show(i, sch_len);
+        
+        /* Show find mode message */
+        if (fa_ok) {
+            sprintf(status_msg, "Found: %s - match %d of %d%s", buf.search_str,
+                    fa_find(i) + 1, fa_cnt, wrap ? ", wrapped" : "");
+            if (!fa_show) {
+                fa_show = 1;
+                dmg_all();
+            }
+        } else if (fa_big) {
+            sprintf(status_msg, "Found: %s - over %d matches%s", buf.search_str,
+                    FA_MAX, wrap ? ", wrapped" : "");
+        } else if (wrap) {
+            sprintf(status_msg, "Found: %s - search wrapped", buf.search_str);
+        } else {
+            sprintf(status_msg, "Found: %s - Press Ctrl+F to find next", buf.search_str);
+        }
+        need_status_update = 1;
+        return;
     }
     
-    set_curs(target_pos);
+    /* Not found - exit find mode */
+    sprintf(status_msg, "Not found: %s", buf.search_str);
+    fa_hide();
+    in_search_mode = 0;
+    in_find_mode = 0;
+    buf.search_active = 0;
+    need_status_update = 1;
 }
 
-/* Simplified page_up using helper */
-page_up()
+/* Replace Functions */
+
+/* Ask for the replacement of buf.search_str */
+rep_with()
 {
-    int i, new_top_pos, lines_to_scroll, prev_pos;
-    int original_top_pos;
+    rep_mode = RM_WITH;
+    rep_str[0] = 0;
+    sprintf(status_msg, "Replace %s with: ", buf.search_str);
+    need_status_update = 1;
+}
 
-    original_top_pos = get_top_pos();
-    new_top_pos = original_top_pos;
-    lines_to_scroll = eff_rows;  /* Use effective rows for proper scrolling */
+/* Keys for the replacement prompt and the question at each match */
+rep_keys(key)
+int key;
+{
+    int len;
     
-    /* Scroll up by screen height */
-    for (i = 0; i < lines_to_scroll && new_top_pos > 0; i++) {
-        prev_pos = new_top_pos;
-        new_top_pos = visln_pre(new_top_pos);
-        if (new_top_pos >= prev_pos) break;
+    if (key == KEY_ESC) {
+        rep_end();
+    } else if (rep_mode == RM_WITH) {
+        len = strlen(rep_str);
+        if (key == KEY_ENTER) {
+            rep_mode = RM_ASK;
+            rep_cnt = 0;
+            rep_ask();
+            return;
+        } else if (key == 127 || key == KEY_BS) {
+            if (len > 0) rep_str[len - 1] = 0;
+        } else if (key >= 32 && key < 127 && len < MAX_SEARCH - 1) {
+            rep_str[len] = key;
+            rep_str[len + 1] = 0;
+        }
+        sprintf(status_msg, "Replace %s with: %s", buf.search_str, rep_str);
+    } else if (key == 'y' || key == 'Y') {
+        /* After an empty match, on past the byte it was before */
+        if (rep_one()) sch_next(buf.cursor_pos + (sch_len == 0));
+        rep_ask();
+    } else if (key == 'n' || key == 'N') {
+        sch_next(buf.cursor_pos + 1);
+        rep_ask();
+    } else if (key == 'a' || key == 'A') {
+        rep_all();
+        rep_mode = 0;
     }
-    
-    if (new_top_pos < 0) new_top_pos = 0;
+}
 
-    /* Check if we're already at the top */
-    if (new_top_pos == original_top_pos && original_top_pos == 0) {
-        /* Already at top of file - just move cursor to top of screen */
-        set_curs(0);
-        log_row = 0;  /* First logical row */
-        cursor_col = 0;
-        need_full_redraw = 1;
-        clr_sel();
+/* Ask about the match selected - none left ends the replace */
+rep_ask()
+{
+    if (!in_find_mode) {
+        rep_end();
         return;
     }
+    sprintf(status_msg, "Replace with %s? (%d done)", rep_str, rep_cnt);
+    need_status_update = 1;
+}
+
+rep_end()
+{
+    if (rep_mode == RM_WITH) {
+        strcpy(status_msg, "Replace cancelled");
+    } else {
+        sprintf(status_msg, "Replaced %d", rep_cnt);
+    }
+    rep_mode = 0;
+    need_status_update = 1;
+}
+
+/* The replacement for the match of m bytes at i - its length, with the
+ * bytes at rep_txt, or -1 if the groups make it too long */
+rep_make(i, m)
+int i, m;
+{
+    if (!skip_rx) {
+        rep_txt = rep_str;
+        return strlen(rep_str);
+    }
+    rep_txt = rx_out;
+    return rx_exp(i, m);
+}
+
+/* Replace the selected match.  Undo gets it char by char as one group,
+ * the old bytes last to first as Backspace would record them, so undo
+ * puts them back in order. */
+rep_one()
+{
+    int i, m, r;
     
-    /* Update screen */
-    buf.topscr_pos = new_top_pos;
-    need_full_redraw = 1;
+    i = buf.select_start;
+    m = buf.select_end - i;
+    r = rep_make(i, m);
+    if (r < 0) {
+        strcpy(status_msg, "Replacement too long");
+        return 0;
+    }
+    if (buf.text_length + r - m > BUF_SIZE) {
+        strcpy(status_msg, "Buffer full (16K limit)");
+        return 0;
+    }
+    undo_grp = ++grp_seq;
+    un_open = 0;
+    if (un_del(i, m)) {
+        un_open = 0;
+        un_ins(i, r);
+    }
+    un_open = 0;
+    undo_grp = 0;
     
-    /* Position cursor at same relative location */
-    page_curs(new_top_pos);
     clr_sel();
+    move_gap_to(i);
+    rs_put(m, rep_txt, r);
+    dmg_text(i, r, m);
+    set_curs(i + r);
+    set_dirty(1);
+    rep_cnt++;
+    return 1;
 }
 
-/* Simplified page_down using helper */
-page_down()
+/* Streaming rewrite - the gap is the write point.  The unread text starts
+ * at gap_end: rs_copy() passes k bytes of it through, rs_put() drops del
+ * bytes of it and writes the n bytes at s instead.  The gap must hold
+ * any growth. */
+rs_copy(k)
+int k;
 {
-    int i, new_top_pos, lines_to_scroll, next_pos;
-    int last_line_start, max_reasonable_top;
+    char *d, *s;
     
-    new_top_pos = get_top_pos();
-    lines_to_scroll = eff_rows;  /* Use effective rows for proper scrolling */
+    d = text_ptr + buf.gap_start;
+    s = text_ptr + buf.gap_end;
+    buf.gap_start += k;
+    buf.gap_end += k;
+    if (d == s) return;
+    while (k-- > 0) {
+        *d++ = *s++;
+    }
+}
+
+rs_put(del, s, n)
+int del, n;
+char *s;
+{
+    buf.gap_end += del;
+    memcpy(text_ptr + buf.gap_start, s, n);
+    buf.gap_start += n;
+    buf.text_length += n - del;
+}
+
+/* Log the match of m bytes at i for undo, after a run of k untouched
+ * bytes - r bytes go in its place */
+ru_add(k, i, m, r)
+int k, i, m, r;
+{
+    int j;
     
-    /* Calculate maximum scroll position */
-    if (buf.text_length > 0) {
-        last_line_start = line_sta(buf.text_length - 1);
-        max_reasonable_top = last_line_start;
+    if (ru_len < 0) return;
+    if (ru_len + 9 + m > RU_MAX) {
+        ru_len = -1;
+        return;
+    }
+    ru_num(k);
+    if (ru_var) {
+        ru_num(m);
+        ru_num(r);
+    }
+    if (ru_case) {
+        for (j = 0; j < m; j++) {
+            ru_log[ru_len++] = gap_char_at(i + j);
+        }
+    }
+}
+
+/* Append k to ru_log - one byte, or 255 and two more */
+ru_num(k)
+int k;
+{
+    if (k < 255) {
+        ru_log[ru_len++] = k;
     } else {
-        max_reasonable_top = 0;
+        ru_log[ru_len++] = 255;
+        ru_log[ru_len++] = k >> 8;
+        ru_log[ru_len++] = k;
     }
+}
+
+/* The number at ru_log[*p], moving *p past it */
+ru_get(p)
+int *p;
+{
+    int k;
     
-    /* Scroll down by screen height */
-    for (i = 0; i < lines_to_scroll && new_top_pos < buf.text_length; i++) {
-        next_pos = visln_next(new_top_pos);
-        if (next_pos <= new_top_pos || next_pos > max_reasonable_top) break;
-        new_top_pos = next_pos;
+    k = ru_log[(*p)++];
+    if (k == 255) {
+        k = (ru_log[*p] << 8) | ru_log[*p + 1];
+        *p += 2;
+    }
+    return k;
+}
+
+/* Replace every match in the scope in one pass.  The gap goes to the
+ * first match; then it travels on to the last, passing each run between
+ * matches through and swapping each match as it goes, so the text moves
+ * once however many matches there are.  One undo entry covers it, with
+ * ru_log kept as its bytes (see ru_keep()). */
+rep_all()
+{
+    int i, k, m, r, n, c, wd, from, first, delta, cur, top, oc;
+    long grow;
+    
+    if (!sch_ok()) return;
+    m = skip_len;
+    r = strlen(rep_str);
+    if (skip_rx || r > m) {
+        /* Growing, or a regular expression whose replacements can -
+         * check the result fits before touching anything.  Matches
+         * after an empty one are looked for a byte on. */
+        grow = 0;
+        for (i = sch_fwd(sch_lo); i >= 0; i = sch_fwd(i + (m > 0 ? m : 1))) {
+            m = sch_len;
+            r = rep_make(i, m);
+            if (r < 0) {
+                strcpy(status_msg, "Replacement too long");
+                return;
+            }
+            grow += r - m;
+        }
+        if (buf.text_length + grow > BUF_SIZE) {
+            strcpy(status_msg, "Buffer full (16K limit)");
+            return;
+        }
     }
     
-    if (new_top_pos > buf.text_length) new_top_pos = buf.text_length;
-    
-    /* Update screen */
-    buf.topscr_pos = new_top_pos;
-    need_full_redraw = 1;
-    
-    /* Position cursor at same relative location */
-    page_curs(new_top_pos);
+    if (ru_log == NULL) ru_log = (unsigned char *)malloc(RU_MAX);
+    ru_len = ru_log != NULL ? 0 : -1;
+    ru_m = skip_len;
+    ru_r = strlen(rep_str);
+    ru_case = skip_case || skip_rx;
+    ru_var = skip_rx;
+    strcpy(ru_pat, skip_str);
+    
     clr_sel();
+    cur = -1;
+    top = -1;
+    
+    /* The pass starts at the first match - the text before it stays.
+     * The cursor waits there, so set_curs() counts lines in new text. */
+    from = sch_fwd(sch_lo);
+    if (from < 0) from = buf.gap_start;
+    move_gap_to(from);
+    oc = buf.cursor_pos;
+    if (oc > from) set_curs(from);
+    wd = skip_word;
+    skip_word = 0;  /* Word ends are checked against the old text here */
+    rx_rw = 1;
+    rx_lead = from > 0 ? gap_char_at(from - 1) & 0xFF : -1;  /* Old byte */
+    n = 0;          /* before the unread text */
+    first = -1;
+    delta = 0;
+    while ((i = sch_fwd(from)) >= 0) {
+        m = sch_len;
+        if (wd) {
+            c = i > buf.gap_start ? gap_char_at(i - 1) & 0xFF : rx_lead;
+            if ((c >= 0 && wc_tab[c]) || wc_tab[gap_char_at(i + m) & 0xFF]) {
+                from = i + 1;
+                continue;
+            }
+        }
+        r = rep_make(i, m);
+        
+        /* Old cursor and top of screen, moved by the matches before them */
+        if (cur < 0 && oc < i - delta + m) {
+            cur = oc < i - delta ? oc + delta : i;
+        }
+        if (top < 0 && buf.topscr_pos < i - delta + m) {
+            top = buf.topscr_pos < i - delta ? buf.topscr_pos + delta : i;
+        }
+        
+        k = i - buf.gap_start;
+        ru_add(k, i, m, r);
+        if (m > 0) {
+            rx_lead = gap_char_at(i + m - 1) & 0xFF;
+        } else if (k > 0) {
+            rx_lead = gap_char_at(i - 1) & 0xFF;
+        }
+        rs_copy(k);
+        rs_put(m, rep_txt, r);
+        if (first < 0) first = i;
+        delta += r - m;
+        if (sch_scope == SC_SEL) sch_hi += r - m;
+        n++;
+        from = buf.gap_start + (m == 0);
+    }
+    rx_rw = 0;
+    skip_word = wd;
+    sch_rgn();      /* dmg_text() moves the scope's end */
+    if (cur < 0) cur = oc + delta;
+    if (top < 0) top = buf.topscr_pos + delta;
+    
+    rep_cnt += n;
+    sprintf(status_msg, "Replaced %d", rep_cnt);
+    if (n == 0) {
+        set_curs(oc);
+        return;
+    }
+    ru_cnt = n;
+    fa_ok = 0;      /* Stale - found again on the next find */
+    fa_hide();
+    dmg_text(first, buf.gap_start - first, buf.gap_start - delta - first);
+    buf.topscr_pos = visln_sta(top);
+    set_curs(cur);
+    set_dirty(1);
+    it_start(IT_LINES);
+    
+    rd_drop();
+    if (ru_len < 0 || !ru_keep(first)) {
+        /* The history before it no longer leads anywhere */
+        undo_drop(buf.undo_count);
+        ua_top = 0;
+        sp_drop();
+        strcat(status_msg, " - too many to undo");
+    }
 }
 
-/* Search Functions */
-
-/* Start search mode */
-strtsch()
+/* The undo entry for the replace-all just made at first, ru_log and
+ * what goes with it as its bytes.  0 if the arena cannot hold them. */
+ru_keep(first)
+int first;
 {
-    in_search_mode = 1;
-    temp_search_str[0] = 0;
-    strcpy(status_msg, "Find: ");
-    buf.search_active = 1;
-    need_status_update = 1;
+    int n, k;
+    char *s;
+    struct RuHead h;
+    struct UndoEntry *e;
+    
+    k = ru_case ? 0 : strlen(ru_pat) + 1;
+    n = sizeof(struct RuHead) + k + ru_len;
+    if (!ua_room(n)) return 0;
+    add_undo(first, 2, n);
+    e = UNDO_AT(buf.undo_count - 1);
+    e->off = ua_top;
+    h.rh_cnt = ru_cnt;
+    h.rh_m = ru_m;
+    h.rh_r = ru_r;
+    h.rh_case = ru_case;
+    h.rh_var = ru_var;
+    s = ua_buf + ua_top;
+    memcpy(s, (char *)&h, sizeof(struct RuHead));
+    s += sizeof(struct RuHead);
+    memcpy(s, ru_pat, k);
+    memcpy(s + k, ru_log, ru_len);
+    ua_top += n;
+    return 1;
 }
 
-/* End search mode */
-end_search()
+/* Make the n bytes at s, kept by ru_keep(), the replace-all for
+ * ru_undo() or ru_redo() */
+ru_load(s, n)
+char *s;
+int n;
 {
-    in_search_mode = 0;
-    in_find_mode = 0;
-    buf.search_active = 0;
-    temp_search_str[0] = 0;
-    strcpy(status_msg, "Find cancelled");
-    need_status_update = 1;
+    struct RuHead h;
+    
+    memcpy((char *)&h, s, sizeof(struct RuHead));
+    s += sizeof(struct RuHead);
+    n -= sizeof(struct RuHead);
+    ru_cnt = h.rh_cnt;
+    ru_m = h.rh_m;
+    ru_r = h.rh_r;
+    ru_case = h.rh_case;
+    ru_var = h.rh_var;
+    if (!ru_case) {
+        strcpy(ru_pat, s);
+        s += strlen(ru_pat) + 1;
+        n -= strlen(ru_pat) + 1;
+    }
+    memcpy(ru_log, s, n);
+    ru_len = n;
 }
 
-/* Handle search mode keys */
-search_keys(key)
-int key;
+/* Reverse the replace-all logged in ru_log - the same pass, with each
+ * run passed through and the r bytes after it given back their old
+ * m bytes */
+ru_undo(first)
+int first;
 {
-    int len;
-    
-    if (key == KEY_ESC) {
-        end_search();
-    } else if (key == KEY_ENTER) {
-        /* Execute first find and switch to find mode */
-        if (temp_search_str[0] != 0) {
-            /* User typed something - use it */
-            strcpy(buf.search_str, temp_search_str);
-            find_next();
-            in_search_mode = 0;
-            in_find_mode = 1;
-        } else if (buf.search_str[0] != 0) {
-            /* Blank but previous search exists - reuse it */
-	    strcpy(temp_search_str, buf.search_str);
-            find_next();
-            in_search_mode = 0;
-            in_find_mode = 1;
-        }
-        /* Else: blank and no previous search - do nothing, stay in search mode */
-    } else if (key == 127 || key == KEY_BS) {  /* Backspace */
-        len = strlen(temp_search_str);
-        if (len > 0) {
-            temp_search_str[len - 1] = 0;
-            sprintf(status_msg, "Find: %s", temp_search_str);
+    int n, k, m, r, p, old;
+    char *s;
+    
+    old = buf.text_length;
+    set_curs(first);    /* Before the text changes under it */
+    move_gap_to(first);
+    p = 0;
+    m = ru_m;
+    r = ru_r;
+    for (n = 0; n < ru_cnt; n++) {
+        k = ru_get(&p);
+        if (ru_var) {
+            m = ru_get(&p);
+            r = ru_get(&p);
         }
-    } else if (key >= 32 && key < 127) {
-        len = strlen(temp_search_str);
-        if (len < MAX_SEARCH - 1) {
-            temp_search_str[len] = key;
-            temp_search_str[len + 1] = 0;
-            sprintf(status_msg, "Find: %s", temp_search_str);
+        rs_copy(k);
+        rd_keep(text_ptr + buf.gap_end, r);
+        if (ru_case) {
+            s = (char *)ru_log + p;
+            p += m;
+        } else {
+            s = ru_pat;
         }
+        rs_put(r, s, m);
     }
+    fa_ok = 0;
+    dmg_text(first, buf.gap_start - first, buf.gap_start - first + old - buf.text_length);
+    ensure_vis();
+    it_start(IT_LINES);
 }
 
-/* Find next occurrence */
-find_next()
+/* Do the replace-all in ru_log again - the r bytes of each match are
+ * at s, in order, where ru_undo() kept them */
+ru_redo(first, s)
+int first;
+char *s;
 {
-    int i, j, match, search_len;
-    int screen_pos, vis_lines, screen_height, is_visible;
-    
-    if (!buf.search_active || buf.search_str[0] == 0) {
-        strcpy(status_msg, "No search string");
-        need_status_update = 1;
-        return;
-    }
-    
-    search_len = strlen(buf.search_str);
-    
-    /* Search from current position forward */
-    for (i = buf.cursor_pos + 1; i <= buf.text_length - search_len; i++) {
-        match = 1;
-        for (j = 0; j < search_len; j++) {
-            if (gap_char_at(i + j) != buf.search_str[j]) {
-                match = 0;
-                break;
-            }
+    int n, k, m, r, p, old;
+    
+    old = buf.text_length;
+    set_curs(first);    /* Before the text changes under it */
+    move_gap_to(first);
+    p = 0;
+    m = ru_m;
+    r = ru_r;
+    for (n = 0; n < ru_cnt; n++) {
+        k = ru_get(&p);
+        if (ru_var) {
+            m = ru_get(&p);
+            r = ru_get(&p);
         }
-        
-        if (match) {
-            set_curs(i);  /* Use set_curs to update cursor and line count */
-            buf.search_pos = i;
-            
-            /* Select the found text */
-            buf.selecting = 1;
-            buf.select_start = i;
-            buf.select_end = i + search_len;
-            buf.selection_anchor = i;
-            
-            /* Show find mode message */
-            sprintf(status_msg, "Found: %s - Press Ctrl+F to find next", buf.search_str);
+        if (ru_case) p += m;
+        rs_copy(k);
+        rs_put(m, s, r);
+        s += r;
+    }
+    fa_ok = 0;
+    dmg_text(first, buf.gap_start - first, buf.gap_start - first + old - buf.text_length);
+    ensure_vis();
+    it_start(IT_LINES);
+}
 
-	    screen_pos = buf.topscr_pos;
-	    vis_lines = 0;
-	    screen_height = eff_rows;  /* Use effective rows (accounts for double-spacing) */
-	    is_visible = 0;
-    
-	    /* Walk through visible positions counting visual lines */
-	    while (screen_pos <= i && vis_lines < screen_height) {
-	      if (screen_pos == i) {
-		is_visible = 1;
-		break;
-	      }
-	      screen_pos = visln_next(screen_pos);
-	      vis_lines++;
-	      if (screen_pos <= i && screen_pos >= buf.text_length) break;
-	    }
-    
-	    /* If found text is off-screen, scroll to show it */
-	    if (!is_visible) {
-	      /* Center the found text on screen */
-	      buf.topscr_pos = line_sta(i);
-	      /* Move back a few visual lines for context */
-	      for (j = 0; j < 5 && buf.topscr_pos > 0; j++) {
-		buf.topscr_pos = visln_pre(buf.topscr_pos);
-	      }
-	    }
-	    
-            need_full_redraw = 1;
-            return;
-        }
-    }
-    
-    /* Not found - exit find mode */
-    sprintf(status_msg, "Not found: %s", buf.search_str);
-    in_search_mode = 0;
-    in_find_mode = 0;
-    buf.search_active = 0;
-    need_status_update = 1;
-    need_full_redraw = 1;
+/* Forget the oldest n undo entries */
+undo_drop(n)
+int n;
+{
+    if (n <= 0) return;
+    buf.undo_head = (buf.undo_head + n) & (MAX_UNDO - 1);
+    buf.undo_count -= n;
 }
 
 /* Goto Line Functions */
@@ -2731,11 +6259,28 @@ find_next()
 start_goto()
 {
     in_goto_mode = 1;
+    goto_rpt = 0;
+    goto_pmt = "Goto line: ";
     goto_line_str[0] = 0;  /* Clear line number string */
-    strcpy(status_msg, "Goto line: ");
+    strcpy(status_msg, goto_pmt);
     need_status_update = 1;
 }
 
+/* Ctrl+E - the number prompt asks how many times to play the macro */
+start_rpt(ch)
+int ch;
+{
+    if (mac_rec) {
+        strcpy(status_msg, "Recording - ^R to stop first");
+        need_status_update = 1;
+        return;
+    }
+    start_goto();
+    goto_rpt = 1;
+    goto_pmt = "Repeat macro: ";
+    strcpy(status_msg, goto_pmt);
+}
+
 /* End goto line mode */
 end_goto()
 {
@@ -2752,13 +6297,17 @@ int key;
     
     if (key == KEY_ESC) {
         end_goto();
+    } else if (key == KEY_ENTER && goto_rpt) {
+        /* Play the macro - a blank count plays it once */
+        in_goto_mode = 0;
+        line_num = goto_line_str[0] != 0 ? atoi(goto_line_str) : 1;
+        if (line_num > 0) mac_play(line_num);
     } else if (key == KEY_ENTER) {
         /* Execute goto */
         if (goto_line_str[0] != 0) {
             line_num = atoi(goto_line_str);
             if (line_num > 0) {
                 goto_ln(line_num - 1);  /* goto_ln expects 0-based */
-                need_full_redraw = 1;
             } else {
                 strcpy(status_msg, "Invalid line number");
                 need_status_update = 1;
@@ -2769,14 +6318,14 @@ int key;
         len = strlen(goto_line_str);
         if (len > 0) {
             goto_line_str[len - 1] = 0;
-            sprintf(status_msg, "Goto line: %s", goto_line_str);
+            sprintf(status_msg, "%s%s", goto_pmt, goto_line_str);
         }
     } else if (key >= '0' && key <= '9') {  /* Only digits */
         len = strlen(goto_line_str);
         if (len < 7) {  /* Max 7 digits (9999999) */
             goto_line_str[len] = key;
             goto_line_str[len + 1] = 0;
-            sprintf(status_msg, "Goto line: %s", goto_line_str);
+            sprintf(status_msg, "%s%s", goto_pmt, goto_line_str);
         }
     }
 }
@@ -2836,12 +6385,6 @@ int ln_start, pos;
 do_char(ch)
 int ch;
 {
-
-  int old_end_col;
-  int tab_width;
-  /* Always minimal update for regular characters */
-  /*need_minimal_update = 1;*/
-    
   ensure_gap_at_cursor();
     
   if (!gap_has_space()) {
@@ -2850,154 +6393,69 @@ int ch;
     return;
   }
     
-  add_undo(buf.cursor_pos, 0, ch);
-    
   /* Insert character */
   *(text_ptr + buf.gap_start) = ch;
   buf.gap_start++;
   buf.cursor_pos++;
   buf.text_length++;
+  un_ins(buf.cursor_pos - 1, 1);
   set_dirty(1);
+  dmg_text(buf.cursor_pos - 1, 1, 0);
   
   /* Track total lines when inserting newline */
   if (IS_LINE_END(ch)) {
       total_logical_lines++;
   }
     
-  /* Simple cursor tracking for regular characters */
-  if (ch == 9) {
-    /* Tab - calculate width for cur_end_col tracking */
-    tab_width = calc_tab_width(cursor_col);
-    old_end_col = cur_end_col;
-    cur_end_col += tab_width;
-    
-    /* Check if tab caused wrapping change */
-    if (cur_end_col >= screen_cols) {
-        cur_end_col = cur_end_col - screen_cols;
-        need_redraw_down = 1;
-        need_minimal_update = 0;
-        need_char_update = 0;
-    } else {
-        /* Tab didn't cause wrap - use minimal update */
-        need_minimal_update = 1;
-        need_redraw_down = 0;
-        need_char_update = 0;
-    }
-    
-    /* Don't manually adjust cursor_col/log_row - let fast_curs() do it */
-    
-  } else {
-    /* Regular character */
-    old_end_col = cur_end_col;
-    cur_end_col++;
-      
+  /* Simple cursor tracking for regular characters - tabs are left to
+     fast_curs() */
+  if (ch != 9) {
     cursor_col++;
     if (cursor_col >= screen_cols) {
       log_row++;
       cursor_col = 0;
     }
-
-    /* Handle cur_end_col wrapping */
-    if (cur_end_col >= screen_cols) {
-        cur_end_col = cur_end_col - screen_cols;  /* Wrapped to next visual line */
-        need_redraw_down = 1;  /* Wrapping changed */
-        need_char_update = 0;
-    } else {
-        need_char_update = 1;
-        need_redraw_down = 0;
-    }
-
-	
   }
 
-
-  update_from_pos = buf.cursor_pos - 1;
   need_status_update = 1;
 }
 
 do_back()
 {
      char deleted_char;
-     int old_end_col;
     
     if (buf.cursor_pos <= 0) return;
     
     ensure_gap_at_cursor();
     
     deleted_char = *(text_ptr + buf.gap_start - 1);
-    add_undo(buf.cursor_pos - 1, 1, deleted_char);
+    un_del(buf.cursor_pos - 1, 1);
     
     /* Delete character */
     buf.gap_start--;
     buf.cursor_pos--;
     buf.text_length--;
     set_dirty(1);
+    dmg_text(buf.cursor_pos, 0, 1);
     
     /* Track total lines when deleting newline */
     if (IS_LINE_END(deleted_char)) {
         total_logical_lines--;
     }
     
-      /* Special case: if buffer is now empty, force full redraw */
-    if (buf.text_length == 0) {
-        need_full_redraw = 1;
-        need_status_update = 1;
-        return;
-    }
-    
     /* Incremental cursor tracking - move backward */
     if (IS_LINE_END(deleted_char)) {
-      /* Deleted newline - complex case, need to recalculate */
+      /* Deleted newline - recalculate from the top of the screen */
       fast_curs();  
 
         buf.ccurs_ln--;
-
-    
-      /* For newline deletion, just force full redraw - more reliable */
-      need_minimal_update = 0;
-      need_redraw_down = 0;
-      need_full_redraw = 1;
-      update_from_pos = buf.cursor_pos - 1;     
-    } else if (deleted_char == 9) {
-      /* Deleted tab */
-      
-      /* If line ending is close to start of visual line, we're un-wrapping */
-      if (cur_end_col < tab_wdth) {
-        need_redraw_down = 1;  /* Wrapping changed */
-        need_minimal_update = 0;
-        need_char_update = 0;
-      } else {
-        /* Tab didn't cause wrap change - use minimal update */
-        need_minimal_update = 1;
-        need_redraw_down = 0;
-        need_char_update = 0;
-      }
-      
-      /* Don't manually adjust cursor_col/log_row - let fast_curs() do it */
-      
-      /* Redraw from current cursor position */
-      update_from_pos = buf.cursor_pos;
-    } else {
-      old_end_col = cur_end_col;/* Regular character - simple backtrack */
+    } else if (deleted_char != 9) {
+      /* Regular character - simple backtrack; tabs are left to fast_curs() */
       cursor_col--;
-      cur_end_col--;
       if (cursor_col < 0) {
 	log_row--;
 	cursor_col = screen_cols - 1;  /* Wrap to end of previous line */
       }
-
-      /* Handle cur_end_col un-wrapping */
-      if (cur_end_col < 0) {
-	cur_end_col = screen_cols - 1;  /* Un-wrapped from previous visual line */
-        need_redraw_down = 1;  /* Wrapping changed */
-        need_char_update = 0;
-      } else {
-        need_char_update = 1;
-        need_redraw_down = 0;
-      }
-	
-      /* Redraw from current cursor position */
-      update_from_pos = buf.cursor_pos;
     }
 
     need_status_update = 1;
@@ -3010,11 +6468,11 @@ do_cr_enter()
     ensure_gap_at_cursor();
     if (!gap_has_space()) return;
     
-    add_undo(buf.cursor_pos, 0, CR);  /* Insert CR */
     *(text_ptr + buf.gap_start) = CR;  /* Insert CR */
     buf.gap_start++;
     buf.cursor_pos++;
     buf.text_length++;
+    un_ins(buf.cursor_pos - 1, 1);
     set_dirty(1);
     total_logical_lines++;  /* Track total lines */
     
@@ -3023,19 +6481,12 @@ do_cr_enter()
         buf.ccurs_ln++;
 
     
-    /* (2) Clear to end of current line */
-    write_block(1, CLEAR_EOL, 1);
+    /* (2) Rows from here down are repainted by upd_fast() */
+    dmg_text(buf.cursor_pos - 1, 1, 0);
     
-    /* (3) Advance cursor to next row and start drawing */
+    /* (3) Advance cursor to next row */
     log_row++;
     cursor_col = 0;
-    write_pos(cursor_col, PHYS_ROW(log_row));
-     
-    /* Draw remaining text from cursor position */
-    if (buf.cursor_pos < buf.text_length) {
-        need_redraw_down = 1;
-        update_from_pos = buf.cursor_pos;
-    }
     
     need_status_update = 1;  /* Update status bar for line count change */
 }
@@ -3047,11 +6498,11 @@ do_lf_enter()
     ensure_gap_at_cursor();
     if (!gap_has_space()) return;
     
-    add_undo(buf.cursor_pos, 0, LF);  /* Insert LF */
     *(text_ptr + buf.gap_start) = LF;  /* Insert LF */
     buf.gap_start++;
     buf.cursor_pos++;
     buf.text_length++;
+    un_ins(buf.cursor_pos - 1, 1);
     set_dirty(1);
     total_logical_lines++;  /* Track total lines */
     
@@ -3060,21 +6511,12 @@ do_lf_enter()
         buf.ccurs_ln++;
 
     
-    /* (2) Clear to end of current line */
-    putchar(0x04);
+    /* (2) Rows from here down are repainted by upd_fast() */
+    dmg_text(buf.cursor_pos - 1, 1, 0);
     
-    /* (3) Advance cursor to next row and start drawing */
+    /* (3) Advance cursor to next row */
     log_row++;
     cursor_col = 0;
-    putchar(0x02);
-    putchar(cursor_col + 0x20);
-    putchar(PHYS_ROW(log_row) + 0x20);
-    
-    /* Draw remaining text from cursor position */
-    if (buf.cursor_pos < buf.text_length) {
-        need_redraw_down = 1;
-        update_from_pos = buf.cursor_pos;
-    }
     
     need_status_update = 1;  /* Update status bar for line count change */
 }
@@ -3110,7 +6552,6 @@ ensure_vis()
         for (j = 0; j < 5 && buf.topscr_pos > 0; j++) {
             buf.topscr_pos = visln_pre(buf.topscr_pos);
         }
-        need_full_redraw = 1;
     }
 }
 
@@ -3167,469 +6608,730 @@ int line;
 clear_eol(from_col, row)
 int from_col, row;
 {
-    putchar(0x04);
+    term_cap(TC_CLREOL);
 }
 
-add_undo(pos, action, ch)
-int pos, action;
-char ch;
+/* New entry on top of the undo stack - its bytes are the caller's.  A
+ * full ring overwrites the oldest entry. */
+add_undo(pos, action, len)
+int pos, action, len;
 {
-    int i;
-    
-    if (buf.undo_count < MAX_UNDO) {
-        /* Buffer not full - add normally */
-        buf.undo_buf[buf.undo_count].pos = pos;
-        buf.undo_buf[buf.undo_count].action = action;
-        buf.undo_buf[buf.undo_count].ch = ch;
-        buf.undo_count++;
+    struct UndoEntry *e;
+    
+    rd_drop();
+    if (buf.undo_count == MAX_UNDO) un_spill(1);
+    e = UNDO_AT(buf.undo_count);
+    buf.undo_count++;
+    e->pos = pos;
+    e->action = action;
+    e->len = len;
+    e->grp = undo_grp;
+}
+
+/* n bytes were just inserted at pos - typed ones join the open entry
+ * when they follow it, unless they start a new word */
+un_ins(pos, n)
+int pos, n;
+{
+    struct UndoEntry *e;
+    
+    if (n <= 0 || un_skip) return;
+    rd_drop();
+    e = UNDO_AT(buf.undo_count - 1);
+    if (un_open && buf.undo_count > 0 && tm_now() - un_time < UN_PAUSE &&
+        e->action == 0 && pos == e->pos + e->len &&
+        !(n == 1 && is_word_char(gap_char_at(pos)) &&
+          !is_word_char(gap_char_at(pos - 1)))) {
+        e->len += n;
+    } else {
+        add_undo(pos, 0, n);
+    }
+    un_open = 1;
+    un_time = tm_now();
+}
+
+/* n bytes at pos are about to be deleted.  Backspace takes back what
+ * the open entry typed, or grows a delete entry to the left; any other
+ * delete is one entry, its bytes copied to the arena in one go.
+ * Returns 0 if it cannot be undone - the history before it is gone. */
+un_del(pos, n)
+int pos, n;
+{
+    int i, g;
+    char *s;
+    struct UndoEntry *e;
+    
+    if (n <= 0) return 1;
+    rd_drop();
+    e = UNDO_AT(buf.undo_count - 1);
+    g = undo_grp;
+    if (un_open && buf.undo_count > 0 && tm_now() - un_time < UN_PAUSE &&
+        n == 1) {
+        if (e->action == 0 && pos == e->pos + e->len - 1) {
+            /* Typed in this entry - forget it was */
+            if (--e->len == 0) {
+                buf.undo_count--;
+                un_open = 0;
+                return 1;
+            }
+            un_time = tm_now();
+            return 1;
+        }
+        if (e->action == 1 && pos == e->pos - 1) {
+            if (e->len < UNDO_SPAN && ua_room(1)) {
+                /* Its bytes are the last in the arena */
+                s = ua_buf + e->off;
+                for (i = e->len; i > 0; i--) {
+                    s[i] = s[i - 1];
+                }
+                s[0] = gap_char_at(pos);
+                e->pos--;
+                e->len++;
+                ua_top++;
+                un_time = tm_now();
+                return 1;
+            }
+            /* Full - the next entry undoes with it */
+            if (g == 0) {
+                if (e->grp == 0) e->grp = ++grp_seq;
+                g = e->grp;
+            }
+        }
+    }
+    if (ua_room(n)) {
+        add_undo(pos, 1, n);
+        e = UNDO_AT(buf.undo_count - 1);
+        e->off = ua_top;
+        gap_copy(ua_buf + ua_top, pos, n);
+        ua_top += n;
+    } else if (un_big(pos, n)) {
+        add_undo(pos, 1, n);
+        e = UNDO_AT(buf.undo_count - 1);
+        e->off = -1;
     } else {
-        /* Buffer full - shift everything left to make room */
-        /* This discards the oldest operation and keeps the most recent */
-        for (i = 0; i < MAX_UNDO - 1; i++) {
-            /* Copy struct members individually (OS-9 C compatibility) */
-            buf.undo_buf[i].pos = buf.undo_buf[i + 1].pos;
-            buf.undo_buf[i].action = buf.undo_buf[i + 1].action;
-            buf.undo_buf[i].ch = buf.undo_buf[i + 1].ch;
+        un_open = 0;
+        strcpy(status_msg, "Too big to undo");
+        return 0;
+    }
+    e->grp = g;
+    un_open = 1;
+    un_time = tm_now();
+    return 1;
+}
+
+/* The n bytes at pos go straight to the spilled history, too big for
+ * the arena.  Everything in the ring is spilled first, so they are the
+ * top of it until their entry is undone or spilled in turn.  Returns 0
+ * if they could not be written - the history is dropped. */
+un_big(pos, n)
+int pos, n;
+{
+    int k;
+    
+    un_spill(buf.undo_count);
+    ua_top = 0;
+    k = buf.gap_start - pos;
+    if (k > n) k = n;
+    if (k < 0) k = 0;
+    if (sp_io(text_ptr + pos, sp_top, k, 1) &&
+        sp_io(text_ptr + buf.gap_end + pos + k - buf.gap_start,
+              sp_top + k, n - k, 1)) {
+        sp_top += n;
+        return 1;
+    }
+    sp_drop();
+    return 0;
+}
+
+/* Room for n more bytes in the arena, 0 if it cannot hold them.  The
+ * oldest entries are spilled until the rest fit, then the bytes of the
+ * rest slide down to the start. */
+ua_room(n)
+int n;
+{
+    int i, k, lo;
+    struct UndoEntry *e;
+    
+    if (ua_buf == NULL || n > UA_MAX) return 0;
+    if (ua_top + n <= UA_MAX) return 1;
+    lo = ua_top + n - UA_MAX;   /* Bytes below this must go */
+    k = 0;
+    for (i = 0; i < buf.undo_count; i++) {
+        e = UNDO_AT(i);
+        if (e->action != 0 && e->off >= 0) {
+            if (e->off >= lo) break;
+            k = i + 1;
+        }
+    }
+    un_spill(k);
+    
+    /* The oldest delete left starts the arena */
+    lo = ua_top;
+    for (i = 0; i < buf.undo_count; i++) {
+        e = UNDO_AT(i);
+        if (e->action != 0 && e->off >= 0) {
+            if (lo == ua_top) lo = e->off;
+            e->off -= lo;
+        }
+    }
+    for (i = lo; i < ua_top; i++) {
+        ua_buf[i - lo] = ua_buf[i];
+    }
+    ua_top -= lo;
+    return 1;
+}
+
+/* An edit - nothing undone can be redone now */
+rd_drop()
+{
+    buf.redo_count = 0;
+}
+
+/* Move the oldest k entries out to the spilled history.  If it cannot
+ * take one, that entry and everything older is forgotten. */
+un_spill(k)
+int k;
+{
+    int n;
+    struct UndoEntry *e;
+    
+    while (k-- > 0) {
+        e = UNDO_AT(0);
+        n = e->action != 0 && e->off >= 0 ? e->len : 0;    /* -1: already there */
+        if (n > 0 && !sp_io(ua_buf + e->off, sp_top, n, 1)) {
+            sp_drop();
+        } else if (!sp_io((char *)e, sp_top + n,
+                          sizeof(struct UndoEntry), 1)) {
+            sp_drop();
+        } else {
+            sp_top += n + sizeof(struct UndoEntry);
+        }
+        undo_drop(1);
+    }
+}
+
+/* Entries there are to undo.  With none left in memory the newest
+ * spilled one is read back in below the redo entries, its bytes at the
+ * start of the arena, so do_undo() goes on as if it had never left.
+ * Bytes too big for the arena stay where they are. */
+un_have()
+{
+    struct UndoEntry *e;
+    
+    if (buf.undo_count > 0 || sp_top == 0) return buf.undo_count;
+    if (buf.redo_count == MAX_UNDO) buf.redo_count--;
+    e = &buf.undo_buf[(buf.undo_head - 1) & (MAX_UNDO - 1)];
+    sp_top -= sizeof(struct UndoEntry);
+    if (!sp_io((char *)e, sp_top, sizeof(struct UndoEntry), 0)) {
+        sp_drop();
+        return 0;
+    }
+    ua_top = 0;
+    if (e->action == 1 && (ua_buf == NULL || e->len > UA_MAX)) {
+        e->off = -1;
+    } else if (e->action != 0) {
+        sp_top -= e->len;
+        if (!sp_io(ua_buf, sp_top, e->len, 0)) {
+            sp_drop();
+            return 0;
+        }
+        e->off = 0;
+        ua_top = e->len;
+    }
+    buf.undo_head = (buf.undo_head - 1) & (MAX_UNDO - 1);
+    buf.undo_count = 1;
+    return 1;
+}
+
+/* Forget the spilled history */
+sp_drop()
+{
+    sp_top = 0;
+}
+
+/* Write (wr) or read n bytes at s to or from the spilled history at
+ * pos, 0 if it could not */
+sp_io(s, pos, n, wr)
+char *s;
+long pos;
+int n, wr;
+{
+#ifdef posix
+    if (sp_fp == NULL) sp_fp = tmpfile();
+    if (sp_fp == NULL || fseek(sp_fp, pos, 0) != 0) return 0;
+    if (wr) return fwrite(s, 1, n, sp_fp) == n;
+    return fread(s, 1, n, sp_fp) == n;
+#else
+    int b, o, k;
+    char *p;
+    
+    while (n > 0) {
+        b = pos / 8192;
+        o = pos % 8192;
+        k = 8192 - o < n ? 8192 - o : n;
+        if (b == sp_nblk && wr && sp_nblk < SP_BLKS) {
+            sp_blk[b] = alloc_ram_blocks(1);
+            if (sp_blk[b] < 0) return 0;
+            sp_nblk++;
+        }
+        if (b >= sp_nblk) return 0;
+        p = map_blocks(sp_blk[b], 1);
+        if (p == NULL) return 0;
+        if (wr) {
+            memcpy(p + o, s, k);
+        } else {
+            memcpy(s, p + o, k);
         }
-        /* Add new entry at end */
-        buf.undo_buf[MAX_UNDO - 1].pos = pos;
-        buf.undo_buf[MAX_UNDO - 1].action = action;
-        buf.undo_buf[MAX_UNDO - 1].ch = ch;
-        /* undo_count stays at MAX_UNDO */
+        unmap_blocks(p, 1);
+        s += k;
+        pos += k;
+        n -= k;
     }
+    return 1;
+#endif
 }
 
 do_undo()
 {
-    struct UndoEntry *entry;
-    int i;
+    int grp;
     
-    if (buf.undo_count <= 0) {
+    if (un_have() <= 0) {
         strcpy(status_msg, "Nothing to undo");
         need_status_update = 1;
         return;
     }
-    
-    buf.undo_count = buf.undo_count - 1;
-    entry = &buf.undo_buf[buf.undo_count];
-    
-    if (entry->action == 0) {
-        /* Undo insert: delete the character that was inserted */
-        /* Position cursor after the inserted character, then delete backward */
-        set_curs(entry->pos + 1);
-        ensure_gap_at_cursor();
-        if (buf.cursor_pos > 0) {
-            buf.gap_start--;  /* Delete by moving gap start backward (like backspace) */
-            buf.cursor_pos--;
-            buf.text_length--;
-        }
-    } else {
-        /* Insert character (gap buffer style) */
-        ensure_gap_at_cursor();
-        if (gap_has_space()) {
-            *(text_ptr + buf.gap_start) = entry->ch;
-            buf.gap_start++;
-            buf.text_length++;
-            set_curs(entry->pos + 1);
-        }
-    }
+    clr_sel();  /* Its span would not survive the text changing */
+    if (buf.redo_count == 0) rd_top = 0;
+    if (rd_buf == NULL) rd_buf = (char *)malloc(RD_MAX);
+    rd_lost = rd_buf == NULL;
+    
+    /* The whole group, newest first */
+    do {
+        buf.undo_count = buf.undo_count - 1;
+        buf.redo_count++;
+        grp = UNDO_AT(buf.undo_count)->grp;
+        undo_one(UNDO_AT(buf.undo_count));
+    } while (grp != 0 && un_have() > 0 &&
+             UNDO_AT(buf.undo_count - 1)->grp == grp);
+    if (grp != 0) ensure_vis();  /* A group can end far from the screen */
+    if (rd_lost) buf.redo_count = 0;
     
     set_dirty(1);
     strcpy(status_msg, "Undone");
     temp_message_active = 1;
     need_status_update = 1;
-    recount_total_lines();  /* Recalculate after undo */
-    update_from_pos = entry->pos;
-    need_minimal_update = 1;
 }
 
-/* Unified display function - replaces fast_show, fast_line, fast_from_pos
- * from_pos: starting buffer position
- * stop_type: -1=end of line, -2=bottom of screen, else stop at position
- * row: starting row on screen
- * col: starting column on screen
- */
-draw_range(from_pos, stop_type, row, col)
-int from_pos, stop_type, row, col;
+/* Ctrl+Y - put back what the last undo took, a group at a time */
+do_redo()
 {
-    int i, chunk_start, stop_pos;
-    char ch;
-    int in_reverse;
-    int need_wrap;  /* Add flag for wrap handling */
-    int just_wrapped;
+    int grp;
     
-    in_reverse = 0;
-    need_wrap = 0;
-    
-    /* Defensive checks */
-    if (from_pos < 0) from_pos = 0;
-
-    if (from_pos >= buf.text_length) {
-      /* At or past end of buffer - clear the screen from this position */
-      if (row < status_row) {
-        write_pos(col, row);
-        write_block(1, CLEAR_EOL, 1);
-      }
-        
-      /* Clear remaining lines if drawing full screen */
-      if (stop_type == -2 && row < status_row - 1) {
-	row++;
-	while (row < status_row) {
-	  write_pos(0, row);
-	  write_block(1, ERASE_LINE, 1);
-	  row++;
-	}
-      }
-      return;
+    if (buf.redo_count <= 0) {
+        strcpy(status_msg, "Nothing to redo");
+        need_status_update = 1;
+        return;
     }
+    clr_sel();
     
+    /* The whole group, oldest first */
+    do {
+        grp = UNDO_AT(buf.undo_count)->grp;
+        redo_one(UNDO_AT(buf.undo_count));
+        buf.undo_count++;
+        buf.redo_count--;
+    } while (grp != 0 && buf.redo_count > 0 &&
+             UNDO_AT(buf.undo_count)->grp == grp);
+    if (grp != 0) ensure_vis();
     
-    /* Determine stopping position */
-    if (stop_type == -1) {
-        stop_pos = line_end(from_pos);
-    } else if (stop_type == -2) {
-        stop_pos = buf.text_length;
-    } else {
-        stop_pos = stop_type;
+    set_dirty(1);
+    strcpy(status_msg, "Redone");
+    temp_message_active = 1;
+    need_status_update = 1;
+}
+
+/* Keep n bytes at s on the redo stack */
+rd_keep(s, n)
+char *s;
+int n;
+{
+    if (rd_lost || rd_top + n > RD_MAX) {
+        rd_lost = 1;
+        return;
     }
+    memcpy(rd_buf + rd_top, s, n);
+    rd_top += n;
+}
+
+/* Line ends in the n bytes at s */
+nl_cnt(s, n)
+char *s;
+int n;
+{
+    int k;
     
-    /* Validate bounds */
-    if (stop_pos > buf.text_length) stop_pos = buf.text_length;
-    if (from_pos >= stop_pos) return;
-    
-    /* Position cursor at starting location */
-    write_pos(col, row);
-    
-    /* Check initial selection state */
-    if (buf.selecting && from_pos >= buf.select_start && from_pos < buf.select_end) {
-        write_block(1, REV_ON, 2);
-        in_reverse = 1;
+    k = 0;
+    while (n-- > 0) {
+        if (IS_LINE_END(*s)) k++;
+        s++;
     }
-    
-    /* Main drawing loop with chunking */
-    i = from_pos;
-    while (i < stop_pos && row < status_row) {
-        
-        /* Check for selection boundary at current position */
-        if (buf.selecting) {
-            if (i == buf.select_start && !in_reverse) {
-                write_block(1, REV_ON, 2);
-                in_reverse = 1;
-            } else if (i == buf.select_end && in_reverse) {
-                write_block(1, REV_OFF, 2);
-                in_reverse = 0;
-            }
-        }
+    return k;
+}
 
-	just_wrapped = 0;
-        /* Handle pending wrap from previous iteration */
-        if (need_wrap) {
-            row++;
-            if (dbl_space) {
-                /* Erase the spacing row */
-                if (row < status_row) {
-                    write_pos(0, row);
-                    write_block(1, ERASE_LINE, 1);
-                }
-                row++;  /* Skip to actual text row */
-            }
-            if (row >= status_row) break;
-            write_pos(0, row);
-            col = 0;
-            need_wrap = 0;
-	    just_wrapped = 1;
-        }
-        
-        /* Build chunk of regular characters */
-        chunk_start = i;
-        while (i < stop_pos && row < status_row) {
-            ch = gap_char_at(i);
-            
-            /* Stop chunk at special characters */
-            if (IS_LINE_END(ch) || ch == 9) break;
-            
-            /* Stop chunk at NEXT selection boundary */
-            if (buf.selecting) {
-                if ((i + 1) == buf.select_start || (i + 1) == buf.select_end) {
-                    /* Include current char, stop before boundary */
-                    col++;  /* Count this character */
-                    i++;
-                    if (col >= screen_cols) need_wrap = 1;
-                    break;
-                }
-            }
-            
-            /* Regular printable character */
-            if (ch >= 32 && ch < 127) {
-	      /* Check if we're about to hit column 80 */
-	      if (col == screen_cols - 1) {
-		/* Output chunk up to but not including this character */
-		if (i > chunk_start) {
-		  write_gap_block(1, chunk_start, i - chunk_start);
-		}
-            
-		/* Output the character at column 79 */
-		putchar(ch);
-            
-		/* Manually position to next line BEFORE terminal auto-wraps */
-		row++;
-		if (dbl_space) {
-		    /* Erase the spacing row */
-		    if (row < status_row) {
-		        write_pos(0, row);
-		        write_block(1, ERASE_LINE, 1);
-		    }
-		    row++;  /* Skip to actual text row */
-		}
-		if (row >= status_row) {
-		  i++;
-		  break;
-		}
-		write_pos(0, row);
-		col = 0;
-		i++;
-            
-		/* Start new chunk from next character */
-		chunk_start = i;
-	      } else {
-		col++;
-		i++;
-	      }
-            } else {
-	      /* Non-printable - treat as single char */
-	      col++;
-	      i++;
-	      if (col >= screen_cols) need_wrap = 1;
-	      break;
+/* Reverse one undo entry - one move of the gap and one damage record.
+ * The line count follows the span, so there is nothing to recount.
+ * set_curs() counts lines in the text it walks, so the cursor goes to
+ * the entry first, where the change leaves the text before it alone. */
+undo_one(entry)
+struct UndoEntry *entry;
+{
+    int n;
+    char *s;
+    
+    n = entry->len;
+    if (entry->action == 2) {
+        /* Its log goes on the redo stack, ahead of the new bytes */
+        s = ua_buf + entry->off;
+        ru_load(s, n);
+        ua_top = entry->off;
+        entry->off = rd_top;
+        rd_keep(s, n);
+        ru_undo(entry->pos);
+    } else if (entry->action == 0) {
+        /* Undo insert: the span goes back into the gap */
+        entry->off = rd_top;
+        set_curs(entry->pos);
+        move_gap_to(entry->pos + n);
+        s = text_ptr + buf.gap_start - n;
+        rd_keep(s, n);
+        total_logical_lines -= nl_cnt(s, n);
+        buf.gap_start -= n;
+        buf.text_length -= n;
+        dmg_text(entry->pos, 0, n);
+    } else if (buf.gap_end - buf.gap_start >= n) {
+        /* Undo delete: the span comes back out of it in one block */
+        set_curs(entry->pos);
+        move_gap_to(entry->pos);
+        s = text_ptr + buf.gap_start;
+        if (entry->off >= 0) {
+            memcpy(s, ua_buf + entry->off, n);
+            ua_top = entry->off;    /* They were the last in the arena */
+        } else {
+            /* The top of the spilled history - see un_big() */
+            sp_top -= n;
+            if (!sp_io(s, sp_top, n, 0)) {
+                sp_drop();
+                rd_lost = 1;
+                return;
             }
         }
-        
-        /* Output the chunk if we have characters */
-        if (i > chunk_start) {
-            write_gap_block(1, chunk_start, i - chunk_start);
-        }
-        
-        /* Process special character if we stopped at one (not wrap) */
-        if (i < stop_pos && row < status_row && !need_wrap) {
-            ch = gap_char_at(i);
-            
-            if (IS_LINE_END(ch)) {
-	      /* Make sure reverse video is off before clearing line */
-	      if (in_reverse) {
-		write_block(1, REV_OFF, 2);
-		in_reverse = 0;
-	      }
-	      
-	      write_block(1, CLEAR_EOL, 1);
-                
-	      /* For line-only mode, stop here */
-	      if (stop_type == -1) break;
-                
-	      /* Move to next line */
-	      row++;
-	      if (dbl_space) {
-	          /* Erase the spacing row */
-	          if (row < status_row) {
-	              write_pos(0, row);
-	              write_block(1, ERASE_LINE, 1);
-	          }
-	          row++;  /* Skip to actual text row */
-	      }
-	      if (row >= status_row) break;
-	      write_pos(0, row);
-	      col = 0;
-	      i++;
-
-	      /* Check if we need to turn reverse back on for next line */
-	      if (buf.selecting && i >= buf.select_start && i < buf.select_end) {
-		write_block(1, REV_ON, 2);
-		in_reverse = 1;
-	      }
-                
-            } else if (ch == 9) {
-                /* Tab character */
-                int target_col;
-                target_col = NEXT_TAB(col);
-                
-                while (col < target_col && col < screen_cols) {
-                    putchar(' ');
-                    col++;
-                }
-                
-                if (col >= screen_cols) {
-                    need_wrap = 1;
-                }
-                i++;
+        total_logical_lines += nl_cnt(s, n);
+        buf.gap_start += n;
+        buf.text_length += n;
+        dmg_text(entry->pos, n, 0);
+        set_curs(entry->pos + n);
+    }
+}
+
+/* Apply an undone entry again - the same single gap move, with the
+ * cursor moved first as in undo_one() */
+redo_one(entry)
+struct UndoEntry *entry;
+{
+    int n;
+    char *s;
+    
+    n = entry->len;
+    if (entry->action != 1) {
+        rd_top = entry->off;
+        s = rd_buf + rd_top;
+    }
+    if (entry->action == 2) {
+        ru_load(s, n);
+        ru_redo(entry->pos, s + n);
+        ua_room(n);     /* The log goes back in the arena - it fitted */
+        entry->off = ua_top;
+        memcpy(ua_buf + ua_top, s, n);
+        ua_top += n;
+    } else if (entry->action == 0) {
+        set_curs(entry->pos);
+        move_gap_to(entry->pos);
+        memcpy(text_ptr + buf.gap_start, s, n);
+        total_logical_lines += nl_cnt(s, n);
+        buf.gap_start += n;
+        buf.text_length += n;
+        dmg_text(entry->pos, n, 0);
+        set_curs(entry->pos + n);
+    } else {
+        /* Its bytes go back in the arena, or on the spill as before */
+        set_curs(entry->pos);
+        move_gap_to(entry->pos);
+        if (ua_room(n)) {
+            entry->off = ua_top;
+            memcpy(ua_buf + ua_top, text_ptr + buf.gap_end, n);
+            ua_top += n;
+        } else {
+            entry->off = -1;
+            if (!un_big(entry->pos, n)) {
+                entry->len = 0;     /* Nothing to put back - a no-op */
             }
         }
+        total_logical_lines -= nl_cnt(text_ptr + buf.gap_end, n);
+        buf.gap_end += n;
+        buf.text_length -= n;
+        dmg_text(entry->pos, 0, n);
     }
-    
-    /* Ensure selection state is off when done */
-    if (in_reverse) {
-        write_block(1, REV_OFF, 2);
+}
+
+/* Screen damage tracking - mutations record what changed, the renderer
+ * repaints exactly the text rows that no longer match the screen */
+
+/* Mark one text row for repaint */
+dmg_row(r)
+int r;
+{
+    if (r >= 0 && r < MAX_ROWS) {
+        row_bits[r >> 3] |= 1 << (r & 7);
     }
+}
+
+/* Mark every text row for repaint */
+dmg_all()
+{
+    int i;
     
-    /* Clear to end of current line */
-    if ((col > 0 || i >= buf.text_length - 1) && row < status_row) {
-        write_block(1, CLEAR_EOL, 1);
+    for (i = 0; i < sizeof(row_bits); i++) {
+        row_bits[i] = 0xFF;
     }
-    
-    /* If we reached end of buffer, clear remaining lines on screen */
-    /* This handles un-wrapping of the last line */
-    if (i >= buf.text_length && row < status_row - 1) {
-        row++;
-        while (row < status_row) {
-            write_pos(0, row);
-            write_block(1, ERASE_LINE, 1);
-            row++;
+}
+
+/* Record a text change at pos: del chars removed, ins chars inserted.
+ * Call after the gap buffer has been updated; the search indexes, the
+ * selection scope and the idle tasks are told about it here. */
+dmg_text(pos, ins, del)
+int pos, ins, del;
+{
+    it_edit(pos);
+    tg_mark(pos, pos + ins);
+    sc_edit(pos, ins, del);
+    fa_edit(pos, ins, del);
+    dmg_attr = 0;
+    dmg_rng(pos, ins, del);
+    
+    /* Edit above the screen - keep the top on a visual line start */
+    if (pos < buf.topscr_pos) {
+        if (buf.topscr_pos >= pos + del) {
+            buf.topscr_pos += ins - del;
+        } else {
+            buf.topscr_pos = pos;
         }
+        buf.topscr_pos = visln_sta(buf.topscr_pos);
     }
-    
-    /* For full screen mode, also clear remaining lines */
-    if (stop_type == -2 && row < status_row - 1) {
-        row++;
-        while (row < status_row) {
-            write_pos(0, row);
-            write_block(1, ERASE_LINE, 1);
-            row++;
-        }
+}
+
+/* Attributes changed over [lo, hi) - same text, same length */
+dmg_span(lo, hi)
+int lo, hi;
+{
+    if (hi <= lo) return;
+    dmg_attr = dmg_lo < 0 || dmg_attr;
+    dmg_rng(lo, hi - lo, hi - lo);
+}
+
+/* Add a change at pos to the pending range.  It is kept in current
+ * coordinates; text past dmg_hi is old text moved by dmg_delta. */
+dmg_rng(pos, ins, del)
+int pos, ins, del;
+{
+    if (dmg_lo < 0) {
+        dmg_lo = pos;
+        dmg_hi = pos + ins;
+        dmg_delta = ins - del;
+    } else {
+        if (pos < dmg_hi) dmg_hi += ins - del;
+        if (dmg_hi < pos + ins) dmg_hi = pos + ins;
+        if (pos < dmg_lo) dmg_lo = pos;
+        dmg_delta += ins - del;
     }
 }
 
-/* Replace fast_show() */
-fast_show()
+/* Where an old row start sits now, -2 if it was inside the change */
+row_map(q)
+int q;
 {
-    write_block(1, HIDE_CURSOR, 2);
-    draw_range(buf.topscr_pos, -2, text_start_row, 0);
-    write_block(1, SHOW_CURSOR, 2);
+    if (q < 0 || dmg_lo < 0 || q < dmg_lo) return q;
+    if (q >= dmg_hi - dmg_delta) return q + dmg_delta;
+    return -2;
 }
 
-/* Replace fast_line() */  
-fast_line(from_pos)
-int from_pos;
+/* Start of the visual row after the one starting at pos, -1 if none */
+row_next(pos)
+int pos;
 {
-    int row, col, i, vis_start;
+    int col;
     char ch;
     
-    /* Find the start of the visual line containing from_pos */
-    vis_start = visln_sta(from_pos);
-    
-    /* Find the screen row where this visual line starts */
-    /* Count lines from top of screen to vis_start */
-    i = get_top_pos();
-    row = text_start_row;
     col = 0;
+    while (pos < buf.text_length) {
+        ch = gap_char_at(pos);
+        if (IS_LINE_END(ch)) return pos + 1;
+        col = col_adv(col, ch);
+        if (col >= screen_cols) return pos + 1;
+        pos++;
+    }
+    return -1;
+}
+
+/* Repaint text row r whose visual line starts at pos (-1 = past end of
+ * text).  Cells before 'from' and, when 'to' >= 0, from 'to' on are known
+ * good and are left alone. */
+draw_row(r, pos, from, to)
+int r, pos, from, to;
+{
+    int i, col, row, plain, chunk_start, target_col;
+    char ch;
     
-    /* Scan to find screen position of vis_start */
-    while (i < vis_start && i < buf.text_length) {
-        ch = gap_char_at(i);
-        if (IS_LINE_END(ch)) {
-            row++;
-            if (dbl_space) row++;  /* Add spacing between lines */
-            col = 0;
-        } else if (ch == 9) {
-            do {
-                col++;
-                if (col >= screen_cols) {
-                    row++;
-                    if (dbl_space) row++;  /* Add spacing for wrapped lines */
-                    col = 0;
-                    break;
-                }
-            } while (TAB_MOD(col) != 0);
-        } else {
-            col++;
-            if (col >= screen_cols) {
-                row++;
-                if (dbl_space) row++;  /* Add spacing for wrapped lines */
-                col = 0;
-            }
-        }
-        i++;
+    row = PHYS_ROW(r);
+    if (pos < 0) {
+        write_pos(0, row);
+        term_cap(TC_CLREOL);
+        return;
     }
     
-    /* Now row is correct, and col should be 0 (start of visual line) */
-    /* Continue scanning from vis_start to from_pos to get column */
+    /* Column of the first cell to draw */
     col = 0;
-    while (i < from_pos && i < buf.text_length) {
+    for (i = pos; i < from; i++) {
+        col = col_adv(col, gap_char_at(i));
+    }
+    write_pos(col, row);
+    
+    if (to < 0) to = buf.text_length + 1;  /* Whole row, then clear */
+    while (i < to && i < buf.text_length && col < screen_cols) {
         ch = gap_char_at(i);
+        if (IS_LINE_END(ch)) break;
+        
+        /* Reverse video follows the selection */
+        plain = cell_plain(i);
+        if (plain && term_rev) term_cap(TC_REVOFF);
+        if (!plain && !term_rev) term_cap(TC_REVON);
+        
         if (ch == 9) {
-            col = NEXT_TAB(col);
+            target_col = NEXT_TAB(col);
+            while (col < target_col && col < screen_cols) {
+                term_chr(' ');
+                col++;
+            }
+            i++;
+        } else if (ch >= 32 && ch < 127) {
+            /* Chunk of printable characters with the same attribute */
+            chunk_start = i;
+            while (i < to && i < buf.text_length && col < screen_cols) {
+                ch = gap_char_at(i);
+                if (ch < 32 || ch >= 127 || cell_plain(i) != plain) break;
+                col++;
+                i++;
+            }
+            write_gap_block(1, chunk_start, i - chunk_start);
         } else {
+            /* Other control characters take one cell */
+            term_chr(' ');
             col++;
+            i++;
         }
-        i++;
     }
     
-    /* Now row, col are the screen coordinates for from_pos */
-    write_block(1, HIDE_CURSOR, 2);
-    draw_range(from_pos, -1, row, col);
-    
-    /* Recalculate cursor position after drawing (handles tabs, etc.) */
-    fast_curs();
-    
-    write_block(1, SHOW_CURSOR, 2);
+    if (term_rev) term_cap(TC_REVOFF);
+    if (i < to && col < screen_cols) term_cap(TC_CLREOL);
 }
 
-/* Replace fast_from_pos() */
-fast_from_pos(from_pos)  
-int from_pos;
+/* Repaint the damaged text rows and rebuild row_pos[] */
+paint_rows()
 {
-    int row, col, i, vis_start;
-    char ch;
+    int r, p, next, old, need, from, to, i, any;
     
-    /* Find the start of the visual line containing from_pos */
-    vis_start = visln_sta(from_pos);
+    if (rows_top != buf.topscr_pos) {
+        dmg_all();  /* Scrolled, or screen contents unknown */
+    }
     
-    /* Find the screen row where this visual line starts */
-    i = get_top_pos();
-    row = text_start_row;
-    col = 0;
+    any = 0;
+    for (i = 0; i < sizeof(row_bits); i++) {
+        any |= row_bits[i];
+    }
+    rows_drawn = 0;
+    if (!any && dmg_lo < 0) return;
     
-    /* Scan to find screen position of vis_start */
-    while (i < vis_start && i < buf.text_length) {
-        ch = gap_char_at(i);
-        if (IS_LINE_END(ch)) {
-            row++;
-            if (dbl_space) row++;  /* Add spacing between lines */
-            col = 0;
-        } else if (ch == 9) {
-            do {
-                col++;
-                if (col >= screen_cols) {
-                    row++;
-                    if (dbl_space) row++;  /* Add spacing for wrapped lines */
-                    col = 0;
+    term_cap(TC_HIDE);
+    p = buf.topscr_pos;
+    for (r = 0; r < eff_rows; r++) {
+        next = p >= 0 ? row_next(p) : -1;
+        old = row_map(row_pos[r]);
+        
+        need = row_bits[r >> 3] & (1 << (r & 7));
+        from = p;
+        to = -1;
+        if (!need && dmg_lo >= 0) {
+            if (p >= 0 && p < dmg_hi && (next < 0 || next > dmg_lo)) {
+                /* Row overlaps the change - row start unchanged means the
+                   cells before the change are still right, and with a
+                   highlight-only change so are the cells after it */
+                need = 1;
+                if (old == p && dmg_lo > p) from = dmg_lo;
+                if (old == p && dmg_attr) to = dmg_hi;
+            } else if (old != p) {
+                need = 1;  /* Row moved */
+            } else if (p >= 0 && p > dmg_hi) {
+                /* In step with the old screen - done unless a row
+                   further down was marked on its own */
+                for (i = r; i < eff_rows; i++) {
+                    if (row_bits[i >> 3] & (1 << (i & 7))) break;
+                }
+                if (i == eff_rows) {
+                    for (i = r; i <= eff_rows; i++) {
+                        row_pos[i] = row_map(row_pos[i]);
+                    }
                     break;
                 }
-            } while (TAB_MOD(col) != 0);
-        } else {
-            col++;
-            if (col >= screen_cols) {
-                row++;
-                if (dbl_space) row++;  /* Add spacing for wrapped lines */
-                col = 0;
             }
         }
-        i++;
+        
+        if (need) {
+            draw_row(r, p, from, to);
+            rows_drawn++;
+        }
+        row_pos[r] = p;
+        p = next;
     }
+    if (r == eff_rows) row_pos[r] = p;
     
-    /* Now row is correct, calculate column from vis_start to from_pos */
-    col = 0;
-    while (i < from_pos && i < buf.text_length) {
-        ch = gap_char_at(i);
-        if (ch == 9) {
-            col = NEXT_TAB(col);
-        } else {
-            col++;
-        }
-        i++;
+    for (i = 0; i < sizeof(row_bits); i++) {
+        row_bits[i] = 0;
     }
+    dmg_lo = -1;
+    dmg_hi = -1;
+    dmg_delta = 0;
+    dmg_attr = 0;
+    rows_top = buf.topscr_pos;
+    term_cap(TC_SHOW);
+}
+
+/* Repaint the whole text area */
+fast_show()
+{
+    int row;
     
-    write_block(1, HIDE_CURSOR, 2);
-    draw_range(from_pos, -2, row, col);
-    fast_curs();
-    write_block(1, SHOW_CURSOR, 2);
+    rows_top = -1;  /* Nothing on screen can be trusted */
+    paint_rows();
+    
+    /* Blank the rows between text rows (double spacing) and below them */
+    term_cap(TC_HIDE);
+    for (row = text_start_row; row < status_row; row++) {
+        if (row >= PHYS_ROW(eff_rows) ||
+            (dbl_space && (row - text_start_row) % 2 != 0)) {
+            write_pos(0, row);
+            term_cap(TC_CLREOL);
+        }
+    }
+    term_cap(TC_SHOW);
 }
 
 /* Fast cursor positioning - just count to cursor and track position */
@@ -3678,71 +7380,69 @@ fast_curs()
     /* UPDATE GLOBAL VARIABLES */
     log_row = row;
     cursor_col = col;
-    cur_end_col = calc_end_col();
 
     /* Position cursor using calculated coordinates */
-    putchar(0x02);
-    putchar(col + 0x20);
-    putchar(PHYS_ROW(row) + 0x20);
+    write_pos(col, PHYS_ROW(row));
 }
 
 /* Redraw just the title bar - used when dirty flag changes */
 draw_title()
 {
-    int len1, lenf, i, j;
-    char linebuffer[81];
-    char *line;
+    int len1, lenf, used, t;
+    char line[128];
     
     /* Hide cursor and position to row 0, column 0 */
-    write_block(1, HIDE_CURSOR, 2);
-    putchar(0x02);  /* Position cursor command */
-    putchar(0 + 0x20);  /* Column 0 */
-    putchar(0 + 0x20);  /* Row 0 */
+    term_cap(TC_HIDE);
+    write_pos(0, 0);  /* Column 0, row 0 */
+    
+    /* -dbg: slices and time per idle task */
+    if (dbg_ovl) {
+        used = 0;
+        for (t = 0; t < IT_NUM; t++) {
+            sprintf(line + used, " %s %ld/%ldus", it_name[t], it_runs[t], it_us[t]);
+            used += strlen(line + used);
+        }
+        if (tg_tab != NULL) {
+            sprintf(line + used, " %dB", (int)(TG_NHASH * sizeof(unsigned)));
+            used += strlen(line + used);
+        }
+        if (used > screen_cols) used = screen_cols;
+        term_txt(line, used);
+        term_rep(' ', screen_cols - used);
+        term_cap(TC_SHOW);
+        return;
+    }
     
-    line = linebuffer;
     lenf = strlen(fname_ptr);
+    if (lenf > screen_cols - 6) lenf = screen_cols - 6;
     len1 = (screen_cols - lenf) / 2 - 2;
     
-    for (i = 0; i < len1; i++) {
-        line[i] = CH_TOPBL;
-    }
-    
-    line[i] = CH_TOPLTC;
-    i++;
-    line[i] = 32;
-    i++;
-    
-    for (j = 0; j < lenf; j++) {
-        line[i] = fname_ptr[j];
-        i++;
-    }
+    term_rep(CH_TOPBL, len1);
+    term_chr(CH_TOPLTC);
+    term_chr(' ');
+    term_txt(fname_ptr, lenf);
+    used = len1 + 2 + lenf;
     
     /* Add asterisk if file is modified */
     if (buf.dirty) {
-        line[i] = '*';
-        i++;
-    }
-    
-    line[i] = 32;
-    i++;
-    line[i] = CH_TOPRTC;
-    i++;
-    
-    for (; i < 80; i++) {
-        line[i] = CH_TOPBL;
+        term_chr('*');
+        used++;
     }
     
-    /* Write title line */
-    write_block(1, line, 80);
+    term_chr(' ');
+    term_chr(CH_TOPRTC);
+    used += 2;
+    term_rep(CH_TOPBL, screen_cols - used);
     
     /* Restore cursor */
-    write_block(1, SHOW_CURSOR, 2);
+    term_cap(TC_SHOW);
 }
 
 /* Set dirty flag and update title bar if it changed */
 set_dirty(new_value)
 int new_value;
 {
+    if (new_value) as_dirty = 1;
     if (buf.dirty != new_value) {
         buf.dirty = new_value;
         need_title_update = 1;
@@ -3752,68 +7452,7 @@ int new_value;
 /* Fast setup screen */
 fast_scr()
 {
-
-   int len1;
-    int len2;
-    int lenf;
-    char linebuffer[81];
-    char *line;
-    int i;
-    int j;
-      
-  /* Hide cursor */
-    putchar(0x05);
-    putchar(0x20);  
-    putchar(0x01);  /* HOME cursor */
-
-    line = linebuffer;
-    lenf = strlen(fname_ptr);
-    len1 = (screen_cols - lenf) / 2 - 2;
-    
- 
-    for (i=0; i<len1; i++){
-      line[i]= CH_TOPBL;
-    }
-
-    line[i] = CH_TOPLTC;
-    i++;
-    line[i] = 32;
-    i++;
-
-    for (j=0; j<lenf; j++){
-      line[i] = fname_ptr[j];
-      i++;
-    }
-
-    /* Add asterisk if file is modified */
-    if (buf.dirty) {
-      line[i] = '*';
-      i++;
-    }
-
-    line[i] = 32;
-    i++;
-    line[i] = CH_TOPRTC;
-    i++;
-
-    for (; i<80; i++){
-      line[i] = CH_TOPBL;
-    }
-    
-    /* Header line */
-
-    write_block(1,line,80);
-      /*  printf("File: %-20s %s Pos: %d/%d ]", 
-           fname_ptr, 
-           buf.dirty ? "[*]" : "   ",
-           buf.cursor_pos, buf.text_length);*/
-           
-    
-    /* Separator line */
-/*    putchar(0x02);
-    putchar(0 + 0x20);
-    putchar(2 + 0x20);
-    printf("----------------------------------------"); */
+    draw_title();  /* Header line */
     
     fast_show();
     draw_stat();
@@ -3822,112 +7461,6 @@ fast_scr()
 	 putchar(0x21);*/ 
 }
 
-/* Fast minimal update - just redraw from changed position */
-fast_upd(from_pos)
-int from_pos;
-{
-    /* Use efficient single line update with caching */
-    fast_line(from_pos);
-}
-
-/* Fast single character or simple line update - no selection handling needed */
-fast_char_upd(from_pos)
-int from_pos;
-{
-    int row, col, i, chunk_start;
-    char ch;
-    
-    /* Calculate screen position */
-    col = cursor_col;
-    row = log_row;
-    
-    if (from_pos < buf.cursor_pos && (buf.cursor_pos - from_pos) == 1) {
-        col--;
-        if (col < 0) {
-            row--;
-            col = screen_cols - 1;
-        }
-    }
-    
-    write_block(1, HIDE_CURSOR, 2);
-    write_pos(col, PHYS_ROW(row));  /* Convert to physical row */
-    
-    /* Build chunks of regular characters and output them */
-    i = from_pos;
-    while (i < buf.text_length && row < eff_rows) {
-        ch = gap_char_at(i);
-        
-        /* Stop at line ending */
-        if (IS_LINE_END(ch)) break;
-        
-        /* Handle tab - output previous chunk first, then spaces */
-        if (ch == 9) {
-            int target_col = NEXT_TAB(col);
-            while (col < target_col) {
-                putchar(' ');
-                col++;
-                if (col >= screen_cols) {
-                    /* Wrap to next visual line */
-                    row++;
-                    col = 0;
-                    if (row >= eff_rows) break;
-                    write_pos(col, PHYS_ROW(row));  /* Convert to physical row */
-                }
-            }
-            i++;
-        } else if (ch >= 32 && ch < 127) {
-            /* Build chunk of regular characters */
-            chunk_start = i;
-            while (i < buf.text_length) {
-                ch = gap_char_at(i);
-                
-                /* Stop chunk at special characters */
-                if (IS_LINE_END(ch) || ch == 9 || ch < 32 || ch >= 127) break;
-                
-                /* Check if we'd wrap */
-                if (col >= screen_cols) {
-                    /* Output chunk before wrapping */
-                    if (i > chunk_start) {
-                        write_gap_block(1, chunk_start, i - chunk_start);
-                    }
-                    /* Wrap to next visual line */
-                    row++;
-                    col = 0;
-                    if (row >= eff_rows) break;
-                    write_pos(col, PHYS_ROW(row));  /* Convert to physical row */
-                    chunk_start = i;  /* Start new chunk */
-                }
-                
-                col++;
-                i++;
-            }
-            
-            /* Output remaining chunk */
-            if (i > chunk_start && row < status_row) {
-                write_gap_block(1, chunk_start, i - chunk_start);
-            }
-        } else {
-            /* Non-printable - skip */
-            col++;
-            if (col >= screen_cols) {
-                row++;
-                col = 0;
-                if (row >= eff_rows) break;
-                write_pos(col, PHYS_ROW(row));  /* Convert to physical row */
-            }
-            i++;
-        }
-    }
-    
-    /* Clear rest of current line */
-    if (row < status_row) {
-        write_block(1, CLEAR_EOL, 1);
-    }
-    
-    write_pos(cursor_col, PHYS_ROW(log_row));
-    write_block(1, SHOW_CURSOR, 2);
-}
-
 /* Enhanced upd_fast() with auto-scroll coordination */
 upd_fast()
 {
@@ -3935,12 +7468,14 @@ upd_fast()
     int scroll_occurred = 0;
     int lines_to_scroll;
     int new_top_pos;
+    int full;
     
     /* Don't update display while in help mode */
     if (in_help_mode) return;
     
     if (update_in_progress) return;
     update_in_progress = 1;
+    stat_out = 0;
     
     /* Simple visual line scrolling using buffer positions */
     if (log_row < 0) {
@@ -3955,7 +7490,6 @@ upd_fast()
         }
         
         buf.topscr_pos = new_top_pos;
-        need_full_redraw = 1;
         scroll_occurred = 1;
         
         need_status_update = 1;
@@ -3972,49 +7506,38 @@ upd_fast()
         }
         
          buf.topscr_pos = new_top_pos;
-        need_full_redraw = 1;
         scroll_occurred = 1;
         
         need_status_update = 1;
     }
     
-    /* Existing update logic - but scroll check may have set need_full_redraw */
-   if (scroll_occurred) {
-        /* If cursor ended up beyond visible area, force it to bottom of text area */
-        if (log_row >= eff_rows) {
-            log_row = eff_rows - 1;  /* Bottom row of text area */
-        }
-        
-        /* Position cursor at the corrected coordinates */
-        putchar(0x02);
-        putchar(cursor_col + 0x20);
-        putchar(PHYS_ROW(log_row) + 0x20);
+    /* If cursor ended up beyond visible area, force it to bottom of text area */
+    if (scroll_occurred && log_row >= eff_rows) {
+        log_row = eff_rows - 1;
+    }
+    
+    /* Macro playback - damage builds up for the one paint at the end */
+    if (mac_run) {
+        update_in_progress = 0;
+        return;
     }
     
-    /* Existing update logic - but scroll check may have set need_full_redraw */
+    /* A scroll moves rows_top away from topscr_pos, so paint_rows()
+       repaints every row; otherwise only the damaged ones */
+    full = need_full_redraw;
     if (need_full_redraw) {
         fast_scr();
+        full_draws++;
+        rows_drawn = eff_rows;
         need_full_redraw = 0;
         need_status_update = 0;
-        need_minimal_update = 0;
-        update_from_pos = -1;
-        last_cursor_pos = buf.cursor_pos;
-     } else if (need_char_update && update_from_pos >= 0) {
-        /* NEW: Fast character update path */
-        fast_char_upd(update_from_pos);
-        need_char_update = 0;
-        update_from_pos = -1;
-    } else if (need_redraw_down && update_from_pos >= 0) {
-        fast_from_pos(update_from_pos);
-        need_redraw_down = 0;
-        update_from_pos = -1;	
-    } else if (need_minimal_update && update_from_pos >= 0) {
-        fast_upd(update_from_pos);
-        need_minimal_update = 0;
-        update_from_pos = -1;
-    } else if (buf.cursor_pos != last_cursor_pos) {
-        fast_curs();
         last_cursor_pos = buf.cursor_pos;
+    } else {
+        paint_rows();
+        if (rows_drawn > 0 || buf.cursor_pos != last_cursor_pos) {
+            fast_curs();
+            last_cursor_pos = buf.cursor_pos;
+        }
     }
     
     if (need_status_update) {
@@ -4029,10 +7552,30 @@ upd_fast()
         fast_curs();  /* Restore cursor after title draw */
     }
     
+    if (log_fp) {
+        fprintf(log_fp, "rows %d%s stat %ld\n", rows_drawn,
+                full ? " full" : "", stat_out);
+        fflush(log_fp);
+    }
     
     update_in_progress = 0;
 }
 
+/* -log totals: system calls per key and terminal traffic */
+log_sum()
+{
+    int i;
+    
+    if (log_fp == NULL) return;
+    fprintf(log_fp, "keys %ld in_calls %ld in_polls %ld out_calls %ld out_bytes %ld\n",
+            key_count, in_calls, in_polls, out_calls, out_bytes);
+    fprintf(log_fp, "waits %ld late %ld\n", ev_waits, ev_late);
+    for (i = 1; i < CM_NUM; i++) {
+        if (cm_cnt[i]) fprintf(log_fp, "%s %ld\n", cm_name[i], cm_cnt[i]);
+    }
+    fflush(log_fp);
+}
+
 
 
 
@@ -4172,41 +7715,3 @@ int pos;
     
     return last_vis_start;
 }
-
-/* Calculate visual column of end of current line from cursor position */
-
-/* Calculate visual width of a tab at given column position */
-calc_tab_width(col)
-int col;
-{
-    return tab_wdth - TAB_MOD(col);
-}
-
-calc_end_col()
-{
-    int pos, col;
-    char ch;
-    
-    pos = buf.cursor_pos;
-    col = cursor_col;
-    
-    while (pos < buf.text_length) {
-        ch = gap_char_at(pos);
-        if (IS_LINE_END(ch)) break;
-        
-        if (ch == 9) {
-            col = NEXT_TAB(col);
-        } else {
-            col++;
-        }
-        
-        /* Wrap column at screen boundary */
-        if (col >= screen_cols) {
-            col = col - screen_cols;
-        }
-        
-        pos++;
-    }
-    
-    return col;
-}